@@ -0,0 +1,528 @@
+module;
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+module Cache;
+import Cache;
+
+import <string>;
+import <vector>;
+import <cstdint>;
+import <cstring>;
+import <fstream>;
+import <filesystem>;
+import <random>;
+
+import Token;
+import Expr;
+import Stmt;
+import Interpreter;
+import GC;
+
+namespace {
+
+	constexpr char cacheMagic[4] = { 'L', 'O', 'X', 'C' };
+
+	enum class Tag : uint8_t {
+		NONE,
+
+		ASSIGN, BINARY, CALL, GET, GROUPING, LITERAL,
+		LOGICAL, SET, SUPER, THIS, UNARY, VARIABLE,
+
+		BLOCK, CLASS, EXPRESSION, FUNCTION, IF,
+		PRINT, RETURN, VAR, WHILE,
+
+		ARRAY, INDEX, SET_INDEX,
+
+		IMPORT
+	};
+
+	enum class ObjTag : uint8_t {
+		NIL, BOOL, NUMBER, STRING
+	};
+
+	struct CorruptCache {};
+
+	class Writer : public ExprVisitor<void>, public StmtVisitor<void> {
+		std::string& out;
+		const Interpreter& interpreter;
+		std::vector<const Function*>& functions;
+
+		template<class T> void raw(T value) {
+			out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+		}
+
+		inline void tag(Tag t) { raw((uint8_t)t); }
+
+		void str(const std::string& s) {
+			raw((uint32_t)s.size());
+			out.append(s);
+		}
+
+		void object(const Object& obj) {
+			if (obj.isBool()) { raw((uint8_t)ObjTag::BOOL); raw((uint8_t)obj.getBool()); }
+			else if (obj.isDouble()) { raw((uint8_t)ObjTag::NUMBER); raw(obj.getDouble()); }
+			else if (obj.isString()) { raw((uint8_t)ObjTag::STRING); str(obj.getString()); }
+			else raw((uint8_t)ObjTag::NIL); //only literals end up in the tree
+		}
+
+		void token(const Token& t) {
+			raw((uint8_t)t.type);
+			str(t.lexeme);
+			object(t.literal);
+			raw((int32_t)t.line);
+		}
+
+		inline void depth(const Expr* expr) {
+			raw((int32_t)interpreter.depthOf(expr));
+			raw((int32_t)interpreter.slotOf(expr));
+		}
+
+	public:
+		Writer(std::string& out, const Interpreter& interpreter, std::vector<const Function*>& functions)
+			: out{ out }, interpreter{ interpreter }, functions{ functions } {}
+
+		void expr(const Expr* e) {
+			if (!e) return tag(Tag::NONE);
+			e->accept(this);
+		}
+
+		void stmt(const Stmt* s) {
+			if (!s) return tag(Tag::NONE);
+			s->accept(this);
+		}
+
+		void stmts(const std::vector<Stmt*>& list) {
+			raw((uint32_t)list.size());
+			for (const Stmt* s : list) stmt(s);
+		}
+
+		void visitArrayLiteralExpr(const ArrayLiteral* e) override {
+			tag(Tag::ARRAY);
+			token(e->bracket);
+			raw((uint32_t)e->elems.size());
+			for (const Expr* element : e->elems) expr(element);
+		}
+		void visitIndexExpr(const Index* e) override { tag(Tag::INDEX); expr(e->obj); token(e->bracket); expr(e->index); }
+		void visitSetIndexExpr(const SetIndex* e) override { tag(Tag::SET_INDEX); expr(e->obj); token(e->bracket); expr(e->index); expr(e->val); }
+		void visitAssignExpr(const Assign* e) override { tag(Tag::ASSIGN); token(e->id); expr(e->val); depth(e); }
+		void visitBinaryExpr(const Binary* e) override { tag(Tag::BINARY); expr(e->l); token(e->op); expr(e->r); }
+		void visitCallExpr(const Call* e) override {
+			tag(Tag::CALL);
+			expr(e->calleeExpr);
+			token(e->parenthesis);
+			raw((uint32_t)e->args.size());
+			for (const Expr* arg : e->args) expr(arg);
+		}
+		void visitGetExpr(const Get* e) override { tag(Tag::GET); expr(e->obj); token(e->id); }
+		void visitGroupingExpr(const Grouping* e) override { tag(Tag::GROUPING); expr(e->expr); }
+		void visitLiteralExpr(const Literal* e) override { tag(Tag::LITERAL); object(e->val); }
+		void visitLogicalExpr(const Logical* e) override { tag(Tag::LOGICAL); expr(e->l); token(e->op); expr(e->r); }
+		void visitSetExpr(const Set* e) override { tag(Tag::SET); expr(e->obj); token(e->name); expr(e->val); }
+		void visitSuperExpr(const Super* e) override { tag(Tag::SUPER); token(e->keywrd); token(e->meth); depth(e); }
+		void visitThisExpr(const This* e) override { tag(Tag::THIS); token(e->keywrd); depth(e); }
+		void visitUnaryExpr(const Unary* e) override { tag(Tag::UNARY); token(e->op); expr(e->r); }
+		void visitVariableExpr(const Variable* e) override { tag(Tag::VARIABLE); token(e->nam); depth(e); }
+
+		void visitBlockStmt(const Block* s) override { tag(Tag::BLOCK); stmts(s->stmts); }
+		void visitClassStmt(const Class* s) override {
+			tag(Tag::CLASS);
+			token(s->nam);
+			expr(s->super);
+			raw((uint32_t)s->meths.size());
+			for (const Function* method : s->meths) stmt(method);
+		}
+		void visitExpressionStmt(const Expression* s) override { tag(Tag::EXPRESSION); expr(s->expr); }
+		void visitFunctionStmt(Function* s) override {
+			tag(Tag::FUNCTION);
+			functions.push_back(s);
+			token(s->id);
+			raw((uint32_t)s->params.size());
+			for (const Token& param : s->params) token(param);
+			raw((uint8_t)s->changesOutside);
+			raw((uint32_t)s->callsOutside.size());
+			for (const std::string& name : s->callsOutside) str(name);
+			raw((uint32_t)s->creates.size());
+			for (const std::string& name : s->creates) str(name);
+			stmts(s->body);
+		}
+		void visitIfStmt(const If* s) override { tag(Tag::IF); expr(s->cond); stmt(s->th); stmt(s->el); }
+		void visitImportStmt(const Import* s) override { tag(Tag::IMPORT); token(s->keywrd); str(s->path); }
+		void visitPrintStmt(const Print* s) override { tag(Tag::PRINT); expr(s->expr); }
+		void visitReturnStmt(const Return* s) override { tag(Tag::RETURN); token(s->keywrd); expr(s->val); }
+		void visitVarStmt(const Var* s) override { tag(Tag::VAR); token(s->id); expr(s->init); }
+		void visitWhileStmt(const While* s) override { tag(Tag::WHILE); expr(s->cond); stmt(s->body); }
+	};
+
+	class Reader {
+		const char*& cur;
+		const char* const end;
+		Interpreter& interpreter;
+		GC& gc;
+		std::vector<Function*>& functions;
+		const bool ownGlobals;
+
+		//mirrors Resolver::lastFunction, so fns_in_body is rebuilt the same way
+		Function* lastFunction = nullptr;
+
+		template<class T> T raw() {
+			if ((size_t)(end - cur) < sizeof(T)) throw CorruptCache();
+			T value;
+			std::memcpy(&value, cur, sizeof(T));
+			cur += sizeof(T);
+			return value;
+		}
+
+		inline Tag tag() { return (Tag)raw<uint8_t>(); }
+
+		uint32_t count() {
+			uint32_t n = raw<uint32_t>();
+			if (n > (size_t)(end - cur)) throw CorruptCache(); //every element takes at least one byte
+			return n;
+		}
+
+		std::string str() {
+			uint32_t size = count();
+			std::string s(cur, size);
+			cur += size;
+			return s;
+		}
+
+		Object object() {
+			switch ((ObjTag)raw<uint8_t>()) {
+				case ObjTag::NIL: return Object();
+				case ObjTag::BOOL: return Object((bool)raw<uint8_t>());
+				case ObjTag::NUMBER: return Object(raw<double>());
+				case ObjTag::STRING: return Object(str());
+			}
+			throw CorruptCache();
+		}
+
+		Token token() {
+			TokenType type = (TokenType)raw<uint8_t>();
+			if (type > TokenType::Eof) throw CorruptCache();
+			std::string lexeme = str();
+			Object literal = object();
+			Token t = Token(type, lexeme, raw<int32_t>());
+			t.literal = literal;
+			return t;
+		}
+
+		template<class E> E* resolved(E* e, const Token& name) {
+			int32_t depth = raw<int32_t>();
+			int32_t slot = raw<int32_t>();
+			if (depth >= 0) interpreter.resolve(e, depth);
+			else if (slot >= 0) interpreter.resolveSlot(e, slot);
+			else if (ownGlobals) interpreter.resolveGlobal(e, name.lexeme);
+			else interpreter.resolveByName(e);
+			return e;
+		}
+
+		Expr* expr(Tag t) {
+			switch (t) {
+				case Tag::NONE: return nullptr;
+				case Tag::ASSIGN: {
+					Token name = token();
+					Expr* value = expr();
+					return resolved(new Assign(name, value), name);
+				}
+				case Tag::BINARY: {
+					Expr* left = expr();
+					Token op = token();
+					return new Binary(left, op, expr());
+				}
+				case Tag::CALL: {
+					Expr* callee = expr();
+					Token paren = token();
+					std::vector<Expr*> args(count());
+					for (Expr*& arg : args) arg = expr();
+					return new Call(callee, paren, args);
+				}
+				case Tag::GET: {
+					Expr* object = expr();
+					return new Get(object, token());
+				}
+				case Tag::GROUPING: return new Grouping(expr());
+				case Tag::LITERAL: return new Literal(object());
+				case Tag::LOGICAL: {
+					Expr* left = expr();
+					Token op = token();
+					return new Logical(left, op, expr());
+				}
+				case Tag::SET: {
+					Expr* object = expr();
+					Token name = token();
+					return new Set(object, name, expr());
+				}
+				case Tag::SUPER: {
+					Token keyword = token();
+					Token method = token();
+					return resolved(new Super(keyword, method), keyword);
+				}
+				case Tag::THIS: {
+					Token keyword = token();
+					return resolved(new This(keyword), keyword);
+				}
+				case Tag::UNARY: {
+					Token op = token();
+					return new Unary(op, expr());
+				}
+				case Tag::VARIABLE: {
+					Token name = token();
+					return resolved(new Variable(name), name);
+				}
+				case Tag::ARRAY: {
+					Token bracket = token();
+					std::vector<Expr*> elements(count());
+					for (Expr*& element : elements) element = expr();
+					return new ArrayLiteral(bracket, elements);
+				}
+				case Tag::INDEX: {
+					Expr* object = expr();
+					Token bracket = token();
+					return new Index(object, bracket, expr());
+				}
+				case Tag::SET_INDEX: {
+					Expr* object = expr();
+					Token bracket = token();
+					Expr* index = expr();
+					return new SetIndex(object, bracket, index, expr());
+				}
+			}
+			throw CorruptCache();
+		}
+
+		Function* function() {
+			Token name = token();
+			std::vector<Token> params(count(), Token(TokenType::Eof, "", 0));
+			for (Token& param : params) param = token();
+
+			Function* fn = gc.track(new Function(name, params, {}));
+			fn->changesOutside = raw<uint8_t>();
+			fn->callsOutside.resize(count());
+			for (std::string& callee : fn->callsOutside) callee = str();
+			fn->creates.resize(count());
+			for (std::string& creator : fn->creates) creator = str();
+			functions.push_back(fn);
+			if (lastFunction) lastFunction->fns_in_body.push_back(fn);
+			else {
+				gc.pin(fn);
+				pinned.push_back(fn);
+			}
+
+			Function* prevLastFunction = lastFunction;
+			lastFunction = fn;
+			fn->body = stmts();
+			lastFunction = prevLastFunction;
+
+			return fn;
+		}
+
+	public:
+		//top-level functions, which stay pinned for the program's lifetime unless the cache turns out corrupt
+		std::vector<Function*> pinned;
+
+		Reader(const char*& cur, const char* end, Interpreter& interpreter, GC& gc, std::vector<Function*>& functions, bool ownGlobals)
+			: cur{ cur }, end{ end }, interpreter{ interpreter }, gc{ gc }, functions{ functions }, ownGlobals{ ownGlobals } {}
+
+		Expr* expr() { return expr(tag()); }
+
+		Stmt* stmt() {
+			Tag t = tag();
+			switch (t) {
+				case Tag::NONE: return nullptr;
+				case Tag::BLOCK: return new Block(stmts());
+				case Tag::CLASS: {
+					Token name = token();
+					Expr* super = expr();
+					if (super && !dynamic_cast<Variable*>(super)) throw CorruptCache();
+					std::vector<Function*> methods(count());
+					for (Function*& method : methods) {
+						if (tag() != Tag::FUNCTION) throw CorruptCache();
+						method = function();
+					}
+					return new Class(name, (Variable*)super, methods);
+				}
+				case Tag::EXPRESSION: return new Expression(expr());
+				case Tag::FUNCTION: return function();
+				case Tag::IF: {
+					Expr* condition = expr();
+					Stmt* thenBranch = stmt();
+					return new If(condition, thenBranch, stmt());
+				}
+				case Tag::IMPORT: {
+					Token keyword = token();
+					return new Import(keyword, str());
+				}
+				case Tag::PRINT: return new Print(expr());
+				case Tag::RETURN: {
+					Token keyword = token();
+					return new Return(keyword, expr());
+				}
+				case Tag::VAR: {
+					Token name = token();
+					return new Var(name, expr());
+				}
+				case Tag::WHILE: {
+					Expr* condition = expr();
+					return new While(condition, stmt());
+				}
+			}
+			throw CorruptCache();
+		}
+
+		std::vector<Stmt*> stmts() {
+			std::vector<Stmt*> list(count());
+			for (Stmt*& s : list) s = stmt();
+			return list;
+		}
+	};
+}
+
+std::string Cache::interpreterVersion() {
+	//no build stamp, so identical sources give identical binaries; formatVersion carries every layout change
+	return "cpplox " + std::to_string(formatVersion);
+}
+
+std::string Cache::pathFor(const std::string& scriptPath) {
+	if (scriptPath.ends_with(".lox")) return scriptPath + "c";
+	return scriptPath + ".loxc";
+}
+
+uint64_t Cache::hashSource(const std::string& source) {
+	//FNV-1a
+	uint64_t hash = 14695981039346656037ull;
+	for (unsigned char c : source) {
+		hash ^= c;
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+void Cache::encodeProgram(std::string& out, const std::vector<Stmt*>& stmts, const Interpreter& interpreter, std::vector<const Function*>& functions) {
+	Writer(out, interpreter, functions).stmts(stmts);
+}
+
+bool Cache::decodeProgram(const char*& cur, const char* end, std::vector<Stmt*>& stmts, std::vector<Function*>& functions, Interpreter& interpreter, GC& gc,
+	bool ownGlobals) {
+	try {
+		stmts = Reader(cur, end, interpreter, gc, functions, ownGlobals).stmts();
+	}
+	catch (CorruptCache) {
+		stmts.clear();
+		functions.clear();
+		return false;
+	}
+	return true;
+}
+
+void Cache::writeHeader(std::string& out, const char* magic, uint64_t sourceHash) {
+	out.append(magic, 4);
+
+	std::string version = interpreterVersion();
+	uint32_t versionSize = (uint32_t)version.size();
+	out.append((const char*)&versionSize, sizeof versionSize);
+	out.append(version);
+	out.append((const char*)&sourceHash, sizeof sourceHash);
+}
+
+bool Cache::readHeader(const char*& cur, const char* end, const char* magic, uint64_t sourceHash) {
+	std::string version = interpreterVersion();
+	uint32_t versionSize = (uint32_t)version.size();
+	size_t size = 4 + sizeof versionSize + version.size() + sizeof sourceHash;
+
+	if ((size_t)(end - cur) < size) return false;
+	if (std::memcmp(cur, magic, 4) != 0) return false;
+	if (std::memcmp(cur + 4, &versionSize, sizeof versionSize) != 0) return false;
+	if (std::memcmp(cur + 4 + sizeof versionSize, version.data(), version.size()) != 0) return false;
+	if (std::memcmp(cur + 4 + sizeof versionSize + version.size(), &sourceHash, sizeof sourceHash) != 0) return false;
+
+	cur += size;
+	return true;
+}
+
+bool Cache::writeFile(const std::string& path, const std::string& contents) {
+	//write next to the target and rename, so a concurrent run never maps a half-written file
+	std::string tmpPath = path + ".tmp" + std::to_string(std::random_device()());
+	{
+		std::ofstream file{ tmpPath, std::ios::binary | std::ios::trunc };
+		if (!file) return false;
+		file.write(contents.data(), (std::streamsize)contents.size());
+		if (!file) return false;
+	}
+
+	std::error_code ec;
+	std::filesystem::rename(tmpPath, path, ec);
+	if (ec) {
+		std::filesystem::remove(tmpPath, ec);
+		return false;
+	}
+	return true;
+}
+
+bool Cache::store(const std::string& path, uint64_t sourceHash, const std::vector<Stmt*>& stmts, const Interpreter& interpreter) {
+	std::string out;
+	writeHeader(out, cacheMagic, sourceHash);
+
+	std::vector<const Function*> functions;
+	encodeProgram(out, stmts, interpreter, functions);
+
+	return writeFile(path, out);
+}
+
+bool Cache::load(const std::string& path, uint64_t sourceHash, std::vector<Stmt*>& stmts, Interpreter& interpreter, GC& gc) {
+	MappedFile file{ path };
+	if (!file.ok()) return false;
+
+	const char* cur = file.begin();
+	const char* end = file.end();
+	if (!readHeader(cur, end, cacheMagic, sourceHash)) return false;
+
+	std::vector<Function*> functions;
+	return decodeProgram(cur, end, stmts, functions, interpreter, gc) && cur == end;
+}
+
+Cache::MappedFile::MappedFile(const std::string& path) {
+#ifdef _WIN32
+	HANDLE fileHandle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (fileHandle == INVALID_HANDLE_VALUE) return;
+	file = fileHandle;
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(fileHandle, &fileSize) || fileSize.QuadPart == 0) return;
+	mapping = CreateFileMappingA(fileHandle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (!mapping) return;
+	data = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (data) size = (size_t)fileSize.QuadPart;
+#else
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) return;
+	struct stat st;
+	if (fstat(fd, &st) == 0 && st.st_size > 0) {
+		void* mapped = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (mapped != MAP_FAILED) {
+			data = (const char*)mapped;
+			size = (size_t)st.st_size;
+		}
+	}
+	close(fd);
+#endif
+}
+
+Cache::MappedFile::~MappedFile() {
+#ifdef _WIN32
+	if (data) UnmapViewOfFile(data);
+	if (mapping) CloseHandle(mapping);
+	if (file) CloseHandle(file);
+#else
+	if (data) munmap((void*)data, size);
+#endif
+}
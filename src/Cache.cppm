@@ -0,0 +1,68 @@
+export module Cache;
+
+import <string>;
+import <vector>;
+import <cstdint>;
+
+import Stmt;
+import Interpreter;
+import GC;
+
+// Compiled form (.loxc) of a resolved program, so repeated runs of the same
+// script can skip the scanner, the parser and the resolver.
+export namespace Cache {
+
+	// Bumped by hand whenever the AST, the resolution data or the function flags change shape.
+	// It is the only thing tying a cache to the interpreter that wrote it.
+	constexpr uint32_t formatVersion = 6;
+
+	std::string interpreterVersion();
+
+	std::string pathFor(const std::string& scriptPath);
+
+	uint64_t hashSource(const std::string& source);
+
+	// Writes the statements together with the depths the resolver gave them.
+	bool store(const std::string& path, uint64_t sourceHash, const std::vector<Stmt*>& stmts, const Interpreter& interpreter);
+
+	// Fills `stmts` and registers the depths and functions the resolver would have.
+	// Returns false on a missing, stale or corrupt file.
+	bool load(const std::string& path, uint64_t sourceHash, std::vector<Stmt*>& stmts, Interpreter& interpreter, GC& gc);
+
+	// The pieces below are shared with the heap snapshot.
+
+	// Magic, interpreter version and source hash.
+	void writeHeader(std::string& out, const char* magic, uint64_t sourceHash);
+	bool readHeader(const char*& cur, const char* end, const char* magic, uint64_t sourceHash);
+
+	// Replaces the file at `path` with `contents` in one step.
+	bool writeFile(const std::string& path, const std::string& contents);
+
+	// `functions` receives every Function in the order decodeProgram will hand them back.
+	void encodeProgram(std::string& out, const std::vector<Stmt*>& stmts, const Interpreter& interpreter, std::vector<const Function*>& functions);
+
+	// Advances `cur` past the program. Returns false if it is corrupt. Without
+	// `ownGlobals` the program runs against top-level scopes other than the
+	// interpreter's, and looks its globals up by name.
+	bool decodeProgram(const char*& cur, const char* end, std::vector<Stmt*>& stmts, std::vector<Function*>& functions, Interpreter& interpreter, GC& gc,
+		bool ownGlobals = true);
+
+	//read-only view of a whole file, mapped where the platform allows it
+	class MappedFile {
+		const char* data = nullptr;
+		size_t size = 0;
+		void* file = nullptr;
+		void* mapping = nullptr;
+
+	public:
+		MappedFile(const std::string& path);
+		~MappedFile();
+
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+
+		inline const char* begin() const { return data; }
+		inline const char* end() const { return data + size; }
+		inline bool ok() const { return data != nullptr; }
+	};
+}
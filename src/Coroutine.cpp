@@ -0,0 +1,319 @@
+module;
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+//sanitizers need to see stack switches, which they only do through ucontext
+#if defined(__x86_64__) && defined(__ELF__) && !defined(__SANITIZE_ADDRESS__) && !defined(__SANITIZE_THREAD__)
+#define LOX_FIBER_SWITCH
+#else
+#include <ucontext.h>
+#endif
+#ifdef __SANITIZE_ADDRESS__
+#include <sanitizer/common_interface_defs.h>
+#endif
+#endif
+
+module Coroutine;
+import Coroutine;
+
+import <string>;
+import <functional>;
+import <memory>;
+import <exception>;
+import <stdexcept>;
+import <cstdint>;
+import <utility>;
+import <algorithm>;
+
+import Object;
+import Token;
+import Interpreter;
+import GC;
+
+#ifdef _WIN32
+
+struct Fiber::Native {
+	void* fiber = nullptr;
+	void* caller = nullptr;
+
+	static void __stdcall entry(void* fiber) {
+		((Fiber*)fiber)->body();
+	}
+};
+
+Fiber::Fiber(size_t stackSize, std::function<void()> body) : native{ std::make_unique<Native>() }, body{ std::move(body) } {
+	native->fiber = CreateFiberEx(64 * 1024, stackSize, FIBER_FLAG_FLOAT_SWITCH, Native::entry, this);
+	if (!native->fiber) throw std::runtime_error("Could not create a coroutine stack.");
+}
+
+Fiber::~Fiber() {
+	DeleteFiber(native->fiber);
+}
+
+void Fiber::resume() {
+	//a thread has to be a fiber itself to switch to one, and stays one
+	if (!IsThreadAFiber()) ConvertThreadToFiberEx(nullptr, FIBER_FLAG_FLOAT_SWITCH);
+	native->caller = GetCurrentFiber();
+	SwitchToFiber(native->fiber);
+}
+
+void Fiber::suspend() {
+	SwitchToFiber(native->caller);
+}
+
+#else
+
+namespace {
+	// The stack and a guard page below it, so overflowing faults instead of
+	// writing over the heap. Pages are only backed once they are touched.
+	struct FiberStack {
+		char* base = nullptr;
+		size_t size = 0;
+
+		FiberStack(size_t stackSize) {
+			size_t page = (size_t)sysconf(_SC_PAGESIZE);
+			size = (stackSize + page - 1) / page * page + page;
+			int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_NORESERVE
+			flags |= MAP_NORESERVE;
+#endif
+			void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+			if (memory == MAP_FAILED) throw std::runtime_error("Could not create a coroutine stack.");
+			base = (char*)memory;
+			mprotect(base, page, PROT_NONE);
+		}
+
+		~FiberStack() {
+			munmap(base, size);
+		}
+
+		char* top() const { return base + size; }
+	};
+}
+
+#ifdef LOX_FIBER_SWITCH
+
+// Saves the callee-saved registers and the floating point control words on
+// the current stack, stores the stack pointer in *from and restores the same
+// from `to`. A new fiber's stack starts out as if it had switched away just
+// before lox_fiber_start, which calls r13 with r12 as its argument.
+extern "C" void lox_fiber_switch(void** from, void* to);
+extern "C" void lox_fiber_start();
+
+asm(R"(
+	.text
+	.globl lox_fiber_switch
+	.type lox_fiber_switch, @function
+lox_fiber_switch:
+	pushq %rbp
+	pushq %rbx
+	pushq %r12
+	pushq %r13
+	pushq %r14
+	pushq %r15
+	subq $8, %rsp
+	stmxcsr (%rsp)
+	fnstcw 4(%rsp)
+	movq %rsp, (%rdi)
+	movq %rsi, %rsp
+	ldmxcsr (%rsp)
+	fldcw 4(%rsp)
+	addq $8, %rsp
+	popq %r15
+	popq %r14
+	popq %r13
+	popq %r12
+	popq %rbx
+	popq %rbp
+	ret
+	.size lox_fiber_switch, .-lox_fiber_switch
+
+	.globl lox_fiber_start
+	.type lox_fiber_start, @function
+lox_fiber_start:
+	movq %r12, %rdi
+	callq *%r13
+	ud2
+	.size lox_fiber_start, .-lox_fiber_start
+)");
+
+struct Fiber::Native {
+	FiberStack stack;
+	void* sp = nullptr;
+	void* caller = nullptr;
+
+	Native(size_t stackSize) : stack{ stackSize } { }
+
+	static void entry(Fiber* fiber) {
+		fiber->body();
+	}
+};
+
+Fiber::Fiber(size_t stackSize, std::function<void()> body) : native{ std::make_unique<Native>(stackSize) }, body{ std::move(body) } {
+	//control words, r15, r14, r13, r12, rbx, rbp and the return address, as lox_fiber_switch pops them
+	uint64_t* frame = (uint64_t*)((uintptr_t)native->stack.top() & ~(uintptr_t)15) - 10;
+	frame[0] = 0x1F80 | ((uint64_t)0x037F << 32);
+	frame[1] = frame[2] = 0;
+	frame[3] = (uint64_t)&Native::entry;
+	frame[4] = (uint64_t)this;
+	frame[5] = frame[6] = 0;
+	frame[7] = (uint64_t)&lox_fiber_start;
+	native->sp = frame;
+}
+
+Fiber::~Fiber() = default;
+
+void Fiber::resume() {
+	lox_fiber_switch(&native->caller, native->sp);
+}
+
+void Fiber::suspend() {
+	lox_fiber_switch(&native->sp, native->caller);
+}
+
+#else
+
+// AddressSanitizer is told about every switch, or it takes the other stack for an overflow.
+#ifdef __SANITIZE_ADDRESS__
+static void startSwitch(void** fakeStack, const void* bottom, size_t size) { __sanitizer_start_switch_fiber(fakeStack, bottom, size); }
+static void finishSwitch(void* fakeStack, const void** bottom, size_t* size) { __sanitizer_finish_switch_fiber(fakeStack, bottom, size); }
+#else
+static void startSwitch(void**, const void*, size_t) { }
+static void finishSwitch(void*, const void**, size_t*) { }
+#endif
+
+struct Fiber::Native {
+	FiberStack stack;
+	ucontext_t context;
+	ucontext_t caller;
+	const void* callerBottom = nullptr;
+	size_t callerSize = 0;
+	void* fakeStack = nullptr;
+
+	Native(size_t stackSize) : stack{ stackSize } { }
+
+	//makecontext only passes ints
+	static void entry(unsigned high, unsigned low) {
+		Fiber* fiber = (Fiber*)(((uintptr_t)high << 32) | low);
+		finishSwitch(nullptr, &fiber->native->callerBottom, &fiber->native->callerSize);
+		fiber->body();
+	}
+};
+
+Fiber::Fiber(size_t stackSize, std::function<void()> body) : native{ std::make_unique<Native>(stackSize) }, body{ std::move(body) } {
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	getcontext(&native->context);
+	native->context.uc_stack.ss_sp = native->stack.base + page;
+	native->context.uc_stack.ss_size = native->stack.size - page;
+	native->context.uc_link = nullptr;
+	uintptr_t self = (uintptr_t)this;
+	makecontext(&native->context, (void (*)())Native::entry, 2, (unsigned)(self >> 32), (unsigned)self);
+}
+
+Fiber::~Fiber() = default;
+
+void Fiber::resume() {
+	void* fakeStack = nullptr;
+	startSwitch(&fakeStack, native->context.uc_stack.ss_sp, native->context.uc_stack.ss_size);
+	swapcontext(&native->caller, &native->context);
+	finishSwitch(fakeStack, nullptr, nullptr);
+}
+
+void Fiber::suspend() {
+	startSwitch(&native->fakeStack, native->callerBottom, native->callerSize);
+	swapcontext(&native->context, &native->caller);
+	finishSwitch(native->fakeStack, &native->callerBottom, &native->callerSize);
+}
+
+#endif
+#endif
+
+namespace {
+	// Unwinds a coroutine that is destroyed while suspended.
+	struct Killed {};
+}
+
+LoxCoroutine::LoxCoroutine(Interpreter& interpreter, Object fn)
+	: interpreter{ interpreter }, fn{ fn }, saved{ interpreter.newState(depthLimit()) } {
+	//while it runs, the GC finds it at the bottom of the stack and through it the resumer's state
+	saved.stack.push_back(Object((LoxCallable*)this));
+}
+
+LoxCoroutine::~LoxCoroutine() {
+	//its native frames hold nothing but guards that put the interpreter's state back
+	if (state == State::SUSPENDED) {
+		killed = true;
+		switchIn();
+	}
+}
+
+size_t LoxCoroutine::depthLimit() const {
+	return std::min(maxDepth, interpreter.maxDepth);
+}
+
+int LoxCoroutine::arity() const {
+	return 0;
+}
+
+Object LoxCoroutine::call(Interpreter& interpreter, CallParams arguments) {
+	if (waiting) throw NativeError("Coroutine is waiting for I/O.");
+	return resume(Object());
+}
+
+Object LoxCoroutine::resume(Object value) {
+	if (state == State::RUNNING) throw NativeError("Coroutine is already running.");
+	if (state == State::FINISHED) throw NativeError("Coroutine has finished.");
+
+	if (!fiber) {
+		fiber = std::make_unique<Fiber>(Interpreter::nativeStackFor(depthLimit()), [this] { run(); });
+	}
+	transfer = value;
+	switchIn();
+
+	if (error) std::rethrow_exception(std::exchange(error, nullptr));
+	return std::exchange(transfer, Object());
+}
+
+void LoxCoroutine::switchIn() {
+	LoxCoroutine* resumer = interpreter.coroutine;
+	interpreter.coroutine = this;
+	state = State::RUNNING;
+
+	interpreter.swapState(saved);
+	fiber->resume();
+	interpreter.swapState(saved);
+
+	interpreter.coroutine = resumer;
+}
+
+Object LoxCoroutine::yield(Object value) {
+	transfer = value;
+	state = State::SUSPENDED;
+	fiber->suspend();
+
+	if (killed) throw Killed{};
+	return std::exchange(transfer, Object());
+}
+
+void LoxCoroutine::run() {
+	static const Token at = Token(TokenType::IDENTIFIER, "coroutine", 0);
+	transfer = Object();
+	try {
+		transfer = interpreter.call(at, fn, {});
+	}
+	catch (...) {
+		error = std::current_exception();
+	}
+
+	state = State::FINISHED;
+	fiber->suspend();
+}
+
+std::string LoxCoroutine::toString() const {
+	return "<coroutine>";
+}
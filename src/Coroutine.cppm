@@ -0,0 +1,80 @@
+export module Coroutine;
+
+import <string>;
+import <functional>;
+import <memory>;
+import <exception>;
+
+import Object;
+import Token;
+import Interpreter;
+
+// A body that runs on a stack of its own and can stop partway through to
+// return to whoever resumed it. Switching saves a few registers and nothing
+// else, so it costs far less than a thread switch.
+export class Fiber {
+	struct Native;
+	std::unique_ptr<Native> native;
+	std::function<void()> body;
+
+public:
+	Fiber(size_t stackSize, std::function<void()> body);
+	~Fiber();
+
+	Fiber(const Fiber&) = delete;
+	Fiber& operator=(const Fiber&) = delete;
+
+	// Starts the body, or carries on from where it last suspended.
+	void resume();
+
+	// Only called by the body. Returns to the caller of resume.
+	void suspend();
+};
+
+// A Lox function running as a coroutine. Each call resumes it until the
+// function calls yield(value), which that call then returns, and the call
+// after the function has returned gets its return value.
+export class LoxCoroutine : public LoxCallable {
+public:
+	enum class State { READY, RUNNING, SUSPENDED, FINISHED };
+
+	// How deep calls may nest inside a coroutine, unless --max-depth is lower.
+	// Its native stack is sized for this, so thousands of coroutines stay cheap.
+	static constexpr size_t maxDepth = 1000;
+
+	Interpreter& interpreter;
+	const Object fn;
+	State state = State::READY;
+
+	// The coroutine's own stacks while it is suspended, and its resumer's while it runs.
+	ExecutionState saved;
+
+	// The value passing between the coroutine and its resumer.
+	Object transfer;
+
+	// Set while the coroutine waits on the event loop, which alone may resume it then.
+	bool waiting = false;
+
+	LoxCoroutine(Interpreter& interpreter, Object fn);
+	~LoxCoroutine();
+
+	// Suspends the running coroutine, which must be this one. Returns the
+	// value it is resumed with.
+	Object yield(Object value);
+
+	// Runs it up to its next yield, which returns `value` inside it.
+	Object resume(Object value);
+
+	int arity() const override;
+	Object call(Interpreter& interpreter, CallParams arguments) override;
+	std::string toString() const override;
+
+private:
+	std::unique_ptr<Fiber> fiber;
+	std::exception_ptr error;
+	bool killed = false;
+
+	size_t depthLimit() const;
+	void run();
+	void switchIn();
+};
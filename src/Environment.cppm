@@ -6,19 +6,25 @@ import <string>;
 import <iostream>;
 import <memory>;
 
+import Memory;
 import Object;
 import Token;
 import Error;
+import Stats;
 
 export class Environment {
 public:
-	std::unordered_map <std::string, Object> values;
+	CountedMap<std::string, Object> values;
 	Environment* enclosing;
 	bool isTopLevel = false;
 
 	Environment() : enclosing{ nullptr } { }
+	Environment(std::shared_ptr<Budget> budget) : values{ Counted<std::pair<const std::string, Object>>(std::move(budget)) }, enclosing{ nullptr } { }
+
+	// Counts against the budget of the scope it is nested in.
 	Environment(Environment* enclosing, bool isTopLevel = false)
-		: enclosing{ enclosing }, isTopLevel{ isTopLevel } { }
+		: values{ enclosing ? enclosing->values.get_allocator() : Counted<std::pair<const std::string, Object>>() },
+		  enclosing{ enclosing }, isTopLevel{ isTopLevel } { }
 	~Environment() {
 		values.clear();
 	}
@@ -27,6 +33,7 @@ public:
 	Environment(Environment&&) = delete;
 
 	Environment* ancestor(int distance) {
+		Stats::count<Stats::Counter::HOPS>(distance);
 		Environment* environment = this;
 		for (int i = 0; i < distance; i++) {
 			environment = environment->enclosing;
@@ -35,49 +42,54 @@ public:
 		return environment;
 	}
 
-	inline void define(std::string name, Object value) {
-		if (values.contains(name)) values.erase(name);
-		values[name] = value;
+	// Values are overwritten in place, so pointers to them stay valid as long
+	// as the Environment does.
+	inline void define(const std::string& name, Object value) {
+		values.insert_or_assign(name, value);
 	}
 
-	Object get(Token name) {
-		if (values.contains(name.lexeme)) {
-			return values[name.lexeme];
-		}
+	// The variable `name` refers to from this scope, or nullptr.
+	Object* find(const std::string& name) {
+		Environment* scope;
+		return find(name, scope);
+	}
 
-		if (enclosing) return enclosing->get(name);
+	// Also sets `scope` to the one the variable was found in.
+	Object* find(const std::string& name, Environment*& scope) {
+		Stats::count<Stats::Counter::LOOKUPS>();
+		for (scope = this; scope; scope = scope->enclosing) {
+			if (auto found = scope->values.find(name); found != scope->values.end()) return &found->second;
+			Stats::count<Stats::Counter::HOPS>();
+		}
+		return nullptr;
+	}
 
+	Object get(const Token& name) {
+		if (Object* value = find(name.lexeme)) return *value;
 		throw Error::RuntimeError(name, "Undefined variable '" + name.lexeme + "'.");
 	}
 
-	Object getAt(int distance, std::string name) {
+	Object getAt(int distance, const std::string& name) {
+		Stats::count<Stats::Counter::LOOKUPS>();
 		Environment* theEnv = ancestor(distance);
 		return theEnv->values.at(name);
 	}
 
-	void assign(Token name, Object value) {
-
-		if (auto found = values.find(name.lexeme); found != values.end()) {
-			values.erase(found);
-			values[name.lexeme] = value;
-			return;
-		}
-
-		if (enclosing) {
-			enclosing->assign(name, value);
+	void assign(const Token& name, Object value) {
+		if (Object* variable = find(name.lexeme)) {
+			*variable = value;
 			return;
 		}
 
 		throw Error::RuntimeError(name, "Undefined variable '" + name.lexeme + "'.");
 	}
 
-	void assignAt(int distance, Token name, Object value) {
+	void assignAt(int distance, const Token& name, Object value) {
+		Stats::count<Stats::Counter::LOOKUPS>();
 		Environment* theEnv = ancestor(distance);
 
 		if (auto found = theEnv->values.find(name.lexeme); found != theEnv->values.end()) {
-			theEnv->values.erase(found);
-			theEnv->values[name.lexeme] = value;
-			return;
+			found->second = value;
 		}
 	}
 
@@ -15,29 +15,38 @@ export namespace Error {
 		RuntimeError(Token token, std::string message) : message {message}, token{token} { }
 	};
 
-	bool hadError = false;
-	bool hadRuntimeError = false;
-
-	void report(int line, std::string where, std::string message) {
-		std::cerr << "[line " << line << "] Error" << where << ": " << message << '\n';
-		hadError = true;
-	}
-
-	void error(int line, std::string message) {
-		report(line, "", message);
-	}
+	// Error state of one interpreter instance.
+	class Reporter {
+	public:
+		std::ostream& err;
+		bool hadError = false;
+		bool hadRuntimeError = false;
+		// Set when printed output couldn't be written out.
+		bool hadOutputError = false;
+
+		Reporter(std::ostream& err = std::cerr) : err{ err } { }
+
+		void report(int line, std::string where, std::string message) {
+			err << "[line " << line << "] Error" << where << ": " << message << '\n';
+			hadError = true;
+		}
 
-	void error(Token token, std::string message) {
-		if (token.type == TokenType::Eof) {
-			report(token.line, " at end", message);
+		void error(int line, std::string message) {
+			report(line, "", message);
 		}
-		else {
-			report(token.line, " at '" + token.lexeme + "'", message);
+
+		void error(Token token, std::string message) {
+			if (token.type == TokenType::Eof) {
+				report(token.line, " at end", message);
+			}
+			else {
+				report(token.line, " at '" + token.lexeme + "'", message);
+			}
 		}
-	}
 
-	void runtimeError(RuntimeError error) {
-		std::cerr << error.message << "\n[line " << error.token.line << "]\n";
-		hadRuntimeError = true;
-	}
+		void runtimeError(RuntimeError error) {
+			err << error.message << "\n[line " << error.token.line << "]\n";
+			hadRuntimeError = true;
+		}
+	};
 }
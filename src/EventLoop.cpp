@@ -0,0 +1,453 @@
+module;
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
+#endif
+
+module EventLoop;
+import EventLoop;
+
+import <string>;
+import <string_view>;
+import <vector>;
+import <deque>;
+import <unordered_map>;
+import <unordered_set>;
+import <memory>;
+import <cstring>;
+import <stdexcept>;
+import <utility>;
+
+import Object;
+import Token;
+import Interpreter;
+import Coroutine;
+import GC;
+
+namespace {
+	enum class Io { DONE, AGAIN, FAILED };
+
+#ifdef _WIN32
+	Io readSome(int fd, char* buffer, size_t size, size_t& count) {
+		int n = _read(fd, buffer, (unsigned)size);
+		if (n < 0) return Io::FAILED;
+		count = (size_t)n;
+		return Io::DONE;
+	}
+
+	Io writeSome(int fd, const char* data, size_t size, size_t& count) {
+		int n = _write(fd, data, (unsigned)size);
+		if (n < 0) return Io::FAILED;
+		count = (size_t)n;
+		return Io::DONE;
+	}
+
+	Io acceptOne(int, int&) {
+		return Io::FAILED;
+	}
+#else
+	bool wouldBlock() {
+		return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+	}
+
+	int nonBlocking(int fd) {
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
+		return fd;
+	}
+
+	Io readSome(int fd, char* buffer, size_t size, size_t& count) {
+		ssize_t n = ::read(fd, buffer, size);
+		if (n < 0) return wouldBlock() ? Io::AGAIN : Io::FAILED;
+		count = (size_t)n;
+		return Io::DONE;
+	}
+
+	Io writeSome(int fd, const char* data, size_t size, size_t& count) {
+		ssize_t n = ::write(fd, data, size);
+		if (n < 0) return wouldBlock() ? Io::AGAIN : Io::FAILED;
+		count = (size_t)n;
+		return Io::DONE;
+	}
+
+	Io acceptOne(int fd, int& client) {
+		client = ::accept(fd, nullptr, nullptr);
+		if (client < 0) return wouldBlock() || errno == ECONNABORTED ? Io::AGAIN : Io::FAILED;
+		nonBlocking(client);
+		return Io::DONE;
+	}
+
+	sockaddr_un socketAddress(const std::string& path) {
+		sockaddr_un address{};
+		address.sun_family = AF_UNIX;
+		if (path.size() >= sizeof(address.sun_path)) throw NativeError("Socket path is too long.");
+		std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+		return address;
+	}
+#endif
+}
+
+// Tells which watched descriptors can make progress.
+struct EventLoop::Poller {
+	struct Ready {
+		int fd;
+		bool readable;
+		bool writable;
+	};
+
+#if defined(_WIN32)
+	//CRT descriptors have no readiness to wait on, so they always count as
+	//ready and their operations block
+	std::unordered_map<int, std::pair<bool, bool>> watched;
+
+	void watch(int fd, bool in, bool out) {
+		if (in || out) watched[fd] = { in, out };
+		else watched.erase(fd);
+	}
+
+	void wait(std::vector<Ready>& ready) {
+		for (const auto& [fd, directions] : watched) {
+			ready.push_back({ fd, directions.first, directions.second });
+		}
+	}
+#elif defined(__linux__)
+	int epoll;
+	std::unordered_map<int, uint32_t> watched;
+	//regular files, which epoll refuses because they never block
+	std::unordered_map<int, std::pair<bool, bool>> always;
+
+	Poller() : epoll{ epoll_create1(EPOLL_CLOEXEC) } {
+		if (epoll < 0) throw std::runtime_error("Could not create an event loop.");
+	}
+
+	~Poller() {
+		::close(epoll);
+	}
+
+	void watch(int fd, bool in, bool out) {
+		uint32_t events = (in ? EPOLLIN : 0) | (out ? EPOLLOUT : 0);
+		if (auto found = always.find(fd); found != always.end()) {
+			if (events) found->second = { in, out };
+			else always.erase(found);
+			return;
+		}
+
+		auto found = watched.find(fd);
+		if (!events) {
+			if (found == watched.end()) return;
+			epoll_ctl(epoll, EPOLL_CTL_DEL, fd, nullptr);
+			watched.erase(found);
+			return;
+		}
+
+		epoll_event event{};
+		event.events = events;
+		event.data.fd = fd;
+		if (found != watched.end()) {
+			if (found->second == events) return;
+			epoll_ctl(epoll, EPOLL_CTL_MOD, fd, &event);
+			found->second = events;
+		}
+		else if (epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &event) == 0) watched[fd] = events;
+		else if (errno == EPERM) always[fd] = { in, out };
+		else throw NativeError("Can't wait on descriptor " + std::to_string(fd) + ".");
+	}
+
+	void wait(std::vector<Ready>& ready) {
+		for (const auto& [fd, directions] : always) {
+			ready.push_back({ fd, directions.first, directions.second });
+		}
+
+		epoll_event events[64];
+		int count;
+		do count = epoll_wait(epoll, events, 64, ready.empty() ? -1 : 0);
+		while (count < 0 && errno == EINTR);
+
+		//a hangup or an error shows up as the read or write that reports it
+		for (int i = 0; i < count; i++) {
+			uint32_t happened = events[i].events;
+			ready.push_back({ events[i].data.fd, (happened & (EPOLLIN | EPOLLHUP | EPOLLERR)) != 0, (happened & (EPOLLOUT | EPOLLHUP | EPOLLERR)) != 0 });
+		}
+	}
+#else
+	std::unordered_map<int, short> watched;
+
+	void watch(int fd, bool in, bool out) {
+		short events = (in ? POLLIN : 0) | (out ? POLLOUT : 0);
+		if (events) watched[fd] = events;
+		else watched.erase(fd);
+	}
+
+	void wait(std::vector<Ready>& ready) {
+		std::vector<pollfd> fds;
+		for (const auto& [fd, events] : watched) {
+			fds.push_back({ fd, events, 0 });
+		}
+
+		int count;
+		do count = poll(fds.data(), (nfds_t)fds.size(), -1);
+		while (count < 0 && errno == EINTR);
+
+		for (const pollfd& fd : fds) {
+			if (!fd.revents) continue;
+			ready.push_back({ fd.fd, (fd.revents & (POLLIN | POLLHUP | POLLERR)) != 0, (fd.revents & (POLLOUT | POLLHUP | POLLERR)) != 0 });
+		}
+	}
+#endif
+};
+
+EventLoop::EventLoop(Interpreter& interpreter) : interpreter{ interpreter }, poller{ std::make_unique<Poller>() } {
+#ifndef _WIN32
+	//writing to a pipe whose reader is gone should fail the write, not end the process
+	signal(SIGPIPE, SIG_IGN);
+#endif
+}
+
+EventLoop::~EventLoop() {
+	//the heap is gone by now, so the callbacks are only dropped
+	for (int fd : owned) {
+		poller->watch(fd, false, false);
+#ifdef _WIN32
+		_close(fd);
+#else
+		::close(fd);
+#endif
+	}
+}
+
+int EventLoop::open(const std::string& path, const std::string& mode) {
+#ifdef _WIN32
+	int flags = _O_BINARY;
+	if (mode == "r") flags |= _O_RDONLY;
+	else if (mode == "w") flags |= _O_WRONLY | _O_CREAT | _O_TRUNC;
+	else if (mode == "a") flags |= _O_WRONLY | _O_CREAT | _O_APPEND;
+	else throw NativeError("Mode must be \"r\", \"w\" or \"a\".");
+	int fd = _open(path.c_str(), flags, _S_IREAD | _S_IWRITE);
+#else
+	int flags = O_NONBLOCK | O_CLOEXEC;
+	if (mode == "r") flags |= O_RDONLY;
+	else if (mode == "w") flags |= O_WRONLY | O_CREAT | O_TRUNC;
+	else if (mode == "a") flags |= O_WRONLY | O_CREAT | O_APPEND;
+	else throw NativeError("Mode must be \"r\", \"w\" or \"a\".");
+	int fd = ::open(path.c_str(), flags, 0644);
+#endif
+	if (fd < 0) throw NativeError("Could not open '" + path + "'.");
+	owned.insert(fd);
+	return fd;
+}
+
+std::vector<int> EventLoop::pipe() {
+	int fds[2];
+#ifdef _WIN32
+	if (_pipe(fds, 64 * 1024, _O_BINARY) != 0) throw NativeError("Could not create a pipe.");
+#else
+	if (::pipe(fds) != 0) throw NativeError("Could not create a pipe.");
+	nonBlocking(fds[0]);
+	nonBlocking(fds[1]);
+#endif
+	owned.insert(fds[0]);
+	owned.insert(fds[1]);
+	return { fds[0], fds[1] };
+}
+
+int EventLoop::listen(const std::string& path) {
+#ifdef _WIN32
+	throw NativeError("Unix sockets are not supported on this platform.");
+#else
+	sockaddr_un address = socketAddress(path);
+
+	//a socket left behind by an earlier run would make bind fail
+	struct stat info;
+	if (stat(path.c_str(), &info) == 0 && S_ISSOCK(info.st_mode)) unlink(path.c_str());
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) throw NativeError("Could not create a socket.");
+	if (bind(fd, (sockaddr*)&address, sizeof(address)) != 0 || ::listen(fd, SOMAXCONN) != 0) {
+		::close(fd);
+		throw NativeError("Could not listen on '" + path + "'.");
+	}
+	owned.insert(nonBlocking(fd));
+	return fd;
+#endif
+}
+
+int EventLoop::connect(const std::string& path) {
+#ifdef _WIN32
+	throw NativeError("Unix sockets are not supported on this platform.");
+#else
+	sockaddr_un address = socketAddress(path);
+
+	//connecting a local socket doesn't wait on the other side, so it can block
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) throw NativeError("Could not create a socket.");
+	if (::connect(fd, (sockaddr*)&address, sizeof(address)) != 0) {
+		::close(fd);
+		throw NativeError("Could not connect to '" + path + "'.");
+	}
+	owned.insert(nonBlocking(fd));
+	return fd;
+#endif
+}
+
+void EventLoop::close(int fd) {
+	if (queues.count(fd)) throw NativeError("Descriptor " + std::to_string(fd) + " has operations pending.");
+
+	poller->watch(fd, false, false);
+	owned.erase(fd);
+#ifdef _WIN32
+	int failed = _close(fd);
+#else
+	int failed = ::close(fd);
+#endif
+	if (failed) throw NativeError("Could not close descriptor " + std::to_string(fd) + ".");
+}
+
+void EventLoop::submit(int fd, Pending operation) {
+	//the loop holds them until they are done
+	if (operation.callback.isPointer()) interpreter.gc.pin(operation.callback.getPointer());
+	if (operation.waiter) interpreter.gc.pin(operation.waiter);
+
+	Queues& queue = queues[fd];
+	std::deque<Pending>& waiting = operation.op == Op::WRITE ? queue.writes : queue.reads;
+	waiting.push_back(std::move(operation));
+	pending++;
+	try {
+		watch(fd);
+	}
+	catch (...) {
+		//a descriptor the poller refuses would leave run() waiting on nothing
+		release(waiting.back());
+		waiting.pop_back();
+		pending--;
+		if (queue.reads.empty() && queue.writes.empty()) queues.erase(fd);
+		throw;
+	}
+}
+
+void EventLoop::watch(int fd) {
+	auto found = queues.find(fd);
+	if (found == queues.end()) return;
+
+	const Queues& queue = found->second;
+	poller->watch(fd, !queue.reads.empty(), !queue.writes.empty());
+	if (queue.reads.empty() && queue.writes.empty()) queues.erase(found);
+}
+
+bool EventLoop::perform(int fd, Pending& operation, Object& result) {
+	switch (operation.op) {
+	case Op::READ: {
+		char buffer[64 * 1024];
+		size_t count = 0;
+		Io io = readSome(fd, buffer, sizeof(buffer), count);
+		if (io == Io::AGAIN) return false;
+		if (io == Io::FAILED) throw NativeError("Could not read from descriptor " + std::to_string(fd) + ".");
+
+		//nil marks the end of the input
+		if (count > 0) result = Object(std::string(buffer, count));
+		return true;
+	}
+	case Op::WRITE: {
+		std::string_view text = operation.text.getStringView();
+		while (operation.written < text.size()) {
+			size_t count = 0;
+			Io io = writeSome(fd, text.data() + operation.written, text.size() - operation.written, count);
+			if (io == Io::AGAIN) return false;
+			if (io == Io::FAILED) throw NativeError("Could not write to descriptor " + std::to_string(fd) + ".");
+			operation.written += count;
+		}
+		result = Object((double)operation.written);
+		return true;
+	}
+	case Op::ACCEPT: {
+		int client;
+		Io io = acceptOne(fd, client);
+		if (io == Io::AGAIN) return false;
+		if (io == Io::FAILED) throw NativeError("Could not accept on descriptor " + std::to_string(fd) + ".");
+		owned.insert(client);
+		result = Object((double)client);
+		return true;
+	}
+	}
+	return false;
+}
+
+void EventLoop::release(Pending& operation) {
+	if (operation.callback.isPointer()) interpreter.gc.unpin(operation.callback.getPointer());
+	if (operation.waiter) {
+		interpreter.gc.unpin(operation.waiter);
+		operation.waiter->waiting = false;
+	}
+}
+
+void EventLoop::deliver(const Token& at, Pending& operation, Object result) {
+	//a coroutine finds itself on its own stack and a callback is on the caller's once called
+	release(operation);
+	if (operation.waiter) operation.waiter->resume(result);
+	else interpreter.call(at, operation.callback, CallParams{ &result, 1 });
+}
+
+EventLoop::Pending EventLoop::finish(int fd, std::deque<Pending>& queue) {
+	Pending operation = std::move(queue.front());
+	queue.pop_front();
+	pending--;
+	watch(fd);
+	return operation;
+}
+
+void EventLoop::step(const Token& at, int fd, bool writing) {
+	//a callback may have closed it or finished its operations since it was polled
+	auto found = queues.find(fd);
+	if (found == queues.end()) return;
+	std::deque<Pending>& queue = writing ? found->second.writes : found->second.reads;
+	if (queue.empty()) return;
+
+	Object result;
+	bool done;
+	try {
+		done = perform(fd, queue.front(), result);
+	}
+	catch (NativeError&) {
+		//a failed operation is dropped, and a coroutine waiting on it stays suspended
+		Pending failed = finish(fd, queue);
+		release(failed);
+		throw;
+	}
+	if (!done) return;
+
+	Pending operation = finish(fd, queue);
+	deliver(at, operation, result);
+}
+
+void EventLoop::run(const Token& at) {
+	if (running) throw NativeError("The event loop is already running.");
+	running = true;
+	struct Stop {
+		bool& running;
+		~Stop() { running = false; }
+	} stop{ running };
+
+	std::vector<Poller::Ready> ready;
+	while (pending > 0) {
+		ready.clear();
+		poller->wait(ready);
+		for (const Poller::Ready& event : ready) {
+			if (event.readable) step(at, event.fd, false);
+			if (event.writable) step(at, event.fd, true);
+		}
+	}
+}
@@ -0,0 +1,84 @@
+export module EventLoop;
+
+import <string>;
+import <vector>;
+import <deque>;
+import <unordered_map>;
+import <unordered_set>;
+import <memory>;
+
+import Object;
+import Token;
+import Interpreter;
+import Coroutine;
+
+// Reads and writes on files, pipes and sockets that finish in the background
+// while the script carries on. run() waits until descriptors are ready, does
+// the work that won't block, and hands each result to the callback of its
+// operation or resumes the coroutine waiting on it. One interpreter can so
+// keep many operations in flight without threads.
+export class EventLoop {
+public:
+	enum class Op : unsigned char { READ, WRITE, ACCEPT };
+
+	struct Pending {
+		Op op;
+		// a function of one argument, or nil with a waiting coroutine instead
+		Object callback;
+		LoxCoroutine* waiter = nullptr;
+		// what is left to write
+		Object text;
+		size_t written = 0;
+	};
+
+	EventLoop(Interpreter& interpreter);
+	~EventLoop();
+
+	EventLoop(const EventLoop&) = delete;
+	EventLoop& operator=(const EventLoop&) = delete;
+
+	// Descriptors the script opens through the loop, closed with it.
+	int open(const std::string& path, const std::string& mode);
+	std::vector<int> pipe();
+	int listen(const std::string& path);
+	int connect(const std::string& path);
+	void close(int fd);
+
+	// Queues an operation. Operations on one descriptor finish in the order
+	// they were queued, reads and writes each in their own queue.
+	void submit(int fd, Pending pending);
+
+	// Runs until no operation is pending. Errors in callbacks come out of here.
+	void run(const Token& at);
+
+	inline size_t pendingCount() const { return pending; }
+
+private:
+	struct Poller;
+	struct Queues {
+		std::deque<Pending> reads;
+		std::deque<Pending> writes;
+	};
+
+	Interpreter& interpreter;
+	std::unique_ptr<Poller> poller;
+	std::unordered_map<int, Queues> queues;
+	std::unordered_set<int> owned;
+	size_t pending = 0;
+	bool running = false;
+
+	// Keeps the poller's interest in fd in line with its queues.
+	void watch(int fd);
+
+	// Does what it can of an operation without blocking. Returns false if it
+	// has to wait for the descriptor again.
+	bool perform(int fd, Pending& operation, Object& result);
+
+	// Takes the first operation off a queue of fd.
+	Pending finish(int fd, std::deque<Pending>& queue);
+	void release(Pending& operation);
+	void deliver(const Token& at, Pending& operation, Object result);
+
+	// Makes progress on the first read or write of fd.
+	void step(const Token& at, int fd, bool writing);
+};
@@ -51,6 +51,38 @@ Object Get::accept(ExprVisitor<Object>* visitor) const { return visitor->visitGe
 void Get::accept(ExprVisitor<void>* visitor) const { return visitor->visitGetExpr(this); }
 
 
+Index::Index(Expr* object, Token bracket, Expr* index)
+	: obj{object}, bracket{bracket}, index{index} { }
+Index::~Index() {
+	if (obj) delete obj; //nullptr once an assignment turned it into a SetIndex
+	if (index) delete index;
+}
+Object Index::accept(ExprVisitor<Object>* visitor) const { return visitor->visitIndexExpr(this); }
+void Index::accept(ExprVisitor<void>* visitor) const { return visitor->visitIndexExpr(this); }
+
+
+SetIndex::SetIndex(const Expr* object, Token bracket, const Expr* index, Expr* value)
+	: obj{object}, bracket{bracket}, index{index}, val{value} { }
+SetIndex::~SetIndex() {
+	delete obj;
+	delete index;
+	delete val;
+}
+Object SetIndex::accept(ExprVisitor<Object>* visitor) const { return visitor->visitSetIndexExpr(this); }
+void SetIndex::accept(ExprVisitor<void>* visitor) const { return visitor->visitSetIndexExpr(this); }
+
+
+ArrayLiteral::ArrayLiteral(Token bracket, std::vector<Expr*> elements)
+	: bracket{bracket}, elems{elements} { }
+ArrayLiteral::~ArrayLiteral() {
+	for (auto x : elems) {
+		delete x;
+	}
+}
+Object ArrayLiteral::accept(ExprVisitor<Object>* visitor) const { return visitor->visitArrayLiteralExpr(this); }
+void ArrayLiteral::accept(ExprVisitor<void>* visitor) const { return visitor->visitArrayLiteralExpr(this); }
+
+
 Grouping::Grouping(Expr* expression)
 	: expr{expression} { }
 Grouping::~Grouping() {
@@ -7,14 +7,17 @@ import <string>;
 export import Token;
 
 class Expr;
+struct ArrayLiteral;
 struct Assign;
 struct Binary;
 struct Call;
 struct Get;
 struct Grouping;
+struct Index;
 struct Literal;
 struct Logical;
 struct Set;
+struct SetIndex;
 struct Super;
 struct This;
 struct Unary;
@@ -23,14 +26,17 @@ struct Variable;
 
 export template<class R> class ExprVisitor {
 public:
+	virtual R visitArrayLiteralExpr(const ArrayLiteral* expr) = 0;
 	virtual R visitAssignExpr(const Assign* expr) = 0;
 	virtual R visitBinaryExpr(const Binary* expr) = 0;
 	virtual R visitCallExpr(const Call* expr) = 0;
 	virtual R visitGetExpr(const Get* expr) = 0;
 	virtual R visitGroupingExpr(const Grouping* expr) = 0;
+	virtual R visitIndexExpr(const Index* expr) = 0;
 	virtual R visitLiteralExpr(const Literal* expr) = 0;
 	virtual R visitLogicalExpr(const Logical* expr) = 0;
 	virtual R visitSetExpr(const Set* expr) = 0;
+	virtual R visitSetIndexExpr(const SetIndex* expr) = 0;
     virtual R visitSuperExpr(const Super* expr) = 0;
     virtual R visitThisExpr(const This* expr) = 0;
     virtual R visitUnaryExpr(const Unary* expr) = 0;
@@ -93,6 +99,39 @@ export struct Get : public Expr {
 	void accept(ExprVisitor<void>* visitor) const override;
 };
 
+export struct Index : public Expr {
+	const Expr* obj;
+	const Token bracket;
+	const Expr* index;
+
+	Index(Expr* object, Token bracket, Expr* index);
+	~Index();
+	Object accept(ExprVisitor<Object>* visitor) const override;
+	void accept(ExprVisitor<void>* visitor) const override;
+};
+
+export struct SetIndex : public Expr {
+	const Expr* obj;
+	const Token bracket;
+	const Expr* index;
+	const Expr* val;
+
+	SetIndex(const Expr* object, Token bracket, const Expr* index, Expr* value);
+	~SetIndex();
+	Object accept(ExprVisitor<Object>* visitor) const override;
+	void accept(ExprVisitor<void>* visitor) const override;
+};
+
+export struct ArrayLiteral : public Expr {
+	const Token bracket;
+	const std::vector<Expr*> elems;
+
+	ArrayLiteral(Token bracket, std::vector<Expr*> elements);
+	~ArrayLiteral();
+	Object accept(ExprVisitor<Object>* visitor) const override;
+	void accept(ExprVisitor<void>* visitor) const override;
+};
+
 export struct Grouping : public Expr {
 	const Expr* expr;
 
@@ -2,9 +2,27 @@
 module GC;
 import GC;
 
+import <algorithm>;
+import <chrono>;
+import <vector>;
+import <string>;
+import <utility>;
+import <fstream>;
+import <sstream>;
+import <memory>;
+import <map>;
+import <tuple>;
+import <cstdint>;
+import <new>;
+
 import Environment;
 import Stmt;
 import Object;
+import Interpreter;
+import Coroutine;
+import Workers;
+import Stats;
+import Trace;
 
 size_t type_sizes[(int)(Type::Type_MAX)] = {
 	sizeof Environment,
@@ -12,7 +30,26 @@ size_t type_sizes[(int)(Type::Type_MAX)] = {
 	sizeof LoxFn,
 	sizeof LoxClass,
 	sizeof LoxInstance,
-	sizeof Function
+	sizeof Function,
+	sizeof LoxArray,
+	sizeof LoxMap,
+	sizeof LoxCoroutine,
+	sizeof LoxChannel,
+	sizeof LoxWorker
+};
+
+const char* type_names[(int)(Type::Type_MAX)] = {
+	"environments",
+	"natives",
+	"closures",
+	"classes",
+	"instances",
+	"functions",
+	"arrays",
+	"maps",
+	"coroutines",
+	"channels",
+	"workers"
 };
 
 //void*s do not call destructors.
@@ -24,56 +61,202 @@ void deletePtr(void* ptr, Type t) {
 	case Type::LOXCLASS: return delete (LoxClass*)ptr;
 	case Type::INSTANCE: return delete (LoxInstance*)ptr;
 	case Type::FUNCTION: return delete (Function*)ptr;
+	case Type::ARRAY: return delete (LoxArray*)ptr;
+	case Type::MAP: return delete (LoxMap*)ptr;
+	case Type::COROUTINE: return delete (LoxCoroutine*)ptr;
+	case Type::CHANNEL: return delete (LoxChannel*)ptr;
+	case Type::WORKER: return delete (LoxWorker*)ptr;
+	}
+}
+
+struct GC::Profile {
+	std::ofstream out;
+	std::unordered_map<void*, int> sites;
+	size_t collections = 0;
+};
+
+struct GC::Dump {
+	std::ofstream out;
+	std::vector<std::pair<void*, void*>> references;
+};
+
+GC::GC() = default;
+GC::~GC() = default;
+
+void GC::record(void* ptr, Type type) {
+	allocs[ptr] = Data(type);
+	memory->bytes += type_sizes[(int)type];
+	if constexpr (Stats::enabled) allocations[(int)type]++;
+	if (profile) profile->sites[ptr] = site;
+
+	if (reachedLimit() || dump) collect(ptr);
+	//the object stays tracked, and goes with the next collection
+	if (!memory->allows(0)) throw std::bad_alloc();
+}
+
+//with the element storage of arrays and maps, which is what usually grows
+size_t GC::sizeOf(void* ptr, Type type) const {
+	size_t size = type_sizes[(int)type];
+	if (type == Type::ARRAY) size += ((LoxArray*)ptr)->values.capacity() * sizeof(Object) + ((LoxArray*)ptr)->numbers.capacity() * sizeof(double);
+	if (type == Type::MAP) size += ((LoxMap*)ptr)->slots.capacity() * sizeof(LoxMap::Slot);
+	return size;
+}
+
+bool GC::startProfile(const std::string& path) {
+	auto started = std::make_unique<Profile>();
+	started->out.open(path, std::ios::trunc);
+	if (!started->out) return false;
+	profile = std::move(started);
+	return true;
+}
+
+bool GC::dumpHeap(const std::string& path) {
+	auto started = std::make_unique<Dump>();
+	started->out.open(path, std::ios::trunc);
+	if (!started->out) return false;
+	dump = std::move(started);
+	collect();
+	bool written = !dump->out.fail();
+	dump.reset();
+	return written;
+}
+
+void GC::writeProfile() {
+	struct Site {
+		size_t objects = 0;
+		size_t bytes = 0;
+	};
+	std::map<std::pair<int, Type>, Site> sites;
+	Site total;
+	for (const auto& [ptr, data] : allocs) {
+		if (data.mark != Mark::BLACK) continue;
+		auto found = profile->sites.find(ptr);
+		Site& site = sites[{ found == profile->sites.end() ? 0 : found->second, data.type }];
+		size_t size = sizeOf(ptr, data.type);
+		site.objects++;
+		site.bytes += size;
+		total.objects++;
+		total.bytes += size;
+	}
+
+	std::vector<std::pair<std::pair<int, Type>, Site>> largest(sites.begin(), sites.end());
+	std::sort(largest.begin(), largest.end(), [](const auto& a, const auto& b) {
+		return std::tie(b.second.bytes, a.first) < std::tie(a.second.bytes, b.first);
+	});
+
+	std::ostringstream report;
+	report << "collection " << ++profile->collections << ": " << total.objects << " objects, " << total.bytes << " bytes live\n";
+	for (const auto& [key, site] : largest) {
+		//line 0 is anything allocated before the script ran
+		report << "  line " << key.first << " " << type_names[(int)key.second] << ": " << site.objects << " objects, " << site.bytes << " bytes\n";
 	}
+	profile->out << report.str();
+	profile->out.flush();
 }
 
-GC::GC() : alloc_size{0} {}
+void GC::writeDump() {
+	std::ofstream& out = dump->out;
+	std::unordered_map<void*, std::vector<void*>> references;
+	std::vector<void*> roots;
+	for (const auto& [from, to] : dump->references) {
+		if (from) references[from].push_back(to);
+		else roots.push_back(to);
+	}
 
-Environment* GC::track(Environment* ptr) { 
-	allocs[(void*)ptr] = Data(Type::ENV);
-	alloc_size += sizeof Environment;
+	auto id = [](void* ptr) { return (uintptr_t)ptr; };
+	out << "{\"roots\": [";
+	for (size_t i = 0; i < roots.size(); i++) out << (i ? ", " : "") << id(roots[i]);
+	out << "],\n\"objects\": [";
+	bool first = true;
+	for (const auto& [ptr, data] : allocs) {
+		if (data.mark != Mark::BLACK) continue;
+		out << (first ? "\n" : ",\n") << "{\"id\": " << id(ptr) << ", \"type\": \"" << type_names[(int)data.type]
+			<< "\", \"size\": " << sizeOf(ptr, data.type);
+		if (profile) {
+			auto found = profile->sites.find(ptr);
+			out << ", \"line\": " << (found == profile->sites.end() ? 0 : found->second);
+		}
+		out << ", \"references\": [";
+		const std::vector<void*>& to = references[ptr];
+		for (size_t i = 0; i < to.size(); i++) out << (i ? ", " : "") << id(to[i]);
+		out << "]}";
+		first = false;
+	}
+	out << "\n]}\n";
+	out.close();
+}
+
+Environment* GC::track(Environment* ptr) {
+	record(ptr, Type::ENV);
 	return ptr;
 }
 NativeFn* GC::track(NativeFn* ptr) {
-	allocs[(void*)ptr] = Data(Type::NATIVEFN);
-	alloc_size += sizeof NativeFn;
+	record(ptr, Type::NATIVEFN);
 	return ptr;
 }
 LoxFn* GC::track(LoxFn* ptr) {
-	allocs[(void*)ptr] = Data(Type::LOXFN);
-	alloc_size += sizeof LoxFn;
+	record(ptr, Type::LOXFN);
 	return ptr;
 }
 LoxClass* GC::track(LoxClass* ptr) {
-	allocs[(void*)ptr] = Data(Type::LOXCLASS);
-	alloc_size += sizeof LoxClass;
+	record(ptr, Type::LOXCLASS);
 	return ptr;
 }
 LoxInstance* GC::track(LoxInstance* ptr) {
-	allocs[(void*)ptr] = Data(Type::INSTANCE);
-	alloc_size += sizeof LoxInstance;
+	record(ptr, Type::INSTANCE);
 	return ptr;
 }
 Function* GC::track(Function* ptr) {
-	allocs[(void*)ptr] = Data(Type::FUNCTION);
-	alloc_size += sizeof Function;
+	record(ptr, Type::FUNCTION);
+	return ptr;
+}
+
+LoxArray* GC::track(LoxArray* ptr) {
+	record(ptr, Type::ARRAY);
+	return ptr;
+}
+LoxMap* GC::track(LoxMap* ptr) {
+	record(ptr, Type::MAP);
+	return ptr;
+}
+LoxCoroutine* GC::track(LoxCoroutine* ptr) {
+	record(ptr, Type::COROUTINE);
+	return ptr;
+}
+LoxChannel* GC::track(LoxChannel* ptr) {
+	record(ptr, Type::CHANNEL);
+	return ptr;
+}
+LoxWorker* GC::track(LoxWorker* ptr) {
+	record(ptr, Type::WORKER);
 	return ptr;
 }
 
 bool GC::reachedLimit() {
-	if (alloc_size >= alloc_limit) {
-		//alloc_limit *= 2; //Some factor
-		return true;
-	}
-	return false;
+	return memory->bytes >= alloc_limit;
 }
 
 void GC::mark(void* void_ptr, Data& data) {
-	if (data.mark == Mark::BLACK)
+	if (data.mark != Mark::WHITE)
 		return;
-	data.mark = Mark::BLACK;
+	data.mark = Mark::GRAY;
+	gray.emplace_back(void_ptr, &data);
+}
 
-	switch (data.type) {
+//a worklist rather than recursion, so long chains of scopes or nested arrays can't overflow the stack
+void GC::markGray() {
+	while (!gray.empty()) {
+		auto [ptr, data] = gray.back();
+		gray.pop_back();
+		data->mark = Mark::BLACK;
+		marking = ptr;
+		markReferences(ptr, data->type);
+	}
+	marking = nullptr;
+}
+
+void GC::markReferences(void* void_ptr, Type type) {
+	switch (type) {
 		case Type::ENV: {
 			Environment* ptr = (Environment*)void_ptr;
 
@@ -85,6 +268,8 @@ void GC::mark(void* void_ptr, Data& data) {
 			}
 		} break;
 		case Type::NATIVEFN:
+		case Type::CHANNEL:
+		case Type::WORKER:
 			break;
 		case Type::LOXFN: {
 			LoxFn* ptr = (LoxFn*)void_ptr;
@@ -118,11 +303,43 @@ void GC::mark(void* void_ptr, Data& data) {
 				markOne(fn);
 			}
 		} break;
+		case Type::ARRAY: {
+			LoxArray* ptr = (LoxArray*)void_ptr;
+
+			for (const auto& value : ptr->values) {
+				if (value.isPointer())
+					markRoot(value.getPointer());
+			}
+		} break;
+		case Type::MAP: {
+			LoxMap* ptr = (LoxMap*)void_ptr;
+
+			//keys are numbers and strings, only the values can point into the heap
+			for (const auto& slot : ptr->slots) {
+				if (slot.value.isPointer())
+					markRoot(slot.value.getPointer());
+			}
+		} break;
+		case Type::COROUTINE: {
+			LoxCoroutine* ptr = (LoxCoroutine*)void_ptr;
+
+			//a suspended coroutine's own state, or while it runs, its resumer's
+			const ExecutionState& saved = ptr->saved;
+			if (ptr->fn.isPointer()) markRoot(ptr->fn.getPointer());
+			if (ptr->transfer.isPointer()) markRoot(ptr->transfer.getPointer());
+			if (saved.environment) markRoot(saved.environment);
+			for (Environment* frame : saved.frames) {
+				markRoot(frame);
+			}
+			markValues(saved.stack);
+			markValues(saved.tailCall);
+		} break;
 	}
 }
 
 void GC::markOne(void* entry) {
 	if (auto found = allocs.find(entry); found != allocs.end()) {
+		if (dump) dump->references.emplace_back(marking, entry);
 		mark(found->first, found->second);
 	}
 	else {
@@ -130,14 +347,29 @@ void GC::markOne(void* entry) {
 	}
 }
 
+//roots may be natives, which live outside the heap
+void GC::markRoot(void* entry) {
+	if (auto found = allocs.find(entry); found != allocs.end()) {
+		if (dump) dump->references.emplace_back(marking, entry);
+		mark(found->first, found->second);
+	}
+}
+
 void GC::markFromList(std::vector<void*> entryPoints) {
 	for (void* entry : entryPoints) {
 		markOne(entry);
 	}
 }
 
+void GC::markValues(const CountedVector<Object>& values) {
+	for (const Object& value : values) {
+		if (value.isPointer()) markRoot(value.getPointer());
+	}
+}
+
 void GC::markFromEnv(Environment* env) {
 	if (auto found = allocs.find((void*)env); found != allocs.end()) {
+		if (dump) dump->references.emplace_back(marking, env);
 		mark(found->first, found->second);
 	}
 	else {
@@ -146,12 +378,17 @@ void GC::markFromEnv(Environment* env) {
 }
 
 void GC::sweep() {
+	for (const auto& [ptr, data] : allocs) {
+		if (data.mark == Mark::WHITE && data.type == Type::FUNCTION) ((Function*)ptr)->deleteBody();
+	}
+
 	for (auto iter = allocs.begin(); iter != allocs.end(); ) {
 		void* ptr = iter->first;
 		Data& data = iter->second;
 
 		if (data.mark == Mark::WHITE) {
-			alloc_size -= type_sizes[(int)(data.type)];
+			memory->bytes -= type_sizes[(int)(data.type)];
+			if (profile) profile->sites.erase(ptr);
 			if (ptr != nullptr) //for some reason
 				deletePtr(ptr, data.type);
 			iter = allocs.erase(iter);
@@ -163,8 +400,88 @@ void GC::sweep() {
 	}
 }
 
-void GC::runFromEnv(Environment* env) {
-	if (!reachedLimit()) return;
-	markFromEnv(env);
+void GC::deleteAll() {
+	for (const auto& [ptr, data] : allocs) {
+		if (data.type == Type::FUNCTION) ((Function*)ptr)->deleteBody();
+	}
+
+	for (const auto& [ptr, data] : allocs) {
+		memory->bytes -= type_sizes[(int)data.type];
+		deletePtr(ptr, data.type);
+	}
+	allocs.clear();
+	pinned.clear();
+	if (profile) profile->sites.clear();
+}
+
+void GC::pin(void* ptr) {
+	pinned[ptr]++;
+}
+
+void GC::unpin(void* ptr) {
+	if (auto found = pinned.find(ptr); found != pinned.end() && --found->second == 0) {
+		pinned.erase(found);
+	}
+}
+
+void GC::collect(void* allocated) {
+	//without roots, everything would look unreachable
+	if (paused || !roots.environment) return;
+	//sweeping a suspended coroutine unwinds it, which must not start another collection
+	Pause pause{ *this };
+	Trace::Span collecting{ "gc", "collect" };
+	Trace::Span marking{ "gc", "mark" };
+	std::chrono::steady_clock::time_point start;
+	if constexpr (Stats::enabled) start = std::chrono::steady_clock::now();
+	markFromEnv(*roots.environment);
+	for (Environment* frame : *roots.frames) {
+		markRoot(frame);
+	}
+	markValues(*roots.stack);
+	markValues(*roots.tailCall);
+	for (const auto& [ptr, _] : pinned) {
+		markRoot(ptr);
+	}
+	if (allocated) markRoot(allocated);
+	markGray();
+	if constexpr (Stats::enabled) {
+		cycles++;
+		markMilliseconds += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	}
+	marking.end();
+	if (profile) writeProfile();
+	if (dump) writeDump();
+	Trace::Span sweeping{ "gc", "sweep" };
+	size_t before = memory->bytes;
 	sweep();
+	if constexpr (Stats::enabled) bytesSwept += before - memory->bytes;
+	sweeping.end();
+
+	//with a fixed limit, a large live heap would be traced over and over.
+	//the bytes include what arrays and maps hold, which costs as much to trace.
+	//collecting halfway to the memory limit leaves garbage room to pile up in
+	size_t headroom = memory->limit > memory->bytes ? memory->limit - memory->bytes : 0;
+	alloc_limit = std::max(min_alloc_limit, std::min(memory->bytes * 2, memory->bytes + headroom / 2));
+}
+
+void GC::stats(std::vector<std::pair<std::string, double>>& counters, std::vector<std::pair<std::string, double>>& calls) const {
+	counters.emplace_back("lookups", (double)counts.values[(int)Stats::Counter::LOOKUPS]);
+	counters.emplace_back("hops", (double)counts.values[(int)Stats::Counter::HOPS]);
+	counters.emplace_back("returns thrown", (double)counts.values[(int)Stats::Counter::RETURNS_THROWN]);
+	counters.emplace_back("gc cycles", (double)cycles);
+	counters.emplace_back("heap bytes", (double)memory->bytes);
+	counters.emplace_back("bytes swept", (double)bytesSwept);
+	counters.emplace_back("mark ms", markMilliseconds);
+	for (int type = 0; type < (int)Type::Type_MAX; type++) {
+		counters.emplace_back(std::string("allocated ") + type_names[type], (double)allocations[type]);
+	}
+
+	for (const auto& [ptr, data] : allocs) {
+		const Function* function = (const Function*)ptr;
+		if (data.type != Type::FUNCTION || function->calls == 0) continue;
+		calls.emplace_back(function->id.lexeme + ":" + std::to_string(function->id.line), (double)function->calls);
+	}
+	std::sort(calls.begin(), calls.end(), [](const auto& a, const auto& b) {
+		return a.second != b.second ? a.second > b.second : a.first < b.first;
+	});
 }
@@ -3,12 +3,25 @@ export module GC;
 
 import <unordered_map>;
 import <iostream>;
+import <vector>;
+import <string>;
+import <utility>;
+import <memory>;
+
+import Memory;
+import Stats;
 
 export class Environment;
 export class NativeFn;
 export class LoxFn;
 export class LoxClass;
 export class LoxInstance;
+export class LoxArray;
+export class LoxMap;
+export class LoxCoroutine;
+export class LoxChannel;
+export class LoxWorker;
+export class Object;
 export struct Function;
 
 enum class Type : unsigned char {
@@ -18,6 +31,11 @@ enum class Type : unsigned char {
 	LOXCLASS,
 	INSTANCE,
 	FUNCTION,
+	ARRAY,
+	MAP,
+	COROUTINE,
+	CHANNEL,
+	WORKER,
 
 	Type_MAX
 };
@@ -37,21 +55,86 @@ struct Data {
 };
 
 export class GC {
-	size_t alloc_limit = 256*256;
+	static constexpr size_t min_alloc_limit = 256*256;
+	size_t alloc_limit = min_alloc_limit;
 
 	std::unordered_map<void*, Data> allocs;
-	size_t alloc_size;
+
+	//objects held by the host, with a count per pin
+	std::unordered_map<void*, int> pinned;
+
+	// Where objects were allocated, kept while profiling.
+	struct Profile;
+	std::unique_ptr<Profile> profile;
+
+	// References recorded during the next mark, for dumpHeap.
+	struct Dump;
+	std::unique_ptr<Dump> dump;
+	//the object whose references are being marked, or null for the roots
+	void* marking = nullptr;
+
+	//marked objects whose references are still to be marked
+	std::vector<std::pair<void*, Data*>> gray;
+
+	//allocations wait for a collection while this is above 0
+	int paused = 0;
 
 	bool reachedLimit();
 
+	void record(void* ptr, Type type);
+	size_t sizeOf(void* ptr, Type type) const;
+	void writeProfile();
+	void writeDump();
+
 	void markOne(void* entry);
+	void markRoot(void* entry);
 	void mark(void* void_ptr, Data& data);
+	void markGray();
+	void markReferences(void* void_ptr, Type type);
 	void markFromList(std::vector<void*> entryPoints);
 	void markFromEnv(Environment* env);
+	void markValues(const CountedVector<Object>& values);
 
 	void sweep();
 public:
+	// Counted while Stats::enabled, with the interpreter's own in `counts`.
+	Stats::Counters counts;
+	size_t allocations[(int)Type::Type_MAX] = {};
+	size_t cycles = 0;
+	size_t bytesSwept = 0;
+	double markMilliseconds = 0;
+
+	// The objects of this heap and what their containers hold. A limit set
+	// here makes allocations past it fail with "Out of memory.".
+	std::shared_ptr<Budget> memory = std::make_shared<Budget>();
+
+	// The source line of the latest call, array literal or declaration, which
+	// allocations are attributed to while profiling.
+	int site = 0;
+
+	// What the interpreter allocating from this heap is using: its innermost
+	// scope, the environments of unfinished blocks and calls, the values on
+	// its stack, e.g. call arguments and operands waiting for the rest of
+	// their expression, and a pending tail call. Set by the Interpreter.
+	struct Roots {
+		Environment* const* environment = nullptr;
+		const CountedVector<Environment*>* frames = nullptr;
+		const CountedVector<Object>* stack = nullptr;
+		const CountedVector<Object>* tailCall = nullptr;
+	} roots;
+
+	// Holds off collections while objects are allocated that nothing points
+	// at yet, as when a snapshot is read. The next allocation after it
+	// collects if the heap has grown past its limit in the meantime.
+	struct Pause {
+		GC& gc;
+
+		Pause(GC& gc) : gc{ gc } { gc.paused++; }
+		~Pause() { gc.paused--; }
+	};
+
 	GC();
+	~GC();
 
 	Environment* track(Environment* ptr);
 	NativeFn* track(NativeFn* ptr);
@@ -59,14 +142,39 @@ public:
 	LoxClass* track(LoxClass* ptr);
 	LoxInstance* track(LoxInstance* ptr);
 	Function*	 track(Function*    ptr);
+	LoxArray*	 track(LoxArray*    ptr);
+	LoxMap*		 track(LoxMap*      ptr);
+	LoxCoroutine* track(LoxCoroutine* ptr);
+	LoxChannel*	 track(LoxChannel*  ptr);
+	LoxWorker*	 track(LoxWorker*   ptr);
+
+	void deleteAll();
 
-	inline void deleteAll() {
-		for (auto x : allocs) {
-			delete x.first;
-		}
+	inline void at(int line) {
+		site = line;
 	}
 
-	void runFromEnv(Environment* env);
+	// From now on, records the line each object is allocated at, and after
+	// each collection appends the live objects and bytes per line to the file
+	// at path. Returns false if it can't be written.
+	bool startProfile(const std::string& path);
+
+	// Collects, and writes the live objects and the references between them
+	// to path as JSON. Returns false if it can't be written.
+	bool dumpHeap(const std::string& path);
+
+	void pin(void* ptr);
+	void unpin(void* ptr);
+
+	// Marks from the roots and the pinned objects, and frees the rest. An
+	// allocation that takes the heap past its limit starts one, with the new
+	// object as a root too, so host code must have linked anything it
+	// allocated before into it, or pinned it.
+	void collect(void* allocated = nullptr);
+
+	// The counters of this thread and this heap by name, and the calls of each
+	// function in the heap that has been called, most called first.
+	void stats(std::vector<std::pair<std::string, double>>& counters, std::vector<std::pair<std::string, double>>& calls) const;
 };
 
 //export GC global_gc;
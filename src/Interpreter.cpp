@@ -6,29 +6,73 @@ import <iostream>;
 import <string>;
 import <vector>;
 import <unordered_map>;
+import <cmath>;
+import <utility>;
+import <memory>;
+import <algorithm>;
+import <new>;
+import <stdexcept>;
+import <optional>;
 
 import Expr;
 import Stmt;
 import Error;
 import Environment;
+import Output;
 import NativeFunctions;
+import EventLoop;
+import Stats;
+import Memory;
 
 ReturnFromLoxFn::ReturnFromLoxFn(Object val) : value{ val } { }
 
-void Interpreter::executeBlock(const std::vector<Stmt*> statements, Environment* environment) {
-	auto previous = this->environment;
-	try {
-		this->environment = environment;
+namespace {
+	// Pops everything a call or block pushed, however it ends.
+	struct StackMark {
+		CountedVector<Object>& stack;
+		size_t base;
+
+		~StackMark() { stack.erase(stack.begin() + base, stack.end()); }
+	};
+
+	// Restores the interpreter's environment and frame however a block or call ends.
+	struct FrameGuard {
+		Environment*& environment;
+		size_t& frameBase;
+		CountedVector<Environment*>& frames;
+
+		Environment* previous;
+		size_t previousBase;
+
+		FrameGuard(Environment*& environment, size_t& frameBase, CountedVector<Environment*>& frames, Environment* next, size_t nextBase)
+			: environment{ environment }, frameBase{ frameBase }, frames{ frames }, previous{ environment }, previousBase{ frameBase } {
+			frames.push_back(previous);
+			environment = next;
+			frameBase = nextBase;
+		}
 
-		for (const Stmt* statement : statements) {
-			execute(statement);
+		~FrameGuard() {
+			environment = previous;
+			frameBase = previousBase;
+			frames.pop_back();
 		}
+	};
+}
 
-		this->environment = previous;
+void Interpreter::executeBlock(const std::vector<Stmt*>& statements, Environment* environment) {
+	//returns, and runtime errors a host may recover from, unwind through the guard
+	FrameGuard scope{ this->environment, frameBase, frames, environment, noFrame };
+
+	for (const Stmt* statement : statements) {
+		execute(statement);
 	}
-	catch (ReturnFromLoxFn ret) {
-		this->environment = previous;
-		throw;
+}
+
+void Interpreter::executeFrame(const std::vector<Stmt*>& statements, Environment* closure, CallParams arguments) {
+	FrameGuard scope{ environment, frameBase, frames, closure, (size_t)(arguments.data() - stack.data()) };
+
+	for (const Stmt* statement : statements) {
+		execute(statement);
 	}
 }
 
@@ -48,10 +92,70 @@ void Interpreter::checkNumberOperands(Token oper, Object left, Object right) {
 	throw Error::RuntimeError(oper, "Operands must be numbers.");
 }
 
-Interpreter::Interpreter(GC& gc) : environment{ gc.track(new Environment(&globals, true)) }, gc{ gc } {
-	globals.define("clock", new NativeFn(NativeFunction::clock, 0));
+Interpreter::Interpreter(GC& gc, Error::Reporter& reporter, Output& out, size_t maxDepth)
+	: globals{ gc.memory }, environment{ gc.track(new Environment(&globals, true)) }, gc{ gc }, reporter{ reporter }, out{ out },
+	  maxDepth{ maxDepth }, depthLimit{ maxDepth }, stackLimit{ maxDepth * slotsPerCall } {
+	//a tail call may briefly need room for one more callee and its arguments
+	stack.reserve(stackLimit + 256);
+	gc.roots = { &environment, &frames, &stack, &tailCall };
+
+	globals.define("clock", new TypedNativeFn<double()>(NativeFunction::clock));
+	globals.define("snapshot", new NativeFn(NativeFunction::snapshot, 0));
+	globals.define("flush", new NativeFn(NativeFunction::flush, 0));
+	globals.define("stats", new NativeFn(NativeFunction::stats, 0));
+	globals.define("heapDump", new NativeFn(NativeFunction::heapDump, 1));
+
+	globals.define("sqrt", new TypedNativeFn<double(double)>(NativeFunction::sqrt));
+	globals.define("abs", new TypedNativeFn<double(double)>(NativeFunction::abs));
+	globals.define("floor", new TypedNativeFn<double(double)>(NativeFunction::floor));
+
+	globals.define("array", new NativeFn(NativeFunction::array, 1));
+	globals.define("len", new TypedNativeFn<double(Object)>(NativeFunction::len));
+	globals.define("push", new TypedNativeFn<void(LoxArray*, Object)>(NativeFunction::push));
+	globals.define("pop", new TypedNativeFn<Object(LoxArray*)>(NativeFunction::pop));
+	globals.define("sum", new TypedNativeFn<double(LoxArray*)>(NativeFunction::sum));
+	globals.define("dot", new TypedNativeFn<double(LoxArray*, LoxArray*)>(NativeFunction::dot));
+	globals.define("scale", new TypedNativeFn<LoxArray*(LoxArray*, double)>(NativeFunction::scale));
+	globals.define("sort", new TypedNativeFn<LoxArray*(LoxArray*)>(NativeFunction::sort));
+	globals.define("map", new NativeFn(NativeFunction::map, 2));
+
+	globals.define("find", new TypedNativeFn<double(Object, Object)>(NativeFunction::find));
+	globals.define("split", new NativeFn(NativeFunction::split, 2));
+	globals.define("replace", new TypedNativeFn<Object(Object, Object, Object)>(NativeFunction::replace));
+	globals.define("substr", new TypedNativeFn<Object(Object, Object, Object)>(NativeFunction::substr));
+	globals.define("compare", new TypedNativeFn<double(Object, Object)>(NativeFunction::compare));
+	globals.define("number", new TypedNativeFn<Object(Object)>(NativeFunction::number));
+
+	globals.define("dict", new NativeFn(NativeFunction::dict, 0));
+	globals.define("get", new TypedNativeFn<Object(LoxMap*, Object)>(NativeFunction::get));
+	globals.define("set", new TypedNativeFn<Object(LoxMap*, Object, Object)>(NativeFunction::set));
+	globals.define("has", new TypedNativeFn<bool(LoxMap*, Object)>(NativeFunction::has));
+	globals.define("remove", new TypedNativeFn<bool(LoxMap*, Object)>(NativeFunction::remove));
+	globals.define("keys", new NativeFn(NativeFunction::keys, 1));
+	globals.define("values", new NativeFn(NativeFunction::values, 1));
+
+	globals.define("coroutine", new NativeFn(NativeFunction::coroutine, 1));
+	globals.define("yield", new NativeFn(NativeFunction::yield, 1));
+	globals.define("done", new TypedNativeFn<bool(Object)>(NativeFunction::done));
+
+	globals.define("open", new NativeFn(NativeFunction::open, 2));
+	globals.define("pipe", new NativeFn(NativeFunction::pipe, 0));
+	globals.define("listen", new NativeFn(NativeFunction::listen, 1));
+	globals.define("connect", new NativeFn(NativeFunction::connect, 1));
+	globals.define("close", new NativeFn(NativeFunction::close, 1));
+	globals.define("read", new NativeFn(NativeFunction::read, 2));
+	globals.define("write", new NativeFn(NativeFunction::write, 3));
+	globals.define("accept", new NativeFn(NativeFunction::accept, 2));
+	globals.define("run", new NativeFn(NativeFunction::run, 0));
+
+	globals.define("spawn", new NativeFn(NativeFunction::spawn, 2));
+	globals.define("channel", new NativeFn(NativeFunction::channel, 0));
+	globals.define("send", new NativeFn(NativeFunction::send, 2));
+	globals.define("parallelMap", new NativeFn(NativeFunction::parallelMap, 2));
+	globals.define("parallelReduce", new NativeFn(NativeFunction::parallelReduce, 3));
 }
 Interpreter::~Interpreter() {
+	gc.roots = {};
 	for (auto& [_, x] : globals.values) {
 		if (x.isCallable()) {
 			delete x.getCallablePtr();
@@ -59,29 +163,101 @@ Interpreter::~Interpreter() {
 	}
 }
 
-Object Interpreter::lookUpVariable(Token name, const Expr* expr) {
+ExecutionState Interpreter::newState(size_t depthLimit) const {
+	//a coroutine's stacks count against the heap
+	Counted<Object> counted{ gc.memory };
+	ExecutionState state{ environment, CountedVector<Object>(counted), CountedVector<Environment*>(counted), CountedVector<Object>(counted) };
+	state.depthLimit = depthLimit;
+	state.stackLimit = depthLimit * slotsPerCall;
+	state.stack.reserve(state.stackLimit + 256);
+	return state;
+}
+
+EventLoop& Interpreter::eventLoop() {
+	if (!events) events = std::make_unique<EventLoop>(*this);
+	return *events;
+}
+
+void Interpreter::swapState(ExecutionState& other) {
+	std::swap(environment, other.environment);
+	stack.swap(other.stack);
+	frames.swap(other.frames);
+	tailCall.swap(other.tailCall);
+	std::swap(depth, other.depth);
+	std::swap(depthLimit, other.depthLimit);
+	std::swap(stackLimit, other.stackLimit);
+	std::swap(frameBase, other.frameBase);
+}
+
+void Interpreter::resolveGlobal(const Expr* expr, const std::string& name) {
+	locals.erase(expr);
+	slots.erase(expr);
+	auto [index, added] = globalIndex.try_emplace(name, (int)globalTable.size());
+	if (added) globalTable.push_back(nullptr);
+	globalSlots[expr] = index->second;
+}
+
+void Interpreter::forgetGlobal(const std::string& name) {
+	if (auto index = globalIndex.find(name); index != globalIndex.end()) globalTable[index->second] = nullptr;
+}
+
+void Interpreter::forgetGlobals() {
+	std::fill(globalTable.begin(), globalTable.end(), nullptr);
+}
+
+Object Interpreter::lookUpVariable(const Token& name, const Expr* expr) {
+	if (frameBase != noFrame) {
+		if (auto slot = slots.find(expr); slot != slots.end()) return stack[frameBase + slot->second];
+	}
+
 	auto distance = locals.find(const_cast<Expr*>(expr)); //don't do that, but I don't want to fix it.
 	if (distance != locals.end()) {
 		return environment->getAt(distance->second, name.lexeme);
 	}
+	else if (auto index = globalSlots.find(expr); index != globalSlots.end()) {
+		return global(index->second, name);
+	}
 	else {
 		return environment->get(name);
 	}
 }
 
-void Interpreter::interpret(std::vector<Stmt*> statements) {
+void Interpreter::interpret(std::vector<Stmt*> statements, size_t from) {
 	try {
-		for (const Stmt* statement : statements) {
-			execute(statement);
+		for (size_t i = from; i < statements.size(); i++) {
+			execute(statements[i]);
+
+			if (snapshotPending) {
+				snapshotPending = false;
+				onSnapshot(i + 1);
+			}
 		}
 
 		//locals.clear();
 	}
 	catch (Error::RuntimeError& error) {
-		Error::runtimeError(error);
+		//what the script printed before failing comes first
+		out.flush();
+		reporter.runtimeError(error);
 
 		//locals.clear();
 	}
+	catch (std::bad_alloc&) {
+		reportOutOfMemory();
+	}
+	catch (std::length_error&) {
+		//a container asked for more than it can ever hold
+		reportOutOfMemory();
+	}
+}
+
+Error::RuntimeError Interpreter::outOfMemory() const {
+	return Error::RuntimeError(Token(TokenType::IDENTIFIER, "", gc.site), "Out of memory.");
+}
+
+void Interpreter::reportOutOfMemory() {
+	out.flush();
+	reporter.runtimeError(outOfMemory());
 }
 
 Object Interpreter::visitLiteralExpr(const Literal* expr) {
@@ -120,9 +296,17 @@ Object Interpreter::visitUnaryExpr(const Unary* expr) {
 	return Object();
 }
 
+Object Interpreter::evaluateHolding(const Token& at, const Object& held, const Expr* expr) {
+	if (!held.isPointer()) return evaluate(expr);
+
+	StackMark mark{ stack, stack.size() };
+	push(at, held);
+	return evaluate(expr);
+}
+
 Object Interpreter::visitBinaryExpr(const Binary* expr) {
 	Object left = evaluate(expr->l);
-	Object right = evaluate(expr->r);
+	Object right = evaluateHolding(expr->op, left, expr->r);
 
 	switch (expr->op.type) {
 		case TokenType::GREATER:
@@ -147,7 +331,9 @@ Object Interpreter::visitBinaryExpr(const Binary* expr) {
 			}
 
 			if (left.isString() && right.isString()) {
-				return left.getString() + right.getString();
+				//where the heap ran out, if it does
+				gc.at(expr->op.line);
+				return left.getLoxString().concat(right.getStringView());
 			}
 
 			throw Error::RuntimeError(expr->op, "Operands must be two numbers or two strings.");
@@ -167,25 +353,84 @@ Object Interpreter::visitBinaryExpr(const Binary* expr) {
 	return Object();
 }
 
-Object Interpreter::visitCallExpr(const Call* expr) {
-	Object callee = evaluate(expr->calleeExpr);
-
-	std::vector<Object> arguments;
-	for (Expr* argument : expr->args) {
-		arguments.push_back(evaluate(argument));
-	}
+void Interpreter::checkCall(const Token& paren, size_t base) {
+	const Object& callee = stack[base];
+	size_t arity = stack.size() - base - 1;
 
 	if (!callee.isCallable()) {
-		throw Error::RuntimeError(expr->parenthesis, "Can only call functions and classes.");
+		throw Error::RuntimeError(paren, "Can only call functions and classes.");
 	}
 
-	if (arguments.size() != callee.callableArity()) {
-		throw Error::RuntimeError(expr->parenthesis,
+	if (arity != callee.callableArity()) {
+		throw Error::RuntimeError(paren,
 			"Expected " + std::to_string(callee.callableArity()) + " arguments but got " +
-			std::to_string(arguments.size()) + ".");
+			std::to_string(arity) + ".");
 	}
+}
+
+Object Interpreter::callFrame(const Token& paren, size_t base) {
+	checkCall(paren, base);
+
+	if (depth == depthLimit) {
+		throw Error::RuntimeError(paren, "Stack overflow.");
+	}
+	gc.at(paren.line);
+
+	depth++;
+	struct Leave {
+		size_t& depth;
+		~Leave() { depth--; }
+	} leave{ depth };
 
-	return callee.call(*this, arguments);
+	const Object& callee = stack[base];
+	CallParams arguments{ stack.data() + base + 1, stack.size() - base - 1 };
+
+	try {
+		return callee.call(*this, arguments);
+	}
+	catch (NativeError error) {
+		throw Error::RuntimeError(paren, error.message);
+	}
+	catch (std::bad_alloc&) {
+		throw outOfMemory();
+	}
+	catch (std::length_error&) {
+		throw outOfMemory();
+	}
+}
+
+CallParams Interpreter::enterTailCall(CallParams current) {
+	size_t base = (size_t)(current.data() - stack.data()) - 1;
+	stack.erase(stack.begin() + base, stack.end());
+	for (Object& value : tailCall) {
+		stack.push_back(std::move(value));
+	}
+	tailCall.clear();
+
+	return CallParams{ stack.data() + base + 1, stack.size() - base - 1 };
+}
+
+Object Interpreter::call(const Token& at, const Object& callee, CallParams args) {
+	StackMark frame{ stack, stack.size() };
+
+	push(at, callee);
+	for (const Object& argument : args) {
+		push(at, argument);
+	}
+
+	return callFrame(at, frame.base);
+}
+
+Object Interpreter::visitCallExpr(const Call* expr) {
+	StackMark frame{ stack, stack.size() };
+
+	//the arguments are evaluated straight into the callee's parameter slots
+	push(expr->parenthesis, evaluate(expr->calleeExpr));
+	for (Expr* argument : expr->args) {
+		push(expr->parenthesis, evaluate(argument));
+	}
+
+	return callFrame(expr->parenthesis, frame.base);
 }
 
 Object Interpreter::visitVariableExpr(const Variable* expr) {
@@ -195,10 +440,20 @@ Object Interpreter::visitVariableExpr(const Variable* expr) {
 Object Interpreter::visitAssignExpr(const Assign* expr) {
 	Object value = evaluate(expr->val);
 
+	if (frameBase != noFrame) {
+		if (auto slot = slots.find(expr); slot != slots.end()) {
+			stack[frameBase + slot->second] = value;
+			return value;
+		}
+	}
+
 	auto distance = locals.find(const_cast<Assign*>(expr));
 	if (distance != locals.end()) {
 		environment->assignAt(distance->second, expr->id, value);
 	}
+	else if (auto index = globalSlots.find(expr); index != globalSlots.end()) {
+		global(index->second, expr->id) = value;
+	}
 	else {
 		environment->assign(expr->id, value);
 	}
@@ -222,11 +477,82 @@ Object Interpreter::visitSetExpr(const Set* expr) {
 		throw Error::RuntimeError(expr->name, "Only instances have fields.");
 	}
 
-	Object value = evaluate(expr->val);
+	Object value = evaluateHolding(expr->name, object, expr->val);
 	object.getLoxInstancePtr()->set(expr->name, value);
 	return value;
 }
 
+size_t Interpreter::arrayIndex(const Token& bracket, const Object& array, const Object& index) {
+	if (!array.isArray()) {
+		throw Error::RuntimeError(bracket, "Only arrays and maps can be indexed.");
+	}
+	if (!index.isDouble() || index.getDouble() != std::floor(index.getDouble())) {
+		throw Error::RuntimeError(bracket, "Array index must be an integer.");
+	}
+	if (index.getDouble() < 0 || index.getDouble() >= array.getArrayPtr()->size()) {
+		throw Error::RuntimeError(bracket, "Array index out of range.");
+	}
+	return (size_t)index.getDouble();
+}
+
+Object Interpreter::visitArrayLiteralExpr(const ArrayLiteral* expr) {
+	//the elements wait on the stack, where the GC sees them
+	StackMark mark{ stack, stack.size() };
+	bool numeric = true;
+	for (Expr* element : expr->elems) {
+		push(expr->bracket, evaluate(element));
+		numeric = numeric && stack.back().isDouble();
+	}
+
+	gc.at(expr->bracket.line);
+	LoxArray* array = gc.track(new LoxArray());
+	if (numeric) {
+		array->numbers.reserve(expr->elems.size());
+		for (size_t i = mark.base; i < stack.size(); i++) array->numbers.push_back(stack[i].getDouble());
+	}
+	else {
+		array->boxed = true;
+		array->values.assign(stack.begin() + mark.base, stack.end());
+	}
+	return Object(array);
+}
+
+void Interpreter::checkMapKey(const Token& bracket, const Object& key) {
+	if (!LoxMap::isKey(key)) {
+		throw Error::RuntimeError(bracket, "Map keys must be numbers other than NaN, or strings.");
+	}
+}
+
+Object Interpreter::visitIndexExpr(const Index* expr) {
+	Object object = evaluate(expr->obj);
+	Object index = evaluateHolding(expr->bracket, object, expr->index);
+	if (object.isMap()) {
+		checkMapKey(expr->bracket, index);
+		const Object* value = object.getMapPtr()->find(index);
+		if (!value) throw Error::RuntimeError(expr->bracket, "Undefined key.");
+		return *value;
+	}
+
+	size_t i = arrayIndex(expr->bracket, object, index);
+	return object.getArrayPtr()->get(i);
+}
+
+Object Interpreter::visitSetIndexExpr(const SetIndex* expr) {
+	//a valid index is a number or a string, which the GC doesn't own
+	Object object = evaluate(expr->obj);
+	Object index = evaluateHolding(expr->bracket, object, expr->index);
+	Object value = evaluateHolding(expr->bracket, object, expr->val);
+	if (object.isMap()) {
+		checkMapKey(expr->bracket, index);
+		object.getMapPtr()->set(index, value);
+		return value;
+	}
+
+	size_t i = arrayIndex(expr->bracket, object, index);
+	object.getArrayPtr()->set(i, value);
+	return value;
+}
+
 Object Interpreter::visitSuperExpr(const Super* expr) {
 	int distance = locals[expr];
 	LoxClass* superclass = (LoxClass*)environment->getAt(distance, "super").getCallablePtr();
@@ -252,9 +578,19 @@ void Interpreter::visitExpressionStmt(const Expression* stmt) {
 	evaluate(stmt->expr);
 }
 
+void Interpreter::visitImportStmt(const Import* stmt) {
+	if (!onImport) throw Error::RuntimeError(stmt->keywrd, "Can't import here.");
+
+	const std::vector<Stmt*>* module = onImport(stmt);
+	if (!module) return;
+	for (const Stmt* s : *module) {
+		execute(s);
+	}
+}
+
 void Interpreter::visitPrintStmt(const Print* stmt) {
 	Object value = evaluate(stmt->expr);
-	std::cout << value << '\n';
+	out.print(value);
 }
 
 void Interpreter::visitVarStmt(const Var* stmt) {
@@ -263,10 +599,20 @@ void Interpreter::visitVarStmt(const Var* stmt) {
 		value = evaluate(stmt->init);
 	}
 
-	environment->define(stmt->id.lexeme, value);
+	//the resolver numbered the slots in declaration order, so the next one is the top
+	if (frameBase != noFrame) push(stmt->id, value);
+	else define(stmt->id.lexeme, value);
 }
 
 void Interpreter::visitBlockStmt(const Block* stmt) {
+	if (frameBase != noFrame) {
+		StackMark mark{ stack, stack.size() };
+		for (const Stmt* statement : stmt->stmts) {
+			execute(statement);
+		}
+		return;
+	}
+
 	auto newEnv = gc.track(new Environment(environment));
 	executeBlock(stmt->stmts, newEnv);
 }
@@ -287,14 +633,41 @@ void Interpreter::visitWhileStmt(const While* stmt) {
 }
 
 void Interpreter::visitFunctionStmt(Function* stmt) {
+	gc.at(stmt->id.line);
 	Object function = gc.track(new LoxFn(stmt, environment, *this, false));
-	environment->define(stmt->id.lexeme, function);
+	define(stmt->id.lexeme, function);
 }
 
 void Interpreter::visitReturnStmt(const Return* stmt) {
+	//a call in return position replaces the current one instead of nesting in it
+	if (auto call = dynamic_cast<const Call*>(stmt->val)) {
+		StackMark frame{ stack, stack.size() };
+
+		push(call->parenthesis, evaluate(call->calleeExpr));
+		for (Expr* argument : call->args) {
+			push(call->parenthesis, evaluate(argument));
+		}
+
+		const Object& callee = stack[frame.base];
+		if (callee.isCallable() && dynamic_cast<LoxFn*>(callee.getCallablePtr())) {
+			checkCall(call->parenthesis, frame.base);
+
+			//blocks being left pop their slots, so the call waits outside the stack
+			for (size_t i = frame.base; i < stack.size(); i++) {
+				tailCall.push_back(std::move(stack[i]));
+			}
+			throw TailCall();
+		}
+
+		Object value = callFrame(call->parenthesis, frame.base);
+		Stats::count<Stats::Counter::RETURNS_THROWN>();
+		throw ReturnFromLoxFn(value);
+	}
+
 	Object value = Object();
 	if (stmt->val) value = evaluate(stmt->val);
 
+	Stats::count<Stats::Counter::RETURNS_THROWN>();
 	throw ReturnFromLoxFn(value);
 }
 
@@ -307,27 +680,37 @@ void Interpreter::visitClassStmt(const Class* stmt) {
 		}
 	}
 
-	environment->define(stmt->nam.lexeme, Object());
+	gc.at(stmt->nam.line);
+
+	//a class in a stack frame has no methods, so nothing captures its slot
+	size_t slot = stack.size();
+	if (frameBase != noFrame) push(stmt->nam, Object());
+	else define(stmt->nam.lexeme, Object());
 
+	//the methods close over a scope holding `super`, left however the rest ends
+	std::optional<FrameGuard> superScope;
 	if (stmt->super) {
-		environment = gc.track(new Environment(environment));
-		environment->define("super", superclass);
+		Environment* scope = gc.track(new Environment(environment));
+		scope->define("super", superclass);
+		superScope.emplace(environment, frameBase, frames, scope, frameBase);
 	}
 
+	//the methods wait on the stack until the class holds them
+	StackMark pending{ stack, stack.size() };
 	std::unordered_map<std::string, LoxFn*> methods;
 	for (Function* method : stmt->meths) {
 		bool isInit = method->id.lexeme == "init";
 		auto function = gc.track(new LoxFn(method, environment, *this, isInit));
 		methods[method->id.lexeme] = function;
+		push(method->id, Object((LoxCallable*)function));
 	}
 
 	LoxClass* super = superclass.isNil() ? nullptr : (LoxClass*)superclass.getCallablePtr();
 
 	Object klass = gc.track(new LoxClass(stmt->nam.lexeme, super, methods));
 
-	if (super) {
-		environment = environment->enclosing;
-	}
+	superScope.reset();
 
-	environment->assign(stmt->nam, klass);
+	if (frameBase != noFrame) stack[slot] = klass;
+	else environment->assign(stmt->nam, klass);
 }
\ No newline at end of file
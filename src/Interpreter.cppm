@@ -3,12 +3,19 @@ export module Interpreter;
 
 import <string>;
 import <vector>;
+import <functional>;
+import <iostream>;
+import <memory>;
 
 import Expr;
 import Stmt;
 import Error;
 import Environment;
+import Memory;
 import GC;
+import Output;
+
+export class EventLoop;
 
 export struct ReturnFromLoxFn {
 	Object value;
@@ -16,14 +23,100 @@ export struct ReturnFromLoxFn {
 	ReturnFromLoxFn(Object val);
 };
 
+// Thrown by `return f(...)` when f is a Lox function. The callee and its
+// arguments wait in Interpreter::tailCall until the returning call takes them.
+export struct TailCall {};
+
+// What a Lox thread of execution is in the middle of: its innermost scope and
+// the stacks behind it. A coroutine keeps its own while suspended.
+export struct ExecutionState {
+	Environment* environment = nullptr;
+	CountedVector<Object> stack;
+	CountedVector<Environment*> frames;
+	CountedVector<Object> tailCall;
+	size_t depth = 0;
+	size_t depthLimit = 0;
+	size_t stackLimit = 0;
+	size_t frameBase = (size_t)-1;
+};
+
 export class Interpreter : public ExprVisitor<Object>, public StmtVisitor<void> {
 public:
 	Environment globals;
 	Environment* environment;
 	GC& gc;
+	Error::Reporter& reporter;
+	Output& out;
+
+	// Set by the `snapshot()` native. interpret then hands the index of the
+	// next top-level statement to onSnapshot.
+	std::function<void(size_t)> onSnapshot;
+	bool snapshotPending = false;
+
+	// Hands an import the top-level statements of its module, or nullptr if
+	// they already ran. They run right away, in the global scope.
+	std::function<const std::vector<Stmt*>*(const Import*)> onImport;
+
+	// Parses and resolves the body of a function the parser skipped, before
+	// its first call. Returns false if the body has errors.
+	std::function<bool(Function*)> onLazyBody;
+
+	// The coroutine running now, or nullptr outside all of them.
+	LoxCoroutine* coroutine = nullptr;
 private:
 
 	std::unordered_map<const Expr*, int> locals;
+	std::unordered_map<const Expr*, int> slots;
+
+	// Globals by the index the resolver gave their name. An entry points at
+	// the variable in the top-level scope or among the natives, and is
+	// nullptr until a lookup by name has found it there.
+	std::unordered_map<const Expr*, int> globalSlots;
+	std::unordered_map<std::string, int> globalIndex;
+	std::vector<Object*> globalTable;
+
+	// Arguments of the calls in progress, and the locals of functions whose
+	// body creates no closures. Such a call's arguments become its parameter
+	// slots and its locals are pushed right above them, so it needs no
+	// Environment. The space is reserved once and never moves, so the spans
+	// handed to callees stay valid.
+	static constexpr size_t slotsPerCall = 4;
+	size_t depthLimit;
+	size_t stackLimit;
+	// The interpreter's own stacks are bounded by --max-depth like its
+	// native stack, and aren't counted against the heap. A coroutine's are.
+	CountedVector<Object> stack{ Counted<Object>(nullptr) };
+
+	// Lox calls in progress, up to depthLimit. Tail calls don't count.
+	size_t depth = 0;
+
+	// Callee and arguments of a pending tail call.
+	CountedVector<Object> tailCall{ Counted<Object>(nullptr) };
+
+	// Where the slots of the innermost call start, or noFrame if its locals are in Environments.
+	static constexpr size_t noFrame = (size_t)-1;
+	size_t frameBase = noFrame;
+
+	// Environments of the blocks and calls in progress, for the GC.
+	CountedVector<Environment*> frames{ Counted<Environment*>(nullptr) };
+
+	// Created by the first I/O native.
+	std::unique_ptr<EventLoop> events;
+
+	inline void push(const Token& at, Object value) {
+		if (stack.size() >= stackLimit) throw Error::RuntimeError(at, "Stack overflow.");
+		stack.push_back(std::move(value));
+	}
+
+	// Checks that the callee at stack[base] can take the arguments above it.
+	void checkCall(const Token& paren, size_t base);
+
+	// Calls the callee at stack[base] with the arguments above it.
+	Object callFrame(const Token& paren, size_t base);
+
+	// Reported at the line allocated on last rather than at the call, which
+	// may be far from where the memory ran out.
+	Error::RuntimeError outOfMemory() const;
 
 	inline Object evaluate(const Expr* expr) {
 		return expr->accept(this);
@@ -31,9 +124,11 @@ private:
 
 	inline void execute(const Stmt* stmt) {
 		stmt->accept(this);
-		gc.runFromEnv(environment);
 	}
 
+	// Evaluates expr while `held` waits on the stack, where the GC sees it.
+	Object evaluateHolding(const Token& at, const Object& held, const Expr* expr);
+
 	bool isTruthy(Object obj);
 
 	inline bool isEqual(Object a, Object b) {
@@ -50,24 +145,120 @@ private:
 		throw Error::RuntimeError(oper, "Operands must be numbers.");
 	}
 
-	Object lookUpVariable(Token name, const Expr* expr);
+	Object lookUpVariable(const Token& name, const Expr* expr);
+
+	// The global at `index` in the table, looked up by name the first time.
+	// Only code whose top-level scope is the interpreter's own uses it.
+	inline Object& global(int index, const Token& name) {
+		if (Object* cached = globalTable[index]) return *cached;
+
+		Environment* scope;
+		Object* variable = environment->find(name.lexeme, scope);
+		if (!variable) throw Error::RuntimeError(name, "Undefined variable '" + name.lexeme + "'.");
+		//a local declared after the code using it resolves as global too, and
+		//only lasts as long as its call or block
+		if (scope->isTopLevel || scope == &globals) globalTable[index] = variable;
+		return *variable;
+	}
+
+	// Defines a variable in the current scope.
+	inline void define(const std::string& name, Object value) {
+		environment->define(name, value);
+		if (environment->isTopLevel) forgetGlobal(name);
+	}
+
+	// The element of `array` that `index` names, checked against its bounds.
+	size_t arrayIndex(const Token& bracket, const Object& array, const Object& index);
+	void checkMapKey(const Token& bracket, const Object& key);
 
 
 public:
-	Interpreter(GC&);
+	// How deep calls may nest before "Stack overflow.". The native stack the
+	// interpreter runs on needs about nativeBytesPerCall for each level.
+	static constexpr size_t defaultMaxDepth = 10000;
+	static constexpr size_t nativeBytesPerCall = 4096;
+	const size_t maxDepth;
+
+	// Native stack for running calls `maxDepth` deep, with room to spare for the
+	// scanner, parser and resolver.
+	static constexpr size_t nativeStackFor(size_t maxDepth) {
+		return maxDepth * nativeBytesPerCall + (1 << 20);
+	}
+
+	Interpreter(GC&, Error::Reporter&, Output& out, size_t maxDepth = defaultMaxDepth);
 	~Interpreter();
 
 	//Function* registerFnRef(Function* stmt);
 	//void unregisterFnRef(Function* stmt);
 
-	void interpret(std::vector<Stmt*> statements);
+	void interpret(std::vector<Stmt*> statements, size_t from = 0);
+
+	// For a heap that went past its memory limit outside of a call.
+	void reportOutOfMemory();
+
+	// An empty state that starts out in the current scope and lets calls nest `depthLimit` deep.
+	ExecutionState newState(size_t depthLimit) const;
+
+	EventLoop& eventLoop();
+
+	// Trades the current state for `other`. The stacks keep their buffers, so
+	// the spans into them stay valid on both sides.
+	void swapState(ExecutionState& other);
+
+	void executeBlock(const std::vector<Stmt*>& statements, Environment* environment);
+
+	// Runs a function body whose locals live on the stack, starting with its arguments.
+	void executeFrame(const std::vector<Stmt*>& statements, Environment* closure, CallParams arguments);
 
-	void executeBlock(const std::vector<Stmt*> statements, Environment* environment);
+	// Calls from outside the script. Errors are reported at `at`.
+	Object call(const Token& at, const Object& callee, CallParams args);
 
+	// Replaces the call whose arguments are `current` with the pending tail
+	// call. Returns the new arguments; the new callee is right below them.
+	CallParams enterTailCall(CallParams current);
+
+	// An expression names an Environment `depth` levels out, a stack slot or
+	// a global. Each call replaces whatever was recorded for the address
+	// before, which may belong to a syntax tree that has been freed.
 	inline void resolve(const Expr* expr, int depth) {
 		locals[expr] = depth;
+		slots.erase(expr);
+		globalSlots.erase(expr);
+	}
+
+	inline void resolveSlot(const Expr* expr, int slot) {
+		slots[expr] = slot;
+		locals.erase(expr);
+		globalSlots.erase(expr);
+	}
+
+	void resolveGlobal(const Expr* expr, const std::string& name);
+
+	// Leaves `expr` to be looked up by name through the scopes it runs in.
+	inline void resolveByName(const Expr* expr) {
+		locals.erase(expr);
+		slots.erase(expr);
+		globalSlots.erase(expr);
+	}
+
+	// Drops what the table knows of a global, after a top-level definition
+	// may have hidden a native of the same name.
+	void forgetGlobal(const std::string& name);
+
+	// Drops the whole table, for when the top-level scope is replaced.
+	void forgetGlobals();
+
+	inline int depthOf(const Expr* expr) const {
+		auto found = locals.find(expr);
+		return found != locals.end() ? found->second : -1;
+	}
+
+	inline int slotOf(const Expr* expr) const {
+		auto found = slots.find(expr);
+		return found != slots.end() ? found->second : -1;
 	}
 
+	Object visitArrayLiteralExpr(const ArrayLiteral* expr) override;
 	Object visitLiteralExpr(const Literal* expr) override;
 	Object visitLogicalExpr(const Logical* expr) override;
 	Object visitGroupingExpr(const Grouping* expr) override;
@@ -78,12 +269,15 @@ public:
 	Object visitAssignExpr(const Assign* expr) override;
 	Object visitGetExpr(const Get* expr) override;
 	Object visitSetExpr(const Set* expr) override;
+	Object visitIndexExpr(const Index* expr) override;
+	Object visitSetIndexExpr(const SetIndex* expr) override;
 	Object visitSuperExpr(const Super* expr) override;
 	Object visitThisExpr(const This* expr) override;
 
 /////////////////STATEMENTS///////////////////
 
 	void visitExpressionStmt(const Expression* stmt) override;
+	void visitImportStmt(const Import* stmt) override;
 	void visitPrintStmt(const Print* stmt) override;
 	void visitVarStmt(const Var* stmt) override;
 	void visitBlockStmt(const Block* stmt) override;
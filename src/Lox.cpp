@@ -0,0 +1,446 @@
+module Lox;
+import Lox;
+
+import <iostream>;
+import <fstream>;
+import <sstream>;
+import <vector>;
+
+import <memory>;
+import <optional>;
+import <functional>;
+import <iomanip>;
+import <string>;
+import <utility>;
+import <new>;
+
+import Object;
+import Token;
+import Environment;
+import Scanner;
+import Parser;
+import Resolver;
+import Interpreter;
+import Output;
+import GC;
+import Error;
+import Cache;
+import Snapshot;
+import Modules;
+import Trace;
+import Stats;
+import Memory;
+
+Lox::Lox(std::ostream& out, std::ostream& err, size_t maxDepth, NumberFormat numbers)
+	: reporter{ err }, output{ out, reporter, numbers }, gc{}, interpreter{ gc, reporter, output, maxDepth } {
+	connect();
+}
+
+Lox::Lox(int outFd, std::ostream& err, size_t maxDepth, NumberFormat numbers)
+	: reporter{ err }, output{ outFd, reporter, numbers }, gc{}, interpreter{ gc, reporter, output, maxDepth } {
+	connect();
+}
+
+void Lox::connect() {
+	interpreter.onImport = [this](const Import* stmt) { return importModule(stmt); };
+	interpreter.onLazyBody = [this](Function* function) { return parseBody(function); };
+}
+
+size_t Lox::stackSizeFor(size_t maxDepth) {
+	return Interpreter::nativeStackFor(maxDepth);
+}
+
+Lox::~Lox() {
+	//scripts still point at functions the GC owns
+	scripts.clear();
+	gc.deleteAll();
+}
+
+void Lox::run(std::string source) {
+	UseBudget use{ *gc.memory };
+	Stats::Use counting{ gc.counts };
+	try {
+		runSource(std::move(source));
+	}
+	catch (std::bad_alloc&) {
+		//compiling went past the memory limit
+		interpreter.reportOutOfMemory();
+	}
+}
+
+void Lox::runSource(std::string source) {
+	Scanner scanner = Scanner(source, reporter);
+	auto tokens = scanner.scanTokens();
+
+	Parser parser = Parser(std::move(tokens), reporter);
+	ParseResult parseResult = parser.parse();
+
+	if (reporter.hadError) return;
+
+	Resolver resolver = Resolver(interpreter, gc);
+	resolver.resolve(parseResult.stmts);
+
+	// Stop if there was a syntax error.
+	if (!reporter.hadError) {
+		preloadImports(parseResult.stmts, "");
+		interpreter.interpret(parseResult.stmts);
+		output.flush();
+	}
+
+}
+
+void Lox::runStream(std::string source, const std::string& path) {
+	Trace::Span stream{ "run", "stream" };
+	UseBudget use{ *gc.memory };
+	Stats::Use counting{ gc.counts };
+	Scanner scanner = Scanner(source, reporter);
+	Parser parser = Parser(scanner, reporter);
+	Resolver resolver = Resolver(interpreter, gc);
+
+	while (!parser.done()) {
+		ParseResult declaration = ParseResult({ parser.parseNext() });
+		if (reporter.hadError) return;
+
+		resolver.resolve(declaration.stmts);
+		if (reporter.hadError) return;
+		Modules::resolveImports(declaration.stmts, path);
+
+		interpreter.interpret(declaration.stmts);
+		output.flush();
+		if (reporter.hadRuntimeError) return;
+
+		//the declaration is freed here, except for functions, which the GC owns
+	}
+}
+
+bool Lox::compileFile(std::string path, std::string source, uint64_t sourceHash, bool useCache, std::vector<Stmt*>& stmts) {
+	//the cache holds whole syntax trees
+	if (lazyBodies) useCache = false;
+
+	std::string cachePath = Cache::pathFor(path);
+	Trace::Span load{ "compile", "load cache" };
+	if (useCache && Cache::load(cachePath, sourceHash, stmts, interpreter, gc)) return true;
+	load.end();
+
+	Trace::Span scan{ "compile", "scan" };
+	Scanner scanner = Scanner(source, reporter);
+	auto tokens = scanner.scanTokens();
+	scan.end();
+
+	Trace::Span parse{ "compile", "parse" };
+	Parser parser = Parser(std::move(tokens), reporter);
+	if (lazyBodies) parser.lazySource = std::make_shared<const std::string>(std::move(source));
+	ParseResult parseResult = parser.parse();
+	parse.end();
+
+	if (reporter.hadError) return false;
+
+	Trace::Span resolve{ "compile", "resolve" };
+	Resolver resolver = Resolver(interpreter, gc);
+	resolver.resolve(parseResult.stmts);
+	resolve.end();
+
+	if (reporter.hadError) return false;
+
+	if (useCache) Cache::store(cachePath, sourceHash, parseResult.stmts, interpreter);
+	std::swap(stmts, parseResult.stmts);
+	return true;
+}
+
+int Lox::runFile(const RunOptions& options) {
+	if (options.memoryLimit) gc.memory->limit = options.memoryLimit;
+	UseBudget use{ *gc.memory };
+	Stats::Use counting{ gc.counts };
+	int exitCode;
+	try {
+		exitCode = runScript(options);
+	}
+	catch (std::bad_alloc&) {
+		//loading or compiling went past the memory limit
+		interpreter.reportOutOfMemory();
+		exitCode = 70;
+	}
+	if (options.stats) printStats();
+	return exitCode;
+}
+
+void Lox::printStats() {
+	std::vector<std::pair<std::string, double>> counters, calls;
+	gc.stats(counters, calls);
+
+	std::ostringstream report;
+	report << std::fixed << std::setprecision(0);
+	report << "-- stats\n";
+	for (const auto& [name, value] : counters) {
+		report << std::left << std::setw(24) << name << std::setprecision(name.ends_with(" ms") ? 3 : 0) << value << "\n";
+	}
+	//the hottest functions are the interesting ones
+	report << "-- calls\n";
+	for (size_t i = 0; i < calls.size() && i < 20; i++) {
+		report << std::left << std::setw(24) << calls[i].first << calls[i].second << "\n";
+	}
+	reporter.err << report.str();
+}
+
+int Lox::runScript(const RunOptions& options) {
+	std::ifstream input{options.script};
+	if (!input) return 69;
+	std::stringstream buffer;
+	buffer << input.rdbuf();
+	std::string source = buffer.str();
+	uint64_t sourceHash = Cache::hashSource(source);
+
+	std::string scriptPath = Modules::resolvePath(options.script, "");
+	imported.insert(scriptPath);
+	cacheModules = options.useCache;
+	lazyBodies = options.lazy;
+	if (!options.heapProfilePath.empty() && !gc.startProfile(options.heapProfilePath)) {
+		reporter.err << "Could not write heap profile '" << options.heapProfilePath << "'.\n";
+	}
+
+	if (options.stream) {
+		runStream(source, scriptPath);
+		return exitCode();
+	}
+
+	std::vector<Stmt*> stmts;
+	size_t next = 0;
+	bool snapshotting = !options.snapshotPath.empty() && !options.lazy;
+	bool restored = snapshotting && Snapshot::restore(options.snapshotPath, sourceHash, stmts, next, interpreter, gc);
+
+	if (restored || compileFile(options.script, source, sourceHash, options.useCache, stmts)) {
+		ParseResult program = ParseResult(stmts);
+		preloadImports(program.stmts, scriptPath);
+
+		if (snapshotting && !restored) {
+			interpreter.onSnapshot = [&](size_t next) {
+				if (!Snapshot::write(options.snapshotPath, sourceHash, program.stmts, next, interpreter)) {
+					reporter.err << "Could not write snapshot '" << options.snapshotPath << "'.\n";
+				}
+			};
+		}
+
+		Trace::Span interpret{ "run", "interpret" };
+		interpreter.interpret(program.stmts, next);
+		interpret.end();
+		interpreter.onSnapshot = nullptr;
+		output.flush();
+	}
+
+	return exitCode();
+}
+
+int Lox::exitCode() const {
+	if (reporter.hadError) return 65;
+	if (reporter.hadRuntimeError) return 70;
+	if (reporter.hadOutputError) return 74;
+	return 0;
+}
+
+const Script* Lox::compile(std::string source) {
+	reporter.hadError = false;
+
+	Trace::Span scan{ "compile", "scan" };
+	Scanner scanner = Scanner(source, reporter);
+	auto tokens = scanner.scanTokens();
+	scan.end();
+
+	Trace::Span parse{ "compile", "parse" };
+	Parser parser = Parser(std::move(tokens), reporter);
+	if (lazyBodies) parser.lazySource = std::make_shared<const std::string>(std::move(source));
+	ParseResult parseResult = parser.parse();
+	parse.end();
+
+	if (reporter.hadError) return nullptr;
+
+	Trace::Span resolve{ "compile", "resolve" };
+	Resolver resolver = Resolver(interpreter, gc);
+	resolver.resolve(parseResult.stmts);
+	resolve.end();
+
+	if (reporter.hadError) return nullptr;
+
+	preloadImports(parseResult.stmts, "");
+	auto script = std::make_unique<Script>();
+	std::swap(script->program.stmts, parseResult.stmts);
+	scripts.push_back(std::move(script));
+	return scripts.back().get();
+}
+
+bool Lox::execute(const Script* script) {
+	UseBudget use{ *gc.memory };
+	Stats::Use counting{ gc.counts };
+	reporter.hadRuntimeError = false;
+	Trace::Span interpret{ "run", "interpret" };
+	interpreter.interpret(script->program.stmts);
+	output.flush();
+	return !reporter.hadRuntimeError;
+}
+
+namespace {
+	// Compiles a module in an instance of its own, so modules can compile side by side.
+	void compileModule(Modules::Compiled& module, bool useCache) {
+		std::ifstream input{ module.path };
+		if (!input) return;
+		std::stringstream buffer;
+		buffer << input.rdbuf();
+		std::string source = buffer.str();
+
+		std::ostringstream out, errors;
+		Lox scratch = Lox(out, errors);
+		std::vector<Stmt*> stmts;
+		if (scratch.compileFile(module.path, source, Cache::hashSource(source), useCache, stmts)) {
+			ParseResult program = ParseResult(stmts);
+			std::vector<const Function*> functions;
+			Cache::encodeProgram(module.program, program.stmts, scratch.interpreter, functions);
+			module.imports = Modules::resolveImports(program.stmts, module.path);
+			module.ok = true;
+		}
+		module.errors = errors.str();
+	}
+
+	Modules::Compiler moduleCompiler(bool useCache) {
+		return [useCache](Modules::Compiled& module) { compileModule(module, useCache); };
+	}
+}
+
+void Lox::preloadImports(const std::vector<Stmt*>& stmts, const std::string& from) {
+	std::vector<std::string> paths = Modules::resolveImports(stmts, from);
+	if (paths.empty()) return;
+
+	Modules::compile(std::move(paths), moduleCompiler(cacheModules), stackSizeFor(interpreter.maxDepth));
+}
+
+const std::vector<Stmt*>* Lox::importModule(const Import* stmt) {
+	if (imported.contains(stmt->resolved)) return nullptr;
+
+	//preloading compiled it already, unless the import was only resolved as it ran
+	const Modules::Compiled* module = Modules::find(stmt->resolved);
+	if (!module) {
+		Modules::compile({ stmt->resolved }, moduleCompiler(cacheModules), stackSizeFor(interpreter.maxDepth));
+		module = Modules::find(stmt->resolved);
+	}
+
+	if (!module->ok) {
+		//the import fails as it runs, whatever stopped the module compiling
+		output.flush();
+		reporter.err << module->errors;
+		Modules::retry(stmt->resolved);
+		throw Error::RuntimeError(stmt->keywrd, "Could not import '" + stmt->path + "'.");
+	}
+
+	auto script = std::make_unique<Script>();
+	std::vector<Function*> functions;
+	const char* cur = module->program.data();
+	if (!Cache::decodeProgram(cur, cur + module->program.size(), script->program.stmts, functions, interpreter, gc)) {
+		throw Error::RuntimeError(stmt->keywrd, "Could not import '" + stmt->path + "'.");
+	}
+
+	Modules::resolveImports(script->program.stmts, stmt->resolved);
+	//a module that failed to import may be imported again
+	imported.insert(stmt->resolved);
+	scripts.push_back(std::move(script));
+	return &scripts.back()->program.stmts;
+}
+
+bool Lox::parseBody(Function* function) {
+	//errors wait until the output printed before them is out
+	std::ostringstream errors;
+	Error::Reporter bodyReporter{ errors };
+
+	Trace::Span parse{ "compile", function->id.lexeme };
+	const LazyBody& lazy = *function->lazy;
+	Scanner scanner = Scanner(lazy.source->substr(lazy.begin, lazy.end - lazy.begin), bodyReporter, lazy.line);
+	Parser parser = Parser(scanner.scanTokens(), bodyReporter);
+	ParseResult body = parser.parse();
+
+	if (!bodyReporter.hadError) {
+		std::swap(function->body, body.stmts);
+		Resolver resolver = Resolver(interpreter, gc, bodyReporter);
+		resolver.resolveLazy(function);
+	}
+
+	if (bodyReporter.hadError) {
+		//stays unparsed, so every call reports the errors
+		function->deleteBody();
+		function->fns_in_body.clear();
+		output.flush();
+		reporter.err << errors.str();
+		reporter.hadError = true;
+		return false;
+	}
+
+	function->lazy.reset();
+	return true;
+}
+
+Environment* Lox::topLevel() const {
+	Environment* env = interpreter.environment;
+	while (!env->isTopLevel && env->enclosing) {
+		env = env->enclosing;
+	}
+	return env;
+}
+
+std::optional<Object> Lox::getGlobal(const std::string& name) const {
+	Environment* top = topLevel();
+	if (auto found = top->values.find(name); found != top->values.end()) return found->second;
+
+	const Environment& natives = interpreter.globals;
+	if (auto found = natives.values.find(name); found != natives.values.end()) return found->second;
+
+	return std::nullopt;
+}
+
+void Lox::setGlobal(const std::string& name, Object value) {
+	topLevel()->define(name, value);
+	interpreter.forgetGlobal(name);
+}
+
+namespace {
+	// A host function that may capture state, unlike NativeFn.
+	class HostFn : public LoxCallable {
+		const std::function<Object(Interpreter&, CallParams)> fn;
+		const int arit;
+
+	public:
+		HostFn(std::function<Object(Interpreter&, CallParams)> fn, int arity) : fn{ fn }, arit{ arity } { }
+
+		int arity() const override { return arit; }
+		Object call(Interpreter& interpreter, CallParams args) override { return fn(interpreter, args); }
+		std::string toString() const override { return "<native fn>"; }
+	};
+}
+
+void Lox::defineNative(const std::string& name, std::function<Object(Interpreter&, CallParams)> fn, int arity) {
+	interpreter.globals.define(name, new HostFn(fn, arity));
+	interpreter.forgetGlobal(name);
+}
+
+Object Lox::call(const Object& callee, CallParams args) {
+	static const Token host = Token(TokenType::IDENTIFIER, "<host>", 0);
+	UseBudget use{ *gc.memory };
+	Stats::Use counting{ gc.counts };
+	return interpreter.call(host, callee, args);
+}
+
+void Lox::pin(const Object& value) {
+	if (value.isPointer()) gc.pin(value.getPointer());
+}
+
+void Lox::unpin(const Object& value) {
+	if (value.isPointer()) gc.unpin(value.getPointer());
+}
+
+void Lox::runPrompt() {
+	while (true) {
+		std::cout << "> ";
+
+		std::string line;
+		getline(std::cin, line);
+
+		if (line.empty()) break;
+		run(line);
+		reporter.hadError = false;
+	}
+}
@@ -0,0 +1,138 @@
+export module Lox;
+
+import <string>;
+import <vector>;
+import <iostream>;
+import <cstdint>;
+import <memory>;
+import <optional>;
+import <functional>;
+import <unordered_set>;
+
+import Object;
+import Stmt;
+import Parser;
+import GC;
+import Error;
+import Interpreter;
+import Output;
+
+export struct RunOptions {
+	bool useCache = true;
+	// Parse function bodies on their first call. Skips the cache and snapshots.
+	bool lazy = false;
+	// Scan, parse, resolve and run one top-level declaration at a time, without the cache or snapshots.
+	bool stream = false;
+	std::string snapshotPath;
+	std::string script;
+	// Print the counters of Stats to the error stream once the script is done.
+	bool stats = false;
+	// Append the live objects per allocation site to this file after each collection.
+	std::string heapProfilePath;
+	// Bytes the heap may hold before allocating fails with "Out of memory.", or 0 for no limit.
+	size_t memoryLimit = 0;
+};
+
+// A program compiled by Lox::compile. It stays valid as long as the instance does.
+export struct Script {
+	ParseResult program;
+
+	Script() : program{ {} } {}
+};
+
+// One interpreter with its own heap, globals, error state and output.
+// Nothing is shared between instances, so each can run on its own thread.
+// Printed output is buffered, and flushed when a script finishes or fails.
+//
+// Embedding: compile a script once, execute it to define its globals, then
+// fetch functions with getGlobal and invoke them with call as often as needed.
+// Values the host keeps between calls must be pinned, or the GC may free them.
+// Strings and numbers may outlive the Lox they came from; other objects die with it.
+export class Lox {
+	std::vector<std::unique_ptr<Script>> scripts;
+
+	// Modules that have run in this instance. Each runs once, however often it is imported.
+	std::unordered_set<std::string> imported;
+	// Whether modules read and write their compiled form next to them.
+	bool cacheModules = true;
+
+	Environment* topLevel() const;
+
+	// Points the interpreter's hooks at this instance.
+	void connect();
+
+	const std::vector<Stmt*>* importModule(const Import* stmt);
+	bool parseBody(Function* function);
+
+	// Compiles what the statements import, in parallel, before any of it runs.
+	void preloadImports(const std::vector<Stmt*>& stmts, const std::string& from);
+
+	int runScript(const RunOptions& options);
+	// 65 after a compile error, 70 after a runtime error, 74 if output was lost, else 0.
+	int exitCode() const;
+	void runSource(std::string source);
+	void printStats();
+
+public:
+	Error::Reporter reporter;
+	Output output;
+	GC gc;
+	Interpreter interpreter;
+
+	// Only skim the bodies of top-level functions and methods in compileFile
+	// and compile, and parse each on its first call. Saves the work on
+	// functions that are never called, but errors in a body only show up then.
+	bool lazyBodies = false;
+
+	// Calls nest at most maxDepth deep. The thread running the instance needs
+	// a native stack of stackSizeFor(maxDepth) bytes.
+	Lox(std::ostream& out = std::cout, std::ostream& err = std::cerr, size_t maxDepth = Interpreter::defaultMaxDepth,
+		NumberFormat numbers = NumberFormat::SHORTEST);
+
+	// Prints straight to a file descriptor, skipping iostreams.
+	Lox(int outFd, std::ostream& err, size_t maxDepth = Interpreter::defaultMaxDepth, NumberFormat numbers = NumberFormat::SHORTEST);
+
+	static size_t stackSizeFor(size_t maxDepth);
+	~Lox();
+
+	Lox(const Lox&) = delete;
+	Lox& operator=(const Lox&) = delete;
+
+	void run(std::string source);
+
+	// Runs each top-level declaration as soon as it is parsed and frees it
+	// afterwards, so memory doesn't grow with the length of the source. A
+	// syntax error stops the run, but what came before it has already run.
+	// Imports are relative to the file at `path`, or to the working directory without one.
+	void runStream(std::string source, const std::string& path = "");
+
+	// Scans, parses and resolves a script, reusing the compiled form next to it when it is still valid.
+	bool compileFile(std::string path, std::string source, uint64_t sourceHash, bool useCache, std::vector<Stmt*>& stmts);
+
+	// Returns the process exit code for the script.
+	int runFile(const RunOptions& options);
+
+	void runPrompt();
+
+	// Returns nullptr on a compile error, which is reported to the error stream.
+	const Script* compile(std::string source);
+
+	// Runs the top-level statements. Returns false on a runtime error.
+	bool execute(const Script* script);
+
+	std::optional<Object> getGlobal(const std::string& name) const;
+	void setGlobal(const std::string& name, Object value);
+	void defineNative(const std::string& name, std::function<Object(Interpreter&, CallParams)> fn, int arity);
+
+	// Typed fast path, e.g. defineNative("hypot", +[](double x, double y) { return std::hypot(x, y); }).
+	// Arity and argument checks come from the signature.
+	template<class R, class... Args> void defineNative(const std::string& name, R(*fn)(Args...)) {
+		interpreter.globals.define(name, new TypedNativeFn<R(Args...)>(fn));
+	}
+
+	// Throws Error::RuntimeError if the callee fails or isn't callable with these arguments.
+	Object call(const Object& callee, CallParams args);
+
+	void pin(const Object& value);
+	void unpin(const Object& value);
+};
@@ -0,0 +1,79 @@
+export module Memory;
+
+import <vector>;
+import <unordered_map>;
+import <string>;
+import <memory>;
+import <new>;
+import <utility>;
+import <type_traits>;
+import <cstddef>;
+import <cstdint>;
+
+// The bytes one heap holds: its objects and the storage of the containers
+// inside them. Allocations past `limit` throw std::bad_alloc. Containers
+// share ownership of their budget, so a string the host kept can still be
+// freed after the heap it came from is gone.
+export struct Budget : std::enable_shared_from_this<Budget> {
+	size_t bytes = 0;
+	size_t limit = SIZE_MAX;
+
+	// What containers created on this thread count against, or nullptr. Set
+	// by UseBudget while an interpreter runs.
+	static inline thread_local Budget* current = nullptr;
+
+	inline bool allows(size_t more) const {
+		return bytes <= limit && more <= limit - bytes;
+	}
+};
+
+// Makes `budget` the current one until the end of the scope.
+export struct UseBudget {
+	Budget* previous;
+
+	UseBudget(Budget& budget) : previous{ std::exchange(Budget::current, &budget) } { }
+	~UseBudget() { Budget::current = previous; }
+
+	UseBudget(const UseBudget&) = delete;
+	UseBudget& operator=(const UseBudget&) = delete;
+};
+
+// An allocator that counts what it hands out against the budget that was
+// current when the container was created. Containers created with no
+// budget current aren't counted.
+export template<class T> class Counted {
+public:
+	using value_type = T;
+	using propagate_on_container_copy_assignment = std::true_type;
+	using propagate_on_container_move_assignment = std::true_type;
+	using propagate_on_container_swap = std::true_type;
+	using is_always_equal = std::false_type;
+
+	std::shared_ptr<Budget> budget;
+
+	Counted() noexcept : budget{ Budget::current ? Budget::current->shared_from_this() : nullptr } { }
+	Counted(std::shared_ptr<Budget> budget) noexcept : budget{ std::move(budget) } { }
+	template<class U> Counted(const Counted<U>& other) noexcept : budget{ other.budget } { }
+
+	T* allocate(size_t n) {
+		size_t size = n * sizeof(T);
+		if (budget) {
+			if (!budget->allows(size)) throw std::bad_alloc();
+			budget->bytes += size;
+		}
+		return std::allocator<T>().allocate(n);
+	}
+
+	void deallocate(T* ptr, size_t n) noexcept {
+		if (budget) budget->bytes -= n * sizeof(T);
+		std::allocator<T>().deallocate(ptr, n);
+	}
+
+	template<class U> inline bool operator==(const Counted<U>& other) const { return budget == other.budget; }
+};
+
+export template<class T> using CountedVector = std::vector<T, Counted<T>>;
+
+export using CountedString = std::basic_string<char, std::char_traits<char>, Counted<char>>;
+
+export template<class K, class V> using CountedMap = std::unordered_map<K, V, std::hash<K>, std::equal_to<K>, Counted<std::pair<const K, V>>>;
@@ -0,0 +1,92 @@
+module Modules;
+import Modules;
+
+import <string>;
+import <vector>;
+import <unordered_map>;
+import <memory>;
+import <mutex>;
+import <algorithm>;
+import <filesystem>;
+import <system_error>;
+
+import Stmt;
+import ThreadPool;
+
+namespace {
+	std::mutex modulesMutex;
+	std::unordered_map<std::string, std::unique_ptr<Modules::Compiled>> compiledModules;
+	//failed modules given up for a retry, kept for those still pointing at them
+	std::vector<std::unique_ptr<Modules::Compiled>> retriedModules;
+}
+
+std::string Modules::resolvePath(const std::string& path, const std::string& from) {
+	std::error_code ec;
+	std::filesystem::path base = from.empty() ? std::filesystem::current_path(ec) : std::filesystem::path(from).parent_path();
+	std::filesystem::path joined = base / path;
+
+	//the same file reached by different relative paths is one module
+	std::filesystem::path canonical = std::filesystem::weakly_canonical(joined, ec);
+	return ec ? joined.lexically_normal().string() : canonical.string();
+}
+
+std::vector<std::string> Modules::resolveImports(const std::vector<Stmt*>& stmts, const std::string& from) {
+	std::vector<std::string> paths;
+	for (Stmt* stmt : stmts) {
+		if (auto importStmt = dynamic_cast<Import*>(stmt)) {
+			importStmt->resolved = resolvePath(importStmt->path, from);
+			paths.push_back(importStmt->resolved);
+		}
+	}
+	return paths;
+}
+
+void Modules::compile(std::vector<std::string> paths, const Compiler& compiler, size_t stackSize, unsigned threads) {
+	//a module's imports are only known once it is compiled, so they make up the next wave
+	while (!paths.empty()) {
+		std::vector<std::unique_ptr<Compiled>> wave;
+		{
+			std::lock_guard<std::mutex> lock{ modulesMutex };
+			for (const std::string& path : paths) {
+				if (compiledModules.contains(path)) continue;
+				if (std::any_of(wave.begin(), wave.end(), [&](const auto& module) { return module->path == path; })) continue;
+
+				wave.push_back(std::make_unique<Compiled>());
+				wave.back()->path = path;
+			}
+		}
+
+		if (wave.size() == 1) {
+			compiler(*wave[0]);
+		}
+		else if (wave.size() > 1) {
+			ThreadPool pool{ std::clamp<unsigned>((unsigned)wave.size(), 1, std::max(threads, 1u)), stackSize };
+			for (auto& module : wave) {
+				pool.submit([&compiler, compiled = module.get()] { compiler(*compiled); });
+			}
+			pool.wait();
+		}
+
+		paths.clear();
+		std::lock_guard<std::mutex> lock{ modulesMutex };
+		for (auto& module : wave) {
+			paths.insert(paths.end(), module->imports.begin(), module->imports.end());
+			//another interpreter may have compiled it meanwhile, and either copy will do
+			compiledModules.try_emplace(module->path, std::move(module));
+		}
+	}
+}
+
+const Modules::Compiled* Modules::find(const std::string& path) {
+	std::lock_guard<std::mutex> lock{ modulesMutex };
+	auto found = compiledModules.find(path);
+	return found != compiledModules.end() ? found->second.get() : nullptr;
+}
+
+void Modules::retry(const std::string& path) {
+	std::lock_guard<std::mutex> lock{ modulesMutex };
+	auto found = compiledModules.find(path);
+	if (found == compiledModules.end() || found->second->ok) return;
+	retriedModules.push_back(std::move(found->second));
+	compiledModules.erase(found);
+}
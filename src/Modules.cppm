@@ -0,0 +1,45 @@
+export module Modules;
+
+import <string>;
+import <vector>;
+import <functional>;
+import <thread>;
+
+import Stmt;
+
+// Files brought in with `import "path";`. Each is compiled once per process,
+// into the form the cache stores, and every interpreter that imports it
+// decodes its own copy from that.
+export namespace Modules {
+
+	struct Compiled {
+		std::string path;
+		bool ok = false;
+		// The encoded program, or what went wrong compiling it.
+		std::string program;
+		std::string errors;
+		// Resolved paths of the modules it imports.
+		std::vector<std::string> imports;
+	};
+
+	// Fills in a Compiled given its path. Runs on worker threads, so it must not share an interpreter.
+	typedef std::function<void(Compiled&)> Compiler;
+
+	// The canonical form of `path`, taken relative to the file `from`, or to the working directory if it is empty.
+	std::string resolvePath(const std::string& path, const std::string& from);
+
+	// Resolves the imports among the top-level statements and returns their paths.
+	std::vector<std::string> resolveImports(const std::vector<Stmt*>& stmts, const std::string& from);
+
+	// Compiles the modules at `paths` and everything they import that this
+	// process hasn't compiled yet, each level of imports in parallel on
+	// threads with `stackSize` bytes of stack, or the default if it is 0.
+	void compile(std::vector<std::string> paths, const Compiler& compiler, size_t stackSize = 0, unsigned threads = std::thread::hardware_concurrency());
+
+	// nullptr if the module hasn't been compiled. What it points to stays valid until the process exits.
+	const Compiled* find(const std::string& path);
+
+	// Lets the module at `path` be compiled again if it failed, e.g. once
+	// the file is fixed. Copies already found stay valid.
+	void retry(const std::string& path);
+}
@@ -2,15 +2,559 @@
 export module NativeFunctions;
 
 import <chrono>;
+import <cmath>;
+import <string>;
+import <vector>;
+import <algorithm>;
+import <string_view>;
+import <charconv>;
+import <system_error>;
+import <memory>;
+import <unordered_set>;
+import <climits>;
 
+import Memory;
 import Object;
+import Environment;
+import Token;
+import Interpreter;
+import GC;
+import Simd;
+import Output;
+import Coroutine;
+import EventLoop;
+import Workers;
+import Snapshot;
+
+namespace NativeFunction {
+	// The numbers of an array, unboxing it again if it only holds numbers.
+	CountedVector<double>& numbers(LoxArray* array) {
+		if (array->boxed) {
+			for (const Object& value : array->values) {
+				if (!value.isDouble()) throw NativeError("Array elements must be numbers.");
+			}
+			array->numbers.reserve(array->values.size());
+			for (const Object& value : array->values) {
+				array->numbers.push_back(value.getDouble());
+			}
+			array->values = CountedVector<Object>(array->values.get_allocator());
+			array->boxed = false;
+		}
+		return array->numbers;
+	}
+
+	size_t sizeArg(const Object& arg, size_t index) {
+		if (!arg.isDouble() || arg.getDouble() < 0 || arg.getDouble() != std::floor(arg.getDouble())) {
+			throw NativeError("Argument " + std::to_string(index + 1) + " must be a non-negative integer.");
+		}
+		//past 2^53 doubles skip integers, and no array or string is that long anyway
+		if (arg.getDouble() > 9007199254740992.0) throw NativeError("Argument " + std::to_string(index + 1) + " is too large.");
+		return (size_t)arg.getDouble();
+	}
+
+	const LoxString& stringArg(const Object& arg, size_t index) {
+		if (!arg.isString()) throw NativeError("Argument " + std::to_string(index + 1) + " must be a string.");
+		return arg.getLoxString();
+	}
+
+	// Where `part` next occurs in `text` at or after `start`, or text.size() if it doesn't.
+	size_t findFrom(std::string_view text, size_t start, std::string_view part) {
+		return start + Simd::find(text.data() + start, text.size() - start, part.data(), part.size());
+	}
+
+	Object keyArg(const Object& arg, size_t index) {
+		if (!LoxMap::isKey(arg)) throw NativeError("Argument " + std::to_string(index + 1) + " must be a number other than NaN, or a string.");
+		return arg;
+	}
+
+	int fdArg(const Object& arg, size_t index) {
+		if (!arg.isDouble() || arg.getDouble() < 0 || arg.getDouble() > INT_MAX || arg.getDouble() != std::floor(arg.getDouble())) {
+			throw NativeError("Argument " + std::to_string(index + 1) + " must be a descriptor.");
+		}
+		return (int)arg.getDouble();
+	}
+
+	// Queues an I/O operation for the event loop. Its callback takes the
+	// result, or inside a coroutine, a nil callback makes the coroutine wait
+	// for the result and this returns it.
+	Object startIo(Interpreter& interpreter, int fd, EventLoop::Op op, const Object& callback, size_t index, Object text = Object()) {
+		EventLoop::Pending operation{ op, callback };
+		operation.text = text;
+		if (callback.isNil() && interpreter.coroutine) operation.waiter = interpreter.coroutine;
+		else if (!callback.isCallable() || callback.callableArity() != 1) {
+			throw NativeError("Argument " + std::to_string(index + 1) + " must be a function of one argument.");
+		}
+
+		LoxCoroutine* waiter = operation.waiter;
+		interpreter.eventLoop().submit(fd, std::move(operation));
+		if (!waiter) return Object();
+
+		//its caller gets nil back, and the loop resumes it with the result
+		waiter->waiting = true;
+		return waiter->yield(Object());
+	}
+
+	// Keeps an object the host code holds alive across calls back into Lox.
+	struct Pin {
+		GC& gc;
+		void* ptr;
+
+		Pin(GC& gc, void* ptr) : gc{ gc }, ptr{ ptr } { gc.pin(ptr); }
+		~Pin() { gc.unpin(ptr); }
+	};
+
+	// Whether fn, or a function it calls or passes on by name, changes what
+	// is declared outside it. Names are looked up in fn's closure as it is now.
+	bool changesOutside(Interpreter& interpreter, LoxFn* fn, std::unordered_set<const Function*>& checked) {
+		Function* function = fn->function;
+		if (!checked.insert(function).second) return false;
+		if (function->lazy && !(interpreter.onLazyBody && interpreter.onLazyBody(function))) {
+			throw NativeError("Could not compile '" + function->id.lexeme + "'.");
+		}
+		if (function->changesOutside) return true;
+
+		//natives that return a new array or map
+		static const std::unordered_set<std::string> creating = { "array", "dict", "keys", "split", "map" };
+		for (const std::string& name : function->creates) {
+			Object* creator = fn->closure->find(name);
+			if (!creator || !creator->isCallable()) return true;
+			if (dynamic_cast<LoxClass*>(creator->getCallablePtr())) continue;
+			if (!creating.contains(name) || creator != interpreter.globals.find(name)) return true;
+		}
+
+		for (const std::string& name : function->callsOutside) {
+			Object* callee = fn->closure->find(name);
+			if (!callee || !callee->isCallable()) continue;
+			if (auto called = dynamic_cast<LoxFn*>(callee->getCallablePtr())) {
+				if (changesOutside(interpreter, called, checked)) return true;
+			}
+			//constructing runs the init of the class and those it calls with super.init
+			for (auto klass = dynamic_cast<LoxClass*>(callee->getCallablePtr()); klass; klass = klass->superclass) {
+				auto init = klass->methods.find("init");
+				if (init != klass->methods.end() && changesOutside(interpreter, init->second, checked)) return true;
+			}
+		}
+		return false;
+	}
+
+	// A function for the parallel natives. Copies of it run side by side, so
+	// it may not change variables or objects it shares with anything else,
+	// nor call functions that do.
+	void parallelArg(Interpreter& interpreter, const Object& arg, size_t index, int arity) {
+		std::string position = "Argument " + std::to_string(index + 1);
+		if (!arg.isCallable() || arg.callableArity() != arity) {
+			throw NativeError(position + " must be a function of " + (arity == 1 ? "one argument." : "two arguments."));
+		}
+		auto fn = dynamic_cast<LoxFn*>(arg.getCallablePtr());
+		if (!fn) return;
+		std::unordered_set<const Function*> checked;
+		if (changesOutside(interpreter, fn, checked)) {
+			throw NativeError(position + " must not change variables or objects it didn't make itself, call methods, or call functions that do.");
+		}
+	}
+}
 
 
 export namespace NativeFunction {
-	Object clock(CallParams) {
+	double clock() {
 		std::chrono::milliseconds ms = std::chrono::duration_cast<std::chrono::milliseconds>(
 			std::chrono::system_clock::now().time_since_epoch()
 		);
-		return Object(static_cast<double>(ms.count()));
+		return static_cast<double>(ms.count());
+	}
+
+	double sqrt(double x) { return std::sqrt(x); }
+	double abs(double x) { return std::fabs(x); }
+	double floor(double x) { return std::floor(x); }
+
+	// array(n) is an array of n zeros.
+	Object array(Interpreter& interpreter, CallParams args) {
+		size_t size = sizeArg(args[0], 0);
+		return Object(interpreter.gc.track(new LoxArray(size)));
+	}
+
+	double len(Object value) {
+		if (value.isArray()) return (double)value.getArrayPtr()->size();
+		if (value.isMap()) return (double)value.getMapPtr()->size();
+		if (value.isString()) return (double)value.getStringView().size();
+		throw NativeError("Argument 1 must be an array, a map or a string.");
+	}
+
+	void push(LoxArray* array, Object value) {
+		array->push(value);
+	}
+
+	Object pop(LoxArray* array) {
+		if (array->size() == 0) throw NativeError("Can't pop from an empty array.");
+		return array->pop();
+	}
+
+	double sum(LoxArray* array) {
+		auto& values = numbers(array);
+		return Simd::sum(values.data(), values.size());
+	}
+
+	double dot(LoxArray* a, LoxArray* b) {
+		auto& left = numbers(a);
+		auto& right = numbers(b);
+		if (left.size() != right.size()) throw NativeError("Arrays must have the same length.");
+		return Simd::dot(left.data(), right.data(), left.size());
+	}
+
+	// Multiplies every element in place.
+	LoxArray* scale(LoxArray* array, double factor) {
+		auto& values = numbers(array);
+		Simd::scale(values.data(), values.size(), factor);
+		return array;
+	}
+
+	// Sorts numbers or strings in place, with NaN after every other number.
+	LoxArray* sort(LoxArray* array) {
+		auto before = [](double a, double b) { return a < b || (std::isnan(b) && !std::isnan(a)); };
+		if (!array->boxed) {
+			std::sort(array->numbers.begin(), array->numbers.end(), before);
+			return array;
+		}
+
+		//checked up front, so a bad element leaves the array as it was
+		bool strings = !array->values.empty() && array->values[0].isString();
+		for (const Object& value : array->values) {
+			if (strings ? !value.isString() : !value.isDouble()) throw NativeError("Can only sort numbers or strings.");
+		}
+
+		if (strings) {
+			std::sort(array->values.begin(), array->values.end(), [](const Object& a, const Object& b) {
+				return a.getStringView() < b.getStringView();
+			});
+		}
+		else {
+			std::sort(array->values.begin(), array->values.end(), [&](const Object& a, const Object& b) {
+				return before(a.getDouble(), b.getDouble());
+			});
+		}
+		return array;
+	}
+
+	// map(array, fn) is a new array of fn applied to every element. Numeric
+	// natives like sqrt run over the unboxed numbers without calling back.
+	Object map(Interpreter& interpreter, CallParams args) {
+		if (!args[0].isArray()) throw NativeError("Argument 1 must be an array.");
+		if (!args[1].isCallable() || args[1].callableArity() != 1) throw NativeError("Argument 2 must be a function of one argument.");
+
+		LoxArray* source = args[0].getArrayPtr();
+		LoxArray* result = interpreter.gc.track(new LoxArray());
+
+		auto op = dynamic_cast<TypedNativeFn<double(double)>*>(args[1].getCallablePtr());
+		if (op && !source->boxed) {
+			const auto& in = source->numbers;
+			auto& out = result->numbers;
+			out.resize(in.size());
+
+			if (op->target() == NativeFunction::sqrt) Simd::sqrt(in.data(), out.data(), in.size());
+			else if (op->target() == NativeFunction::abs) Simd::abs(in.data(), out.data(), in.size());
+			else std::transform(in.begin(), in.end(), out.begin(), op->target());
+			return Object(result);
+		}
+
+		static const Token at = Token(TokenType::IDENTIFIER, "map", 0);
+		Pin pin{ interpreter.gc, result };
+		Object fn = args[1];
+		for (size_t i = 0; i < source->size(); i++) {
+			Object element = source->get(i);
+			result->push(interpreter.call(at, fn, CallParams{ &element, 1 }));
+		}
+		return Object(result);
+	}
+
+	// dict() is an empty map.
+	Object dict(Interpreter& interpreter, CallParams) {
+		return Object(interpreter.gc.track(new LoxMap()));
+	}
+
+	// get(map, key) is nil when the key is missing, unlike map[key].
+	Object get(LoxMap* map, Object key) {
+		const Object* value = map->find(keyArg(key, 1));
+		return value ? *value : Object();
+	}
+
+	Object set(LoxMap* map, Object key, Object value) {
+		map->set(keyArg(key, 1), value);
+		return value;
+	}
+
+	bool has(LoxMap* map, Object key) {
+		return map->find(keyArg(key, 1)) != nullptr;
+	}
+
+	bool remove(LoxMap* map, Object key) {
+		return map->remove(keyArg(key, 1));
+	}
+
+	// keys(map) and values(map) are arrays in the same, unspecified order.
+	Object keys(Interpreter& interpreter, CallParams args) {
+		if (!args[0].isMap()) throw NativeError("Argument 1 must be a map.");
+		LoxMap* map = args[0].getMapPtr();
+		LoxArray* result = interpreter.gc.track(new LoxArray());
+		for (const LoxMap::Slot& slot : map->slots) {
+			if (slot.state == LoxMap::State::FULL) result->push(slot.key);
+		}
+		return Object(result);
+	}
+
+	Object values(Interpreter& interpreter, CallParams args) {
+		if (!args[0].isMap()) throw NativeError("Argument 1 must be a map.");
+		LoxMap* map = args[0].getMapPtr();
+		LoxArray* result = interpreter.gc.track(new LoxArray());
+		for (const LoxMap::Slot& slot : map->slots) {
+			if (slot.state == LoxMap::State::FULL) result->push(slot.value);
+		}
+		return Object(result);
+	}
+
+	// find(text, part) is the index of the first occurrence of part in text, or -1.
+	double find(Object text, Object part) {
+		std::string_view haystack = stringArg(text, 0).view();
+		std::string_view needle = stringArg(part, 1).view();
+		size_t at = findFrom(haystack, 0, needle);
+		return at == haystack.size() && !needle.empty() ? -1 : (double)at;
+	}
+
+	// split(text, separator) is an array of the pieces between separators, sharing
+	// the storage of text. An empty separator splits text into single bytes.
+	Object split(Interpreter& interpreter, CallParams args) {
+		const LoxString& text = stringArg(args[0], 0);
+		std::string_view source = text.view();
+		std::string_view separator = stringArg(args[1], 1).view();
+
+		LoxArray* result = interpreter.gc.track(new LoxArray());
+		result->boxed = true;
+		if (separator.empty()) {
+			for (size_t i = 0; i < source.size(); i++) {
+				result->values.push_back(Object(text.slice(i, 1)));
+			}
+			return Object(result);
+		}
+
+		size_t start = 0;
+		for (size_t at = findFrom(source, 0, separator); at != source.size(); at = findFrom(source, start, separator)) {
+			result->values.push_back(Object(text.slice(start, at - start)));
+			start = at + separator.size();
+		}
+		result->values.push_back(Object(text.slice(start, source.size() - start)));
+		return Object(result);
+	}
+
+	// replace(text, part, replacement) replaces every occurrence of part.
+	Object replace(Object text, Object part, Object replacement) {
+		std::string_view source = stringArg(text, 0).view();
+		std::string_view pattern = stringArg(part, 1).view();
+		std::string_view with = stringArg(replacement, 2).view();
+		if (pattern.empty()) throw NativeError("Argument 2 must not be empty.");
+
+		size_t at = findFrom(source, 0, pattern);
+		if (at == source.size()) return text;
+
+		std::string out;
+		out.reserve(source.size());
+		size_t start = 0;
+		for (; at != source.size(); at = findFrom(source, start, pattern)) {
+			out.append(source.substr(start, at - start));
+			out.append(with);
+			start = at + pattern.size();
+		}
+		out.append(source.substr(start));
+		return Object(std::move(out));
+	}
+
+	// substr(text, start, end) is text from start up to end, sharing its storage.
+	Object substr(Object text, Object start, Object end) {
+		const LoxString& string = stringArg(text, 0);
+		size_t from = sizeArg(start, 1);
+		size_t to = sizeArg(end, 2);
+		if (from > to || to > string.view().size()) throw NativeError("Substring bounds out of range.");
+		return Object(string.slice(from, to - from));
+	}
+
+	// compare(a, b) is -1, 0 or 1 as a sorts before, with or after b.
+	double compare(Object a, Object b) {
+		int order = stringArg(a, 0).view().compare(stringArg(b, 1).view());
+		return order < 0 ? -1 : order > 0 ? 1 : 0;
+	}
+
+	// number(text) is the number text spells out, or nil if it isn't one.
+	Object number(Object text) {
+		std::string_view digits = stringArg(text, 0).view();
+		double value;
+		auto [end, error] = std::from_chars(digits.data(), digits.data() + digits.size(), value);
+		if (error != std::errc() || end != digits.data() + digits.size()) return Object();
+		return Object(value);
+	}
+
+	// Hands buffered output on, e.g. before a long computation.
+	Object flush(Interpreter& interpreter, CallParams) {
+		interpreter.out.flush();
+		return Object();
+	}
+
+	// stats() is a map of the counters --stats prints, with the calls of each
+	// function called so far in a map of its own under "calls".
+	Object stats(Interpreter& interpreter, CallParams) {
+		std::vector<std::pair<std::string, double>> counters, calls;
+		interpreter.gc.stats(counters, calls);
+
+		LoxMap* callCounts = interpreter.gc.track(new LoxMap());
+		for (const auto& [name, value] : calls) {
+			callCounts->set(Object(name), Object(value));
+		}
+		//tracked last, so the collection it may start sees callCounts through it
+		LoxMap* result = new LoxMap();
+		for (const auto& [name, value] : counters) {
+			result->set(Object(name), Object(value));
+		}
+		result->set(Object(std::string("calls")), Object(callCounts));
+		return Object(interpreter.gc.track(result));
+	}
+
+	// heapDump(path) collects and writes the live objects and the references
+	// between them to path as JSON.
+	Object heapDump(Interpreter& interpreter, CallParams args) {
+		std::string path = std::string(stringArg(args[0], 0).view());
+		if (!interpreter.gc.dumpHeap(path)) throw NativeError("Could not write heap dump '" + path + "'.");
+		return Object();
+	}
+
+	// Marks the point a heap snapshot is taken at, once the current top-level statement is done.
+	Object snapshot(Interpreter& interpreter, CallParams) {
+		if (interpreter.onSnapshot) interpreter.snapshotPending = true;
+		return Object();
+	}
+
+	// coroutine(fn) runs fn, a function of no arguments, on a stack of its own.
+	Object coroutine(Interpreter& interpreter, CallParams args) {
+		if (!args[0].isCallable() || args[0].callableArity() != 0) throw NativeError("Argument 1 must be a function of no arguments.");
+		return Object(interpreter.gc.track(new LoxCoroutine(interpreter, args[0])));
+	}
+
+	// Suspends the running coroutine. The call that resumed it returns `value`,
+	// and yield returns what the coroutine is next resumed with.
+	Object yield(Interpreter& interpreter, CallParams args) {
+		if (!interpreter.coroutine) throw NativeError("Can only yield inside a coroutine.");
+		return interpreter.coroutine->yield(args[0]);
+	}
+
+	// True once the coroutine's function has returned.
+	bool done(Object value) {
+		auto coroutine = value.isCallable() ? dynamic_cast<LoxCoroutine*>(value.getCallablePtr()) : nullptr;
+		if (!coroutine) throw NativeError("Argument 1 must be a coroutine.");
+		return coroutine->state == LoxCoroutine::State::FINISHED;
+	}
+
+	// open(path, mode) opens a file for reading ("r"), writing ("w") or appending ("a") and returns its descriptor.
+	Object open(Interpreter& interpreter, CallParams args) {
+		std::string path = std::string(stringArg(args[0], 0).view());
+		std::string mode = std::string(stringArg(args[1], 1).view());
+		return Object((double)interpreter.eventLoop().open(path, mode));
+	}
+
+	// pipe() is an array of the read end and the write end of a new pipe.
+	Object pipe(Interpreter& interpreter, CallParams) {
+		LoxArray* ends = interpreter.gc.track(new LoxArray());
+		for (int fd : interpreter.eventLoop().pipe()) {
+			ends->push(Object((double)fd));
+		}
+		return Object(ends);
+	}
+
+	// listen(path) is a Unix socket bound to path, for accept.
+	Object listen(Interpreter& interpreter, CallParams args) {
+		return Object((double)interpreter.eventLoop().listen(std::string(stringArg(args[0], 0).view())));
+	}
+
+	Object connect(Interpreter& interpreter, CallParams args) {
+		return Object((double)interpreter.eventLoop().connect(std::string(stringArg(args[0], 0).view())));
+	}
+
+	Object close(Interpreter& interpreter, CallParams args) {
+		interpreter.eventLoop().close(fdArg(args[0], 0));
+		return Object();
+	}
+
+	// read(fd, callback) passes what fd has to read next, up to 64KB, to callback, or nil at the end.
+	Object read(Interpreter& interpreter, CallParams args) {
+		return startIo(interpreter, fdArg(args[0], 0), EventLoop::Op::READ, args[1], 1);
+	}
+
+	// write(fd, text, callback) writes all of text and passes its length to callback.
+	Object write(Interpreter& interpreter, CallParams args) {
+		stringArg(args[1], 1);
+		return startIo(interpreter, fdArg(args[0], 0), EventLoop::Op::WRITE, args[2], 2, args[1]);
+	}
+
+	// accept(fd, callback) passes the descriptor of the next connection to a listening socket to callback.
+	Object accept(Interpreter& interpreter, CallParams args) {
+		return startIo(interpreter, fdArg(args[0], 0), EventLoop::Op::ACCEPT, args[1], 1);
+	}
+
+	// Runs the event loop until every operation is done.
+	Object run(Interpreter& interpreter, CallParams) {
+		static const Token at = Token(TokenType::IDENTIFIER, "run", 0);
+		interpreter.eventLoop().run(at);
+		return Object();
+	}
+
+	// spawn(fn, args) calls fn with the elements of args on a thread of its own,
+	// in a heap of its own, and is a worker that waits for and returns a copy
+	// of the result when called. fn and args are copied with all they reach.
+	Object spawn(Interpreter& interpreter, CallParams args) {
+		if (!args[0].isCallable()) throw NativeError("Argument 1 must be a function.");
+		LoxArray* arguments = unbox<LoxArray*>(args[1], 1);
+		if (args[0].callableArity() != (int)arguments->size()) {
+			throw NativeError("Expected " + std::to_string(args[0].callableArity()) + " arguments but got " + std::to_string(arguments->size()) + ".");
+		}
+
+		std::vector<Object> call{ args[0] };
+		for (size_t i = 0; i < arguments->size(); i++) {
+			call.push_back(arguments->get(i));
+		}
+		return Object(interpreter.gc.track(new LoxWorker(interpreter, Snapshot::pack(call, interpreter))));
+	}
+
+	// channel() is a queue any worker it is passed to can send to. Calling it
+	// receives the next value, waiting until one is sent.
+	Object channel(Interpreter& interpreter, CallParams) {
+		return Object(interpreter.gc.track(new LoxChannel(std::make_shared<Channel>())));
+	}
+
+	// send(channel, value) queues a copy of value on the channel.
+	Object send(Interpreter& interpreter, CallParams args) {
+		auto channel = args[0].isCallable() ? dynamic_cast<LoxChannel*>(args[0].getCallablePtr()) : nullptr;
+		if (!channel) throw NativeError("Argument 1 must be a channel.");
+		channel->channel->send(Snapshot::pack({ &args[1], 1 }, interpreter));
+		return Object();
+	}
+
+	// parallelMap(array, fn) is map on every core. fn, the elements and the
+	// results are copied between heaps, so it pays off when fn does real work.
+	Object parallelMap(Interpreter& interpreter, CallParams args) {
+		LoxArray* array = unbox<LoxArray*>(args[0], 0);
+		parallelArg(interpreter, args[1], 1, 1);
+		return Object(mapInParallel(interpreter, args[1], array, false));
+	}
+
+	// parallelReduce(array, fn, initial) folds the array with fn(accumulated, element),
+	// chunks of it at once on every core, so fn has to be associative.
+	Object parallelReduce(Interpreter& interpreter, CallParams args) {
+		static const Token at = Token(TokenType::IDENTIFIER, "parallelReduce", 0);
+		LoxArray* array = unbox<LoxArray*>(args[0], 0);
+		parallelArg(interpreter, args[1], 1, 2);
+
+		LoxArray* partial = mapInParallel(interpreter, args[1], array, true);
+		Pin pin{ interpreter.gc, partial };
+		Object result = args[2];
+		for (size_t i = 0; i < partial->size(); i++) {
+			Object fold[] = { result, partial->get(i) };
+			result = interpreter.call(at, args[1], CallParams{ fold, 2 });
+		}
+		return result;
 	}
-}
\ No newline at end of file
+}
@@ -9,7 +9,10 @@ import <variant>;
 import <string>;
 import <vector>;
 import <iostream>;
-import <functional>;
+import <cstdint>;
+import <cstring>;
+import <charconv>;
+import <cmath>;
 
 import Stmt;
 import Interpreter;
@@ -17,15 +20,35 @@ import Environment;
 import Token;
 import Error;
 import GC;
+import Stats;
+import Trace;
 
 Object::Object(double value) : val{ value } { }
 Object::Object(bool value) : val{ value } {}
-Object::Object(std::string value) : val{ value } { }
+Object::Object(std::string value) : val{ LoxString(std::move(value)) } { }
+Object::Object(LoxString value) : val{ std::move(value) } { }
 Object::Object() : val{ std::monostate() } { }
 Object::Object(LoxCallable* fn) : val{ fn } {}
 Object::Object(LoxInstance* inst) : val{ inst } { }
+Object::Object(LoxArray* array) : val{ array } { }
+Object::Object(LoxMap* map) : val{ map } { }
 //Object::Object(std::variant<double, bool, std::string, std::monostate, LoxCallable*, LoxInstance*> val) : val{ val } { }
 
+LoxString LoxString::concat(std::string_view right) const {
+	//only a string that ends where its buffer ends can grow it, the others copy themselves once
+	bool aliased = right.data() >= buffer->data() && right.data() < buffer->data() + buffer->size();
+	if (offset + length == buffer->size() && !aliased) {
+		buffer->append(right);
+		return LoxString(buffer, offset, length + right.size());
+	}
+
+	CountedString joined;
+	joined.reserve(length + right.size());
+	joined.append(view());
+	joined.append(right);
+	return LoxString(std::move(joined));
+}
+
 bool Object::isClass() const { return std::holds_alternative<LoxCallable*>(val) && dynamic_cast<LoxClass*>(std::get<LoxCallable*>(val)); }
 
 LoxInstance::LoxInstance(LoxClass* klass) : klass{ klass } { }
@@ -45,15 +68,142 @@ void LoxInstance::set(Token name, Object value) {
 	fields[name.lexeme] = value;
 }
 
-NativeFn::NativeFn(std::function<Object(const std::vector<Object>&)> functionPtr, int functionArity)
+Object LoxArray::get(size_t index) const {
+	return boxed ? values[index] : Object(numbers[index]);
+}
+
+void LoxArray::set(size_t index, Object value) {
+	if (!boxed && value.isDouble()) {
+		numbers[index] = value.getDouble();
+		return;
+	}
+	box();
+	values[index] = value;
+}
+
+void LoxArray::push(Object value) {
+	if (!boxed && value.isDouble()) {
+		numbers.push_back(value.getDouble());
+		return;
+	}
+	box();
+	values.push_back(value);
+}
+
+Object LoxArray::pop() {
+	Object last = get(size() - 1);
+	if (boxed) values.pop_back();
+	else numbers.pop_back();
+	return last;
+}
+
+void LoxArray::box() {
+	if (boxed) return;
+	values.reserve(numbers.size());
+	for (double number : numbers) {
+		values.push_back(Object(number));
+	}
+	numbers = CountedVector<double>(numbers.get_allocator());
+	boxed = true;
+}
+
+
+uint64_t LoxMap::hash(const Object& key) {
+	if (key.isString()) {
+		//FNV-1a
+		uint64_t hash = 14695981039346656037ull;
+		for (unsigned char c : key.getStringView()) {
+			hash ^= c;
+			hash *= 1099511628211ull;
+		}
+		return hash;
+	}
+
+	//-0 and 0 are the same key
+	double number = key.getDouble() == 0 ? 0.0 : key.getDouble();
+	uint64_t bits;
+	std::memcpy(&bits, &number, sizeof bits);
+	bits ^= bits >> 33;
+	bits *= 0xff51afd7ed558ccdull;
+	bits ^= bits >> 33;
+	return bits;
+}
+
+//the slot holding the key, or the first free one on its probe sequence
+size_t LoxMap::slotOf(const Object& key, uint64_t hash) const {
+	size_t mask = slots.size() - 1;
+	size_t free = slots.size();
+	for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+		const Slot& slot = slots[i];
+		if (slot.state == State::EMPTY) return free != slots.size() ? free : i;
+		if (slot.state == State::DELETED) {
+			if (free == slots.size()) free = i;
+		}
+		else if (slot.hash == hash && slot.key.equals(key)) {
+			return i;
+		}
+	}
+}
+
+const Object* LoxMap::find(const Object& key) const {
+	if (count == 0) return nullptr;
+	const Slot& slot = slots[slotOf(key, hash(key))];
+	return slot.state == State::FULL ? &slot.value : nullptr;
+}
+
+void LoxMap::set(Object key, Object value) {
+	//at most 3/4 of the table is in use, so probes stay short and always end
+	if ((used + 1) * 4 > slots.size() * 3) grow();
+
+	uint64_t h = hash(key);
+	Slot& slot = slots[slotOf(key, h)];
+	if (slot.state == State::FULL) {
+		slot.value = value;
+		return;
+	}
+
+	if (slot.state == State::EMPTY) used++;
+	count++;
+	slot = Slot{ std::move(key), value, h, State::FULL };
+}
+
+bool LoxMap::remove(const Object& key) {
+	if (count == 0) return false;
+	Slot& slot = slots[slotOf(key, hash(key))];
+	if (slot.state != State::FULL) return false;
+
+	slot = Slot{ Object(), Object(), 0, State::DELETED };
+	count--;
+	return true;
+}
+
+void LoxMap::grow() {
+	//only doubles when the live keys need it, otherwise this just clears the deleted slots
+	size_t capacity = slots.empty() ? 8 : slots.size();
+	while ((count + 1) * 2 > capacity) capacity *= 2;
+
+	CountedVector<Slot> old(capacity, slots.get_allocator());
+	old.swap(slots);
+	used = count;
+	for (Slot& slot : old) {
+		if (slot.state != State::FULL) continue;
+		size_t mask = slots.size() - 1;
+		size_t i = slot.hash & mask;
+		while (slots[i].state != State::EMPTY) i = (i + 1) & mask;
+		slots[i] = std::move(slot);
+	}
+}
+
+
+NativeFn::NativeFn(Fn functionPtr, int functionArity)
 	: fn{functionPtr}, arit{functionArity} { }
 
 int NativeFn::arity() const {
 	return arit;
 }
 
-Object NativeFn::call(Interpreter&, const std::vector<Object>& arguments) {
-	return fn(arguments);
+Object NativeFn::call(Interpreter& interpreter, CallParams arguments) {
+	return fn(interpreter, arguments);
 }
 
 std::string NativeFn::toString() const {
@@ -65,8 +215,10 @@ LoxFn::LoxFn(Function* fn, Environment* env, Interpreter& intr, bool isClassInit
 	: function{ fn }, closure { env }, interpreter{ intr }, isClassInit{ isClassInit } { }
 
 Object LoxFn::bind(LoxInstance* instance) {
-	Environment* environment = interpreter.gc.track(new Environment(closure));
+	//tracked once it holds the instance, which may be referenced from nowhere else
+	Environment* environment = new Environment(closure);
 	environment->define("this", Object(instance));
+	interpreter.gc.track(environment);
 	return Object(interpreter.gc.track(new LoxFn(function, environment, interpreter, isClassInit)));
 }
 
@@ -74,24 +226,50 @@ int LoxFn::arity() const {
 	return (int)(function->params.size());
 }
 
-Object LoxFn::call(Interpreter& interpreter, const std::vector<Object>& arguments) {
-	Environment* local = interpreter.gc.track(new Environment { closure });
-	int size = (int)function->params.size();
-	for (int i = 0; i < size; i++) {
-		local->define(function->params[i].lexeme, arguments[i]);
+Object LoxFn::call(Interpreter& interpreter, CallParams arguments) {
+	Trace::Span span{ "call", function->id.lexeme, Trace::callThreshold };
+
+	//tail calls loop here rather than nesting, so they run in constant space
+	LoxFn* fn = this;
+	while (true) {
+		try {
+			fn->execute(interpreter, arguments);
+			break;
+		}
+		catch (ReturnFromLoxFn returnValue) {
+			if (fn->isClassInit) return fn->closure->getAt(0, "this");
+
+			return returnValue.value;
+		}
+		catch (TailCall) {
+			arguments = interpreter.enterTailCall(arguments);
+			fn = (LoxFn*)arguments.data()[-1].getCallablePtr();
+		}
 	}
 
-	try {
-		interpreter.executeBlock(function->body, local);
+	if (fn->isClassInit) return fn->closure->getAt(0, "this");
+	return Object();
+}
+
+void LoxFn::execute(Interpreter& interpreter, CallParams arguments) {
+	if constexpr (Stats::enabled) function->calls++;
+	if (function->lazy && !(interpreter.onLazyBody && interpreter.onLazyBody(function))) {
+		throw Error::RuntimeError(function->id, "Could not compile '" + function->id.lexeme + "'.");
 	}
-	catch (ReturnFromLoxFn returnValue) {
-		if (isClassInit) return closure->getAt(0, "this");
 
-		return returnValue.value;
+	//the resolver keeps the locals on the stack when nothing in the body closes over them
+	if (function->fns_in_body.empty()) {
+		interpreter.executeFrame(function->body, closure, arguments);
+		return;
 	}
 
-	if (isClassInit) return closure->getAt(0, "this");
-	return Object();
+	Environment* local = interpreter.gc.track(new Environment{ closure });
+	int size = (int)function->params.size();
+	for (int i = 0; i < size; i++) {
+		local->define(function->params[i].lexeme, arguments[i]);
+	}
+
+	interpreter.executeBlock(function->body, local);
 }
 
 std::string LoxFn::toString() const {
@@ -100,7 +278,7 @@ std::string LoxFn::toString() const {
 
 
 LoxClass::LoxClass(std::string name, LoxClass* superclass, std::unordered_map<std::string, LoxFn*> methods)
-	: name{ name }, superclass{ superclass },  methods { methods } { }
+	: name{ name }, superclass{ superclass },  methods{ methods.begin(), methods.end() } { }
 
 
 LoxFn* LoxClass::findMethod(std::string name) {
@@ -126,7 +304,8 @@ Object LoxClass::call(Interpreter& interpreter, CallParams args) {
 	LoxInstance* instance = interpreter.gc.track(new LoxInstance(this));
 	LoxFn* initializer = findMethod("init");
 	if (initializer) {
-		initializer->bind(instance).call(interpreter, args);
+		//through the interpreter, so the bound method sits on the stack where the GC sees it
+		interpreter.call(initializer->function->id, initializer->bind(instance), args);
 	}
 
 	return Object(instance);
@@ -137,12 +316,64 @@ std::string LoxClass::toString() const {
 }
 
 
+void appendNumber(std::string& out, double number, NumberFormat numbers) {
+	char digits[32];
+	std::to_chars_result written;
+	if (numbers == NumberFormat::COMPAT) {
+		written = std::to_chars(digits, digits + sizeof digits, number, std::chars_format::general, 6);
+	}
+	else if (number == std::floor(number) && std::fabs(number) < 1e15) {
+		//whole numbers print without an exponent, like the integers they usually are
+		written = std::to_chars(digits, digits + sizeof digits, number, std::chars_format::fixed);
+	}
+	else {
+		written = std::to_chars(digits, digits + sizeof digits, number);
+	}
+	out.append(digits, written.ptr);
+}
+
+void appendValue(std::string& out, const Object& obj, NumberFormat numbers) {
+	if (obj.isDouble()) appendNumber(out, obj.getDouble(), numbers);
+	else if (obj.isBool()) out += obj.getBool() ? "true" : "false";
+	else if (obj.isString()) out += obj.getStringView();
+	else if (obj.isNil()) out += "nil";
+	else if (obj.isCallable()) out += obj.getCallablePtr()->toString();
+	else if (obj.isLoxInstance()) {
+		out += obj.getLoxInstancePtr()->klass->name;
+		out += " instance";
+	}
+	else if (obj.isArray()) {
+		//nested arrays and maps are elided, so a cycle can't recurse forever
+		const LoxArray* array = obj.getArrayPtr();
+		out += '[';
+		for (size_t i = 0; i < array->size(); i++) {
+			if (i > 0) out += ", ";
+			Object element = array->get(i);
+			if (element.isArray()) out += "[...]";
+			else if (element.isMap()) out += "{...}";
+			else appendValue(out, element, numbers);
+		}
+		out += ']';
+	}
+	else if (obj.isMap()) {
+		out += '{';
+		bool first = true;
+		for (const LoxMap::Slot& slot : obj.getMapPtr()->slots) {
+			if (slot.state != LoxMap::State::FULL) continue;
+			if (!first) out += ", ";
+			first = false;
+			appendValue(out, slot.key, numbers);
+			out += ": ";
+			if (slot.value.isArray()) out += "[...]";
+			else if (slot.value.isMap()) out += "{...}";
+			else appendValue(out, slot.value, numbers);
+		}
+		out += '}';
+	}
+}
+
 std::ostream& operator<<(std::ostream& os, const Object& obj) {
-	if (obj.isDouble()) return os << obj.getDouble();
-	if (obj.isBool()) return os << (obj.getBool() ? "true" : "false");
-	if (obj.isString()) return os << obj.getString();
-	if (obj.isNil()) return os << "nil";
-	if (obj.isCallable()) return os << obj.getCallablePtr()->toString();
-	if (obj.isLoxInstance()) return os << obj.getLoxInstancePtr()->klass->name << " instance";
-	else return os; //unreachable
+	std::string text;
+	appendValue(text, obj, NumberFormat::COMPAT);
+	return os << text;
 }
@@ -3,18 +3,32 @@ export module Object;
 
 import <variant>;
 import <string>;
+import <string_view>;
 import <vector>;
 import <iostream>;
-import <functional>;
 import <memory>;
+import <span>;
+import <utility>;
+import <type_traits>;
+import <cstdint>;
+import <cmath>;
 
+import Memory;
 
 export class Interpreter;
 export struct Token;
 
 class Object;
 
-export typedef const std::vector<Object>& CallParams;
+// Arguments of a call, a window into the interpreter's argument stack.
+export typedef std::span<const Object> CallParams;
+
+// Thrown by natives that reject their arguments. The interpreter reports it at the call site.
+export struct NativeError {
+	std::string message;
+
+	NativeError(std::string message) : message{ message } { }
+};
 
 export class LoxCallable {
 protected:
@@ -34,7 +48,7 @@ class LoxClass;
 
 export class LoxInstance {
 public:
-	std::unordered_map<std::string, Object> fields;
+	CountedMap<std::string, Object> fields;
 	LoxClass* klass;
 
 	LoxInstance(LoxClass* klass);
@@ -49,16 +63,71 @@ public:
 	//~LoxInstance();
 };
 
+// A Lox array. Elements stay plain doubles while they are all numbers, so
+// numeric kernels can run over them directly. Storing anything else boxes
+// the whole array once.
+export class LoxArray {
+public:
+	bool boxed = false;
+	CountedVector<double> numbers;
+	CountedVector<Object> values;
+
+	LoxArray() {}
+	// An array of `size` zeros.
+	LoxArray(size_t size) : numbers(size) {}
+
+	inline size_t size() const { return boxed ? values.size() : numbers.size(); }
+
+	Object get(size_t index) const;
+	void set(size_t index, Object value);
+	void push(Object value);
+	Object pop();
+
+	void box();
+};
+
+export class LoxMap;
+
+// A string value: a window into a shared, append-only buffer. Strings built
+// from one another share the buffer, so `s = s + piece` appends in place
+// rather than copying s, and slices of a string point into its buffer.
+// Copying a string copies a pointer.
+export class LoxString {
+	std::shared_ptr<CountedString> buffer;
+	size_t offset;
+	size_t length;
+
+	LoxString(std::shared_ptr<CountedString> buffer, size_t offset, size_t length)
+		: buffer{ std::move(buffer) }, offset{ offset }, length{ length } {}
+
+	// The buffer and its text count against the current budget.
+	LoxString(CountedString value)
+		: buffer{ std::allocate_shared<CountedString>(Counted<CountedString>(), std::move(value)) }, offset{ 0 }, length{ buffer->size() } {}
+
+public:
+	LoxString(std::string_view value) : LoxString(CountedString(value)) {}
+
+	inline std::string_view view() const { return { buffer->data() + offset, length }; }
+
+	LoxString concat(std::string_view right) const;
+	inline LoxString slice(size_t start, size_t count) const { return LoxString(buffer, offset + start, count); }
+
+	inline bool operator==(const LoxString& other) const { return view() == other.view(); }
+};
+
 export class Object {
-	std::variant<double, bool, std::string, std::monostate, LoxCallable*, LoxInstance*> val;
+	std::variant<double, bool, LoxString, std::monostate, LoxCallable*, LoxInstance*, LoxArray*, LoxMap*> val;
 
 public:
 	Object(double value);
 	Object(bool value);
 	Object(std::string value);
+	Object(LoxString value);
 	Object();
 	Object(LoxCallable* fn);
 	Object(LoxInstance* value);
+	Object(LoxArray* value);
+	Object(LoxMap* value);
 	//Object(std::variant<double, bool, std::string, std::monostate, LoxCallable*, LoxInstance*> val);
 
 	//Object(const Object&);
@@ -69,9 +138,13 @@ public:
 
 	inline const double getDouble() const { return std::get<double>(val); }
 	inline const bool getBool() const { return std::get<bool>(val); }
-	inline const std::string getString() const { return std::get<std::string>(val); }
+	inline const std::string getString() const { return std::string(std::get<LoxString>(val).view()); }
+	inline std::string_view getStringView() const { return std::get<LoxString>(val).view(); }
+	inline const LoxString& getLoxString() const { return std::get<LoxString>(val); }
 	inline LoxCallable* getCallablePtr() const { return std::get<LoxCallable*>(val); }
 	inline LoxInstance* getLoxInstancePtr() const { return std::get<LoxInstance*>(val); }
+	inline LoxArray* getArrayPtr() const { return std::get<LoxArray*>(val); }
+	inline LoxMap* getMapPtr() const { return std::get<LoxMap*>(val); }
 
 	inline const Object call(Interpreter& interpreter, CallParams args) const {
 		return std::get<LoxCallable*>(val)->call(interpreter, args); 
@@ -83,39 +156,149 @@ public:
 	
 	inline bool isDouble() const { return std::holds_alternative<double>(val); }
 	inline bool isBool() const { return std::holds_alternative<bool>(val); }
-	inline bool isString() const { return std::holds_alternative<std::string>(val); }
+	inline bool isString() const { return std::holds_alternative<LoxString>(val); }
 	inline bool isNil() const { return std::holds_alternative<std::monostate>(val); }
 	inline bool isCallable() const { return std::holds_alternative<LoxCallable*>(val); }
 	bool isClass() const;
 	inline bool isLoxInstance() const { return std::holds_alternative<LoxInstance*>(val); }
-
-	inline bool isPointer() const { return std::holds_alternative<LoxCallable*>(val) || std::holds_alternative<LoxInstance*>(val); }
-	inline void* getPointer() const { return std::holds_alternative<LoxCallable*>(val) ? (void*)std::get<LoxCallable*>(val) : (void*)std::get<LoxInstance*>(val); }
+	inline bool isArray() const { return std::holds_alternative<LoxArray*>(val); }
+	inline bool isMap() const { return std::holds_alternative<LoxMap*>(val); }
+
+	inline bool isPointer() const { return isCallable() || isLoxInstance() || isArray() || isMap(); }
+	inline void* getPointer() const {
+		if (isCallable()) return std::get<LoxCallable*>(val);
+		if (isLoxInstance()) return std::get<LoxInstance*>(val);
+		if (isArray()) return std::get<LoxArray*>(val);
+		return std::get<LoxMap*>(val);
+	}
 
 	inline bool equals(const Object other) const {
 		return val == other.val;
 	}
 };
 
+// A Lox hash map with number or string keys. Open addressing with linear
+// probing over one flat table. Every slot keeps its key's hash, so growing
+// the table never rehashes strings and probes skip most mismatched keys
+// without comparing them.
+export class LoxMap {
+public:
+	enum class State : unsigned char { EMPTY, FULL, DELETED };
+
+	struct Slot {
+		Object key;
+		Object value;
+		uint64_t hash = 0;
+		State state = State::EMPTY;
+	};
+
+	CountedVector<Slot> slots;
+	size_t count = 0;
+	size_t used = 0; //full and deleted slots, which both lengthen probes
+
+	// NaN isn't a key, as it is never equal to itself and so couldn't be found again.
+	static inline bool isKey(const Object& key) { return (key.isDouble() && !std::isnan(key.getDouble())) || key.isString(); }
+	static uint64_t hash(const Object& key);
+
+	inline size_t size() const { return count; }
+
+	const Object* find(const Object& key) const;
+	void set(Object key, Object value);
+	bool remove(const Object& key);
+
+private:
+	size_t slotOf(const Object& key, uint64_t hash) const;
+	void grow();
+};
+
 export struct Function;
 export class Stmt;
 
 export class NativeFn : public LoxCallable {
-	const std::function<Object(CallParams)> fn;
+public:
+	typedef Object(*Fn)(Interpreter&, CallParams);
+
+private:
+	const Fn fn;
 	const int arit;
 
 public:
-	NativeFn(std::function<Object(CallParams)> functionPtr, int functionArity);
+	NativeFn(Fn functionPtr, int functionArity);
 
 	int arity() const override;
 	Object call(Interpreter& interpreter, CallParams) override;
 	std::string toString() const override;
 };
 
+template<class T> T unbox(const Object& arg, size_t index);
+
+template<> inline double unbox<double>(const Object& arg, size_t index) {
+	if (!arg.isDouble()) throw NativeError("Argument " + std::to_string(index + 1) + " must be a number.");
+	return arg.getDouble();
+}
+
+template<> inline bool unbox<bool>(const Object& arg, size_t index) {
+	if (!arg.isBool()) throw NativeError("Argument " + std::to_string(index + 1) + " must be a boolean.");
+	return arg.getBool();
+}
+
+template<> inline std::string unbox<std::string>(const Object& arg, size_t index) {
+	if (!arg.isString()) throw NativeError("Argument " + std::to_string(index + 1) + " must be a string.");
+	return arg.getString();
+}
+
+template<> inline LoxArray* unbox<LoxArray*>(const Object& arg, size_t index) {
+	if (!arg.isArray()) throw NativeError("Argument " + std::to_string(index + 1) + " must be an array.");
+	return arg.getArrayPtr();
+}
+
+template<> inline LoxMap* unbox<LoxMap*>(const Object& arg, size_t index) {
+	if (!arg.isMap()) throw NativeError("Argument " + std::to_string(index + 1) + " must be a map.");
+	return arg.getMapPtr();
+}
+
+template<> inline Object unbox<Object>(const Object& arg, size_t) {
+	return arg;
+}
+
+// A native with a plain C++ signature, e.g. TypedNativeFn<double(double, double)>.
+// Arguments are checked and unboxed straight off the argument stack.
+export template<class Signature> class TypedNativeFn;
+
+export template<class R, class... Args> class TypedNativeFn<R(Args...)> : public LoxCallable {
+	R(*const fn)(Args...);
+
+	template<size_t... I> inline R invoke(CallParams args, std::index_sequence<I...>) {
+		return fn(unbox<std::decay_t<Args>>(args[I], I)...);
+	}
+
+public:
+	TypedNativeFn(R(*functionPtr)(Args...)) : fn{ functionPtr } { }
+
+	inline R(*target() const)(Args...) { return fn; }
+
+	int arity() const override { return (int)sizeof...(Args); }
+
+	Object call(Interpreter&, CallParams args) override {
+		if constexpr (std::is_void_v<R>) {
+			invoke(args, std::index_sequence_for<Args...>{});
+			return Object();
+		}
+		else {
+			return Object(invoke(args, std::index_sequence_for<Args...>{}));
+		}
+	}
+
+	std::string toString() const override { return "<native fn>"; }
+};
+
 export class Environment;
 
 export class LoxFn : public LoxCallable {
 	Interpreter& interpreter;
+
+	void execute(Interpreter& interpreter, CallParams arguments);
+
 public:
 	Function* function;
 	Environment* closure;
@@ -132,7 +315,7 @@ public:
 
 export class LoxClass : public LoxCallable {
 public:
-	std::unordered_map<std::string, LoxFn*> methods;
+	CountedMap<std::string, LoxFn*> methods;
 	const std::string name;
 	LoxClass* superclass;
 	LoxClass(std::string name, LoxClass* superclass, std::unordered_map<std::string, LoxFn*> methods);
@@ -144,4 +327,12 @@ public:
 	std::string toString() const override;
 };
 
+// How numbers print: the shortest text that reads back as the same number,
+// or six significant digits the way iostreams print them.
+export enum class NumberFormat : unsigned char { SHORTEST, COMPAT };
+
+// Appends the text `print` shows for a value.
+export void appendValue(std::string& out, const Object& obj, NumberFormat numbers);
+export void appendNumber(std::string& out, double number, NumberFormat numbers);
+
 export std::ostream& operator<<(std::ostream& os, const Object& obj);
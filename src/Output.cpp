@@ -0,0 +1,79 @@
+module;
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+#include <cerrno>
+
+module Output;
+import Output;
+
+import <string>;
+import <string_view>;
+import <iostream>;
+
+import Object;
+import Error;
+
+Output::Output(std::ostream& stream, Error::Reporter& reporter, NumberFormat numbers) : stream{ &stream }, reporter{ reporter }, numbers{ numbers } {
+	buffer.reserve(bufferSize);
+}
+
+Output::Output(int fd, Error::Reporter& reporter, NumberFormat numbers) : fd{ fd }, reporter{ reporter }, numbers{ numbers } {
+	buffer.reserve(bufferSize);
+}
+
+Output::~Output() {
+	flush();
+}
+
+void Output::write(std::string_view text) {
+	buffer += text;
+	if (buffer.size() >= bufferSize) flush();
+}
+
+void Output::print(const Object& value) {
+	appendValue(buffer, value, numbers);
+	buffer += '\n';
+	if (buffer.size() >= bufferSize) flush();
+}
+
+void Output::flush() {
+	if (buffer.empty()) return;
+	if (failed) {
+		buffer.clear();
+		return;
+	}
+
+	if (stream) {
+		stream->write(buffer.data(), buffer.size());
+		stream->flush();
+		failed = !*stream;
+	}
+	else {
+		const char* data = buffer.data();
+		size_t left = buffer.size();
+		while (left > 0) {
+#ifdef _WIN32
+			int written = _write(fd, data, (unsigned)left);
+#else
+			ssize_t written = ::write(fd, data, left);
+#endif
+			if (written < 0 && errno == EINTR) continue;
+			if (written <= 0) {
+				failed = true;
+				break;
+			}
+			data += written;
+			left -= (size_t)written;
+		}
+	}
+	buffer.clear();
+
+	if (failed) {
+		reporter.err << "Could not write output.\n";
+		reporter.hadOutputError = true;
+	}
+}
@@ -0,0 +1,42 @@
+export module Output;
+
+import <string>;
+import <string_view>;
+import <iostream>;
+
+import Object;
+import Error;
+
+// Where `print` writes. Text collects in a large buffer that is handed to
+// the stream or file descriptor when it fills up, on flush() and when the
+// Output is destroyed, rather than going through iostreams line by line.
+// A write that fails is reported once, and what follows it is dropped.
+export class Output {
+	std::ostream* stream = nullptr;
+	int fd = -1;
+	std::string buffer;
+	Error::Reporter& reporter;
+	bool failed = false;
+
+public:
+	static constexpr size_t bufferSize = 64 * 1024;
+
+	NumberFormat numbers;
+
+	Output(std::ostream& stream, Error::Reporter& reporter, NumberFormat numbers = NumberFormat::SHORTEST);
+
+	// Writes straight to a file descriptor, e.g. 1 for standard output.
+	Output(int fd, Error::Reporter& reporter, NumberFormat numbers = NumberFormat::SHORTEST);
+
+	~Output();
+
+	Output(const Output&) = delete;
+	Output& operator=(const Output&) = delete;
+
+	void write(std::string_view text);
+
+	// A value and a newline, as `print` shows it.
+	void print(const Object& value);
+
+	void flush();
+};
@@ -4,11 +4,13 @@ import Parser;
 
 import <vector>;
 import <string>;
+import <algorithm>;
 
 import Token;
 import Expr;
 import Stmt;
 import Error;
+import Scanner;
 
 ParseResult::ParseResult(std::vector<Stmt*> stmts) : stmts{ stmts } {}
 ParseResult::~ParseResult() {
@@ -39,7 +41,7 @@ bool Parser::match(std::initializer_list<TokenType> types) {
 }
 
 ParseError Parser::error(Token token, std::string message) {
-	Error::error(token, message);
+	reporter.error(token, message);
 	return ParseError();
 }
 
@@ -71,6 +73,13 @@ Expr* Parser::assignment() {
 			delete var;
 			return set;
 		}
+		else if (auto var = dynamic_cast<Index*>(expr)) {
+			Expr* set = new SetIndex(var->obj, var->bracket, var->index, value);
+			var->obj = nullptr;
+			var->index = nullptr;
+			delete var;
+			return set;
+		}
 
 		error(equals, "Invalid assignment target.");
 	}
@@ -167,6 +176,12 @@ Expr* Parser::call() {
 			Token name = consume(TokenType::IDENTIFIER, "Expect property name after '.'.");
 			expr = new Get(expr, name);
 		}
+		else if (match({ TokenType::LEFT_BRACKET })) {
+			Token bracket = previous();
+			Expr* index = expression();
+			consume(TokenType::RIGHT_BRACKET, "Expect ']' after index.");
+			expr = new Index(expr, bracket, index);
+		}
 		else {
 			break;
 		}
@@ -180,7 +195,7 @@ Expr* Parser::finishCall(Expr* callee) {
 	if (!check(TokenType::RIGHT_PAREN)) {
 		do {
 			if (arguments.size() >= 255) {
-				Error::error(peek(), "Can't have more than 255 arguments.");
+				reporter.error(peek(), "Can't have more than 255 arguments.");
 			}
 			arguments.push_back(expression());
 		} while (match({ TokenType::COMMA }));
@@ -219,6 +234,18 @@ Expr* Parser::primary() {
 		return new Grouping(expr);
 	}
 
+	if (match({ TokenType::LEFT_BRACKET })) {
+		Token bracket = previous();
+		std::vector<Expr*> elements;
+		if (!check(TokenType::RIGHT_BRACKET)) {
+			do {
+				elements.push_back(expression());
+			} while (match({ TokenType::COMMA }));
+		}
+		consume(TokenType::RIGHT_BRACKET, "Expect ']' after array elements.");
+		return new ArrayLiteral(bracket, elements);
+	}
+
 	throw error(peek(), "Expect expression.");
 }
 
@@ -227,9 +254,12 @@ Expr* Parser::primary() {
 std::vector<Stmt*> Parser::block() {
 	std::vector<Stmt*> statements;
 
+	//declaration recovers from its own errors, so only the closing brace can throw
+	depth++;
 	while (!check({ TokenType::RIGHT_BRACE }) && !isAtEnd()) {
 		statements.push_back(declaration());
 	}
+	depth--;
 
 	consume(TokenType::RIGHT_BRACE, "Expect '}' after block.");
 	return statements;
@@ -240,6 +270,7 @@ Stmt* Parser::declaration() {
 		if (match({ TokenType::CLASS })) return classDeclaration();
 		if (match({ TokenType::FUN })) return function(FnType::FUNCTION);
 		if (match({ TokenType::VAR })) return varDeclaration();
+		if (match({ TokenType::IMPORT })) return importDeclaration();
 
 		return statement();
 	}
@@ -262,7 +293,7 @@ Stmt* Parser::classDeclaration() {
 
 	std::vector<Function*> methods;
 	while (!check({ TokenType::RIGHT_BRACE }) && !isAtEnd()) {
-		methods.emplace_back(function(FnType::METHOD));
+		methods.emplace_back(function(FnType::METHOD, superclass != nullptr));
 	}
 
 	consume(TokenType::RIGHT_BRACE, "Expect '}' after class body.");
@@ -270,7 +301,7 @@ Stmt* Parser::classDeclaration() {
 	return new Class(name, superclass, methods);
 }
 
-Function* Parser::function(FnType fnType) {
+Function* Parser::function(FnType fnType, bool subclass) {
 	std::string kind = fnType_toString(fnType);
 	Token name = consume(TokenType::IDENTIFIER, "Expect " + kind + " name.");
 	consume(TokenType::LEFT_PAREN, "Expect '(' after " + kind + " name.");
@@ -288,11 +319,33 @@ Function* Parser::function(FnType fnType) {
 	consume(TokenType::RIGHT_PAREN, "Expect ')' after parameters.");
 
 	consume(TokenType::LEFT_BRACE, "Expect '{' before " + kind + " body.");
+	if (lazySource && depth == 0) {
+		Function* skimmed = new Function(name, parameters, {});
+		skimmed->lazy = skipBody(fnType == FnType::METHOD, subclass);
+		return skimmed;
+	}
 	std::vector<Stmt*> body = block();
 
 	return new Function(name, parameters, body);
 }
 
+std::unique_ptr<LazyBody> Parser::skipBody(bool method, bool subclass) {
+	//strings and comments are single tokens by now, so counting braces is enough
+	Token open = previous();
+	int braces = 1;
+	while (tokens[current].type != TokenType::Eof) {
+		TokenType type = tokens[current].type;
+		skip();
+		if (type == TokenType::LEFT_BRACE) braces++;
+		else if (type == TokenType::RIGHT_BRACE && --braces == 0) break;
+	}
+	if (braces > 0) throw error(peek(), "Expect '}' after block.");
+
+	size_t begin = (size_t)open.offset + 1;
+	size_t end = (size_t)tokens[current - 1].offset;
+	return std::make_unique<LazyBody>(LazyBody{ lazySource, begin, end, open.line, method, subclass });
+}
+
 Stmt* Parser::varDeclaration() {
 	Token name = consume(TokenType::IDENTIFIER, "Expect variable name.");
 
@@ -305,6 +358,13 @@ Stmt* Parser::varDeclaration() {
 	return new Var(name, initializer);
 }
 
+Stmt* Parser::importDeclaration() {
+	Token keyword = previous();
+	Token path = consume(TokenType::STRING, "Expect module path after 'import'.");
+	consume(TokenType::SEMICOLON, "Expect ';' after module path.");
+	return new Import(keyword, path.literal.getString());
+}
+
 Stmt* Parser::statement() {
 	if (match({ TokenType::FOR })) return forStatement();
 	if (match({ TokenType::IF })) return ifStatement();
@@ -415,6 +475,7 @@ void Parser::synchronize() {
 			case TokenType::CLASS:
 			case TokenType::FUN:
 			case TokenType::VAR:
+			case TokenType::IMPORT:
 			case TokenType::FOR:
 			case TokenType::IF:
 			case TokenType::WHILE:
@@ -427,7 +488,23 @@ void Parser::synchronize() {
 	}
 }
 
-Parser::Parser(std::vector<Token>& tokens) : tokens{ tokens }, current{ 0 } {}
+Parser::Parser(std::vector<Token> tokens, Error::Reporter& reporter) : tokens{ std::move(tokens) }, current{ 0 }, reporter{ reporter } {}
+
+Parser::Parser(Scanner& scanner, Error::Reporter& reporter) : current{ 0 }, scanner{ &scanner }, reporter{ reporter } {
+	tokens.push_back(scanner.scanNext());
+	refill();
+}
+
+void Parser::refill() {
+	//nothing more to scan once the window ends in Eof, which a whole token list always does
+	if (tokens.back().type == TokenType::Eof) return;
+
+	tokens.erase(tokens.begin(), tokens.end() - 1);
+	current = std::min(current, 1);
+	while (tokens.size() < streamWindow && tokens.back().type != TokenType::Eof) {
+		tokens.push_back(scanner->scanNext());
+	}
+}
 
 ParseResult Parser::parse() {
 	std::vector<Stmt*> statements;
@@ -435,4 +512,8 @@ ParseResult Parser::parse() {
 		statements.push_back(declaration());
 	}
 	return ParseResult(statements);
+}
+
+Stmt* Parser::parseNext() {
+	return declaration();
 }
\ No newline at end of file
@@ -3,11 +3,13 @@ export module Parser;
 
 import <vector>;
 import <string>;
+import <memory>;
 
 import Token;
 export import Expr;
 export import Stmt;
 import Error;
+import Scanner;
 
 export struct ParseResult {
 	std::vector<Stmt*> stmts;
@@ -23,8 +25,18 @@ export enum class FnType {
 };
 
 export class Parser {
-	const std::vector<Token>& tokens;
+	// All tokens of the source or, when parsing from a scanner, a window of
+	// them that starts with the previous token.
+	std::vector<Token> tokens;
 	int current;
+	Scanner* scanner = nullptr;
+	Error::Reporter& reporter;
+
+	static constexpr size_t streamWindow = 256;
+	void refill();
+
+	// How many blocks and function bodies enclose the current token.
+	int depth = 0;
 
 	inline Token peek() {
 		return tokens[current];
@@ -43,8 +55,15 @@ export class Parser {
 		return peek().type == type;
 	}
 
+	inline void skip() {
+		if (!isAtEnd()) {
+			current++;
+			if (current == (int)tokens.size()) refill();
+		}
+	}
+
 	inline Token advance() {
-		if (!isAtEnd()) current++;
+		skip();
 		return previous();
 	}
 
@@ -86,10 +105,15 @@ export class Parser {
 
 	Stmt* classDeclaration();
 
-	Function* function(FnType);
+	Function* function(FnType, bool subclass = false);
+
+	// Skips to the brace that closes the body just opened.
+	std::unique_ptr<LazyBody> skipBody(bool method, bool subclass);
 
 	Stmt* varDeclaration();
 
+	Stmt* importDeclaration();
+
 	Stmt* statement();
 
 	Stmt* forStatement();
@@ -107,7 +131,19 @@ export class Parser {
 	void synchronize();
 
 public:
-	Parser(std::vector<Token>& tokens);
+	// When set, the bodies of top-level functions and methods are only
+	// skimmed for their closing brace. They keep their place in this source,
+	// which the tokens came from, and are parsed on their first call.
+	std::shared_ptr<const std::string> lazySource;
+
+	Parser(std::vector<Token> tokens, Error::Reporter& reporter);
+
+	// Pulls tokens from the scanner as it goes, so only a few are held at once.
+	Parser(Scanner& scanner, Error::Reporter& reporter);
 
 	ParseResult parse();
+
+	// One top-level declaration at a time: parseNext is nullptr after a syntax error.
+	inline bool done() { return isAtEnd(); }
+	Stmt* parseNext();
 };
@@ -2,26 +2,65 @@
 module Resolver;
 import Resolver;
 
+import <string>;
+import <unordered_set>;
+import <algorithm>;
+
 import Error;
 
-Resolver::Resolver(Interpreter& interpreter, GC& gc) : interpreter{ interpreter }, gc { gc } {}
+namespace {
+	// Whether anything in the body can close over its locals. If not, they
+	// never outlive the call and can stay on the interpreter's value stack.
+	bool createsClosures(const std::vector<Stmt*>& stmts);
+
+	bool createsClosures(const Stmt* stmt) {
+		if (!stmt) return false;
+		if (dynamic_cast<const Function*>(stmt)) return true;
+		if (auto klass = dynamic_cast<const Class*>(stmt)) return !klass->meths.empty();
+		if (auto block = dynamic_cast<const Block*>(stmt)) return createsClosures(block->stmts);
+		if (auto ifStmt = dynamic_cast<const If*>(stmt)) return createsClosures(ifStmt->th) || createsClosures(ifStmt->el);
+		if (auto whileStmt = dynamic_cast<const While*>(stmt)) return createsClosures(whileStmt->body);
+		return false;
+	}
+
+	bool createsClosures(const std::vector<Stmt*>& stmts) {
+		for (const Stmt* stmt : stmts) {
+			if (createsClosures(stmt)) return true;
+		}
+		return false;
+	}
+}
+
+Resolver::Resolver(Interpreter& interpreter, GC& gc) : interpreter{ interpreter }, gc { gc }, reporter{ interpreter.reporter } {}
+Resolver::Resolver(Interpreter& interpreter, GC& gc, Error::Reporter& reporter) : interpreter{ interpreter }, gc{ gc }, reporter{ reporter } {}
 
 void Resolver::resolveLocal(const Expr* expr, Token name) const {
+	//stack scopes have no Environment, so they don't count towards the depth
+	int depth = 0;
 	for (int i = (int)scopes.size() - 1; i >= 0; i--) {
-		if (scopes[i].contains(name.lexeme)) {
-			interpreter.resolve(expr, (int)(scopes.size()) - 1 - i);
+		if (scopes[i].names.contains(name.lexeme)) {
+			if (scopes[i].onStack) {
+				interpreter.resolveSlot(expr, scopes[i].slots.at(name.lexeme));
+			}
+			else {
+				interpreter.resolve(expr, depth);
+			}
 			return;
 		}
+		if (!scopes[i].onStack) depth++;
 	}
+	interpreter.resolveGlobal(expr, name.lexeme);
 }
 
 void Resolver::declare(Token name) {
 	if (scopes.empty()) return;
-	auto scope = scopes.back();
-	if (scope.contains(name.lexeme)) {
-		Error::error(name, "Already a variable with this name in this scope.");
+	auto& scope = scopes.back();
+	if (scope.names.contains(name.lexeme)) {
+		reporter.error(name, "Already a variable with this name in this scope.");
+		return;
 	}
-	scope[name.lexeme] = false;
+	scope.names[name.lexeme] = false;
+	if (scope.onStack) scope.slots[name.lexeme] = nextSlot++;
 }
 
 void Resolver::visitLiteralExpr(const Literal* expr) {
@@ -52,21 +91,137 @@ void Resolver::visitCallExpr(const Call* expr) {
 	for (auto arg : expr->args) {
 		resolve(arg);
 	}
+
+	//natives that change their first argument in place
+	static const std::unordered_set<std::string> changing = { "push", "pop", "sort", "scale", "set", "remove" };
+	const Expr* callee = expr->calleeExpr;
+	while (auto grouping = dynamic_cast<const Grouping*>(callee)) callee = grouping->expr;
+	if (auto variable = dynamic_cast<const Variable*>(callee)) {
+		const std::string& name = variable->nam.lexeme;
+		int scope = scopeOf(name);
+		if (scope < 0) {
+			if (changing.contains(name) && !expr->args.empty()) changesObject(expr->args[0]);
+		}
+		else if (scopes[scope].owned.contains(name)) {
+			usesOwned(scope, name, true);
+		}
+		else {
+			//a function passed in or kept in a variable could be anything
+			changesFrom(scope);
+		}
+	}
+	else if (auto super = dynamic_cast<const Super*>(callee); super && super->meth.lexeme == "init" && currentFunction == FunctionType::INITIALIZER) {
+		//sets up the same new instance, and the parallel natives check the superclass's init
+	}
+	else {
+		//a method, or a function some other expression evaluates to
+		changesFrom((int)scopes.size() - 1);
+	}
 }
 
 void Resolver::visitVariableExpr(const Variable* expr) {
 	if (!scopes.empty()) {
-		if (auto x = scopes.back().find(expr->nam.lexeme); x != scopes.back().end() && x->second == false) {
-			Error::error(expr->nam, "Can't read local variable in its own initializer.");
+		auto& names = scopes.back().names;
+		if (auto x = names.find(expr->nam.lexeme); x != names.end() && x->second == false) {
+			reporter.error(expr->nam, "Can't read local variable in its own initializer.");
 		}
 	}
 
 	resolveLocal(expr, expr->nam);
+	callsOutside(expr->nam.lexeme);
 }
 
 void Resolver::visitAssignExpr(const Assign* expr) {
 	resolve(expr->val);
 	resolveLocal(expr, expr->id);
+
+	changesOutside(expr->id.lexeme);
+
+	//what changed it as its own may have changed something else
+	int scope = scopeOf(expr->id.lexeme);
+	if (scope < 0) return;
+	auto owned = scopes[scope].owned.find(expr->id.lexeme);
+	if (owned == scopes[scope].owned.end() || creator(expr->val) == owned->second.creator) return;
+	for (Function* user : owned->second.users) user->changesOutside = true;
+	scopes[scope].owned.erase(owned);
+}
+
+int Resolver::scopeOf(const std::string& name) const {
+	for (int i = (int)scopes.size() - 1; i >= 0; i--) {
+		if (scopes[i].names.contains(name)) return i;
+	}
+	return -1;
+}
+
+void Resolver::changesOutside(const std::string& name) {
+	for (int i = (int)scopes.size() - 1; i >= 0 && !scopes[i].names.contains(name); i--) {
+		if (scopes[i].function) scopes[i].function->changesOutside = true;
+	}
+}
+
+void Resolver::changesFrom(int scope) {
+	if (scope < 0) scope = (int)scopes.size() - 1;
+	for (int i = scope; i >= 0; i--) {
+		if (scopes[i].function) scopes[i].function->changesOutside = true;
+	}
+}
+
+void Resolver::changesObject(const Expr* expr) {
+	while (auto grouping = dynamic_cast<const Grouping*>(expr)) expr = grouping->expr;
+
+	//the new instance, unless init is called as a method, which is flagged as any method call
+	if (dynamic_cast<const This*>(expr) && currentFunction == FunctionType::INITIALIZER) return;
+	if (auto variable = dynamic_cast<const Variable*>(expr)) {
+		int scope = scopeOf(variable->nam.lexeme);
+		if (scope >= 0 && scopes[scope].owned.contains(variable->nam.lexeme)) {
+			usesOwned(scope, variable->nam.lexeme, false);
+			return;
+		}
+	}
+	//a parameter, a field or element, or a variable another object was put
+	//in could hold something shared
+	changesFrom((int)scopes.size() - 1);
+}
+
+void Resolver::callsOutside(const std::string& name) {
+	for (int i = (int)scopes.size() - 1; i >= 0 && !scopes[i].names.contains(name); i--) {
+		Function* function = scopes[i].function;
+		if (function && std::find(function->callsOutside.begin(), function->callsOutside.end(), name) == function->callsOutside.end()) {
+			function->callsOutside.push_back(name);
+		}
+	}
+}
+
+void Resolver::usesOwned(int scope, const std::string& name, bool call) {
+	Scope::Owned& owned = scopes[scope].owned.at(name);
+	for (int i = (int)scopes.size() - 1; i >= 0; i--) {
+		Function* function = scopes[i].function;
+		if (!function) continue;
+		if (i > scope) {
+			//nested functions share it between their calls
+			if (!call) function->changesOutside = true;
+			continue;
+		}
+		if (std::find(owned.users.begin(), owned.users.end(), function) == owned.users.end()) owned.users.push_back(function);
+		if (!owned.creator.empty() && std::find(function->creates.begin(), function->creates.end(), owned.creator) == function->creates.end()) {
+			function->creates.push_back(owned.creator);
+		}
+	}
+}
+
+std::optional<std::string> Resolver::creator(const Expr* expr) const {
+	while (auto grouping = dynamic_cast<const Grouping*>(expr)) expr = grouping->expr;
+	if (dynamic_cast<const ArrayLiteral*>(expr)) return "";
+	if (auto call = dynamic_cast<const Call*>(expr)) {
+		auto callee = dynamic_cast<const Variable*>(call->calleeExpr);
+		if (callee && scopeOf(callee->nam.lexeme) < 0) return callee->nam.lexeme;
+	}
+	return std::nullopt;
+}
+
+void Resolver::owns(const std::string& name, std::string creator) {
+	if (scopes.empty()) return;
+	scopes.back().owned[name] = Scope::Owned{ std::move(creator), {} };
 }
 
 void Resolver::visitGetExpr(const Get* expr) {
@@ -76,14 +231,33 @@ void Resolver::visitGetExpr(const Get* expr) {
 void Resolver::visitSetExpr(const Set* expr) {
 	resolve(expr->val);
 	resolve(expr->obj);
+	changesObject(expr->obj);
+}
+
+void Resolver::visitArrayLiteralExpr(const ArrayLiteral* expr) {
+	for (auto element : expr->elems) {
+		resolve(element);
+	}
+}
+
+void Resolver::visitIndexExpr(const Index* expr) {
+	resolve(expr->obj);
+	resolve(expr->index);
+}
+
+void Resolver::visitSetIndexExpr(const SetIndex* expr) {
+	resolve(expr->val);
+	resolve(expr->obj);
+	resolve(expr->index);
+	changesObject(expr->obj);
 }
 
 void Resolver::visitSuperExpr(const Super* expr) {
 	if (currentClass == ClassType::NONE) {
-		Error::error(expr->keywrd, "Can't use 'super' outside of a class.");
+		reporter.error(expr->keywrd, "Can't use 'super' outside of a class.");
 	}
 	else if (currentClass != ClassType::SUBCLASS) {
-		Error::error(expr->keywrd, "Can't use 'super' in a class with no superclass.");
+		reporter.error(expr->keywrd, "Can't use 'super' in a class with no superclass.");
 	}
 
 	resolveLocal(expr, expr->keywrd);
@@ -91,7 +265,7 @@ void Resolver::visitSuperExpr(const Super* expr) {
 
 void Resolver::visitThisExpr(const This* expr) {
 	if (currentClass == ClassType::NONE) {
-		Error::error(expr->keywrd, "Can't use 'this' outside of a class.");
+		reporter.error(expr->keywrd, "Can't use 'this' outside of a class.");
 		return;
 	}
 
@@ -103,6 +277,11 @@ void Resolver::visitExpressionStmt(const Expression* stmt) {
 	resolve(stmt->expr);
 }
 
+void Resolver::visitImportStmt(const Import* stmt) {
+	//a module's declarations become globals, so it can't be pulled into a block or function
+	if (!scopes.empty()) reporter.error(stmt->keywrd, "Can only import at top level.");
+}
+
 void Resolver::visitPrintStmt(const Print* stmt) {
 	resolve(stmt->expr);
 }
@@ -111,14 +290,18 @@ void Resolver::visitVarStmt(const Var* stmt) {
 	declare(stmt->id);
 	if (stmt->init) {
 		resolve(stmt->init);
+		if (auto made = creator(stmt->init)) owns(stmt->id.lexeme, *made);
 	}
 	define(stmt->id);
 }
 
 void Resolver::visitBlockStmt(const Block* stmt) {
+	//the interpreter pops a block's slots when it ends
+	int enclosingSlot = nextSlot;
 	beginScope();
 	resolve(stmt->stmts);
 	endScope();
+	nextSlot = enclosingSlot;
 }
 
 void Resolver::visitIfStmt(const If* stmt) {
@@ -138,9 +321,10 @@ void Resolver::visitClassStmt(const Class* stmt) {
 
 	declare(stmt->nam);
 	define(stmt->nam);
+	owns(stmt->nam.lexeme);
 
 	if (stmt->super && stmt->nam.lexeme == stmt->super->nam.lexeme) {
-		Error::error(stmt->super->nam, "A class can't inherit from itself.");
+		reporter.error(stmt->super->nam, "A class can't inherit from itself.");
 	}
 
 	if (stmt->super) {
@@ -149,12 +333,12 @@ void Resolver::visitClassStmt(const Class* stmt) {
 	}
 
 	if (stmt->super) {
-		beginScope();
-		scopes.back()["super"] = true;
+		beginScope(false);
+		scopes.back().names["super"] = true;
 	}
 
-	beginScope();
-	scopes.back()["this"] = true;
+	beginScope(false);
+	scopes.back().names["this"] = true;
 
 	for (Function* method : stmt->meths) {
 		FunctionType declaration = FunctionType::METHOD;
@@ -174,15 +358,44 @@ void Resolver::visitClassStmt(const Class* stmt) {
 void Resolver::visitFunctionStmt(Function* stmt) {
 	declare(stmt->id);
 	define(stmt->id);
+	owns(stmt->id.lexeme);
 
 	resolveFunction(stmt, FunctionType::FUNCTION);
 }
 
 void Resolver::resolveFunction(Function* function, FunctionType type) {
-	beginScope();
-
 	gc.track(function);
+	//until its declaration runs, nothing on the heap points at a top-level function
 	if (lastFunction) lastFunction->fns_in_body.push_back(function);
+	else gc.pin(function);
+
+	if (!function->lazy) resolveBody(function, type);
+}
+
+void Resolver::resolveLazy(Function* function) {
+	//only top-level functions and methods are skipped, so their surroundings are known
+	const LazyBody& lazy = *function->lazy;
+	currentClass = lazy.subclass ? ClassType::SUBCLASS : lazy.method ? ClassType::CLASS : ClassType::NONE;
+	if (lazy.subclass) {
+		beginScope(false);
+		scopes.back().names["super"] = true;
+	}
+	if (lazy.method) {
+		beginScope(false);
+		scopes.back().names["this"] = true;
+	}
+
+	FunctionType type = FunctionType::FUNCTION;
+	if (lazy.method) type = function->id.lexeme == "init" ? FunctionType::INITIALIZER : FunctionType::METHOD;
+	resolveBody(function, type);
+}
+
+void Resolver::resolveBody(Function* function, FunctionType type) {
+	//parameters take the first slots, right where the caller pushed the arguments
+	int enclosingSlot = nextSlot;
+	nextSlot = 0;
+	beginScope(!createsClosures(function->body));
+	scopes.back().function = function;
 
 	FunctionType enclosingFunction = currentFunction;
 	currentFunction = type;
@@ -198,17 +411,19 @@ void Resolver::resolveFunction(Function* function, FunctionType type) {
 	resolve(function->body);
 
 	lastFunction = prevLastFunction;
+	currentFunction = enclosingFunction;
 
 	endScope();
+	nextSlot = enclosingSlot;
 }
 
 void Resolver::visitReturnStmt(const Return* stmt) {
 	if (currentFunction == FunctionType::NONE) {
-		Error::error(stmt->keywrd, "Can't return from top-level code.");
+		reporter.error(stmt->keywrd, "Can't return from top-level code.");
 	}
 	if (stmt->val) {
 		if (currentFunction == FunctionType::INITIALIZER) {
-			Error::error(stmt->keywrd, "Can't return a value from an initializer.");
+			reporter.error(stmt->keywrd, "Can't return a value from an initializer.");
 		}
 		resolve(stmt->val);
 	}
@@ -4,11 +4,13 @@ export module Resolver;
 import <vector>;
 import <unordered_map>;
 import <string>;
+import <optional>;
 
 import Expr;
 import Stmt;
 import Interpreter;
 import GC;
+import Error;
 
 enum class FunctionType {
 	NONE,
@@ -23,10 +25,38 @@ enum class ClassType {
 	SUBCLASS
 };
 
+struct Scope {
+	std::unordered_map<std::string, bool> names;
+
+	//locals that live in value stack slots rather than in an Environment
+	bool onStack;
+	std::unordered_map<std::string, int> slots;
+
+	//the function whose parameters the scope holds
+	Function* function = nullptr;
+
+	// A local holding what its function made itself: a new array, map or
+	// instance, or a function declared in the scope.
+	struct Owned {
+		//the global called to make it, e.g. `array` or a class, which the
+		//parallel natives check still names one when they run
+		std::string creator;
+		//the functions that changed or called it as their own
+		std::vector<Function*> users;
+	};
+	std::unordered_map<std::string, Owned> owned;
+
+	Scope(bool onStack) : onStack{ onStack } { }
+};
+
 export class Resolver : public ExprVisitor<void>, public StmtVisitor<void> {
 	Interpreter& interpreter;
 	GC& gc;
-	std::vector<std::unordered_map<std::string, bool>> scopes;
+	Error::Reporter& reporter;
+	std::vector<Scope> scopes;
+
+	//next free slot of the innermost stack frame
+	int nextSlot = 0;
 	
 	FunctionType currentFunction = FunctionType::NONE;
 	ClassType currentClass = ClassType::NONE;
@@ -34,7 +64,38 @@ export class Resolver : public ExprVisitor<void>, public StmtVisitor<void> {
 	Function* lastFunction = nullptr;
 
 	void resolveLocal(const Expr* expr, Token name) const;
+
+	// The innermost scope declaring `name`, or -1 for a global.
+	int scopeOf(const std::string& name) const;
+
+	// Flags the functions between here and the scope declaring `name` as
+	// changing what is declared outside them.
+	void changesOutside(const std::string& name);
+
+	// Flags the functions from `scope` outwards, or all of them for -1.
+	void changesFrom(int scope);
+
+	// The same for changing the object `expr` evaluates to. Only a local
+	// holding an object its function made itself is free to change, for
+	// that function and the ones around it.
+	void changesObject(const Expr* expr);
+
+	// Records that the functions between here and its scope call or pass on
+	// the variable `name`.
+	void callsOutside(const std::string& name);
+
+	// Records the use of the owned local `name` declared in `scope`, as a
+	// call or a change.
+	void usesOwned(int scope, const std::string& name, bool call);
+
+	// What made the value of `expr`, if it is new: "" for an array literal,
+	// or the global it calls.
+	std::optional<std::string> creator(const Expr* expr) const;
+
+	// Records that the local `name` in the innermost scope holds a new value.
+	void owns(const std::string& name, std::string creator = "");
 	void resolveFunction(Function* function, FunctionType type);
+	void resolveBody(Function* function, FunctionType type);
 
 	inline void resolve(const Stmt* stmt) {
 		stmt->accept(this);
@@ -44,8 +105,13 @@ export class Resolver : public ExprVisitor<void>, public StmtVisitor<void> {
 		expr->accept(this);
 	}
 
+	inline void beginScope(bool onStack) {
+		scopes.push_back(Scope(onStack));
+	}
+
+	// Blocks share the storage of the scope they are in.
 	inline void beginScope() {
-		scopes.push_back(std::unordered_map<std::string, bool>());
+		beginScope(!scopes.empty() && scopes.back().onStack);
 	}
 
 	inline void endScope() {
@@ -56,11 +122,12 @@ export class Resolver : public ExprVisitor<void>, public StmtVisitor<void> {
 
 	inline void define(Token name) {
 		if (scopes.empty()) return;
-		scopes.back()[name.lexeme] = true;
+		scopes.back().names[name.lexeme] = true;
 	}
 
 public:
 	Resolver(Interpreter& interpreter, GC& gc);
+	Resolver(Interpreter& interpreter, GC& gc, Error::Reporter& reporter);
 
 	std::vector<std::pair<Function*, Function*>> functions;
 
@@ -70,6 +137,10 @@ public:
 		}
 	}
 
+	// Resolves a body the parser skipped, once it has been parsed.
+	void resolveLazy(Function* function);
+
+	void visitArrayLiteralExpr(const ArrayLiteral* expr) override;
 	void visitLiteralExpr(const Literal* expr) override;
 	void visitLogicalExpr(const Logical* expr) override;
 	void visitGroupingExpr(const Grouping* expr) override;
@@ -80,10 +151,13 @@ public:
 	void visitAssignExpr(const Assign* expr) override;
 	void visitGetExpr(const Get* expr) override;
 	void visitSetExpr(const Set* expr) override;
+	void visitIndexExpr(const Index* expr) override;
+	void visitSetIndexExpr(const SetIndex* expr) override;
 	void visitSuperExpr(const Super* expr) override;
 	void visitThisExpr(const This* expr) override;
 
 	void visitExpressionStmt(const Expression* stmt) override;
+	void visitImportStmt(const Import* stmt) override;
 	void visitPrintStmt(const Print* stmt) override;
 	void visitVarStmt(const Var* stmt) override;
 	void visitBlockStmt(const Block* stmt) override;
@@ -29,6 +29,7 @@ static const std::unordered_map<std::string, TokenType> keywords = {
 	{"for", TokenType::FOR},
 	{"fun", TokenType::FUN},
 	{"if", TokenType::IF},
+	{"import", TokenType::IMPORT},
 	{"nil", TokenType::NIL},
 	{"or", TokenType::OR},
 	{"print", TokenType::PRINT},
@@ -43,15 +44,18 @@ static const std::unordered_map<std::string, TokenType> keywords = {
 void Scanner::addToken(TokenType type) {
 	std::string text = source.substr(start, current - start);
 	tokens.push_back(Token(type, text, line));
+	tokens.back().offset = start;
 }
 
 void Scanner::addToken(TokenType type, std::string lit) {
 		std::string text = source.substr(start, current - start);
 		tokens.push_back(Token(type, text, lit, line));
+		tokens.back().offset = start;
 }
 void Scanner::addToken(TokenType type, double lit) {
 	std::string text = source.substr(start, current - start);
 	tokens.push_back(Token(type, text, lit, line));
+	tokens.back().offset = start;
 }
 
 bool Scanner::match(char expected) {
@@ -62,7 +66,7 @@ bool Scanner::match(char expected) {
 	return true;
 }
 
-Scanner::Scanner(std::string src) : source{ src }, tokens{ {} }, start{ 0 }, current{ 0 }, line{ 1 } {}
+Scanner::Scanner(std::string src, Error::Reporter& reporter, int line) : source{ src }, tokens{ {} }, reporter{ reporter }, start{ 0 }, current{ 0 }, line{ line } {}
 
 std::vector<Token> Scanner::scanTokens() {
 	while (!isAtEnd()) {
@@ -74,6 +78,19 @@ std::vector<Token> Scanner::scanTokens() {
 	return tokens;
 }
 
+Token Scanner::scanNext() {
+	//scanToken adds at most one token, and none for whitespace and comments
+	while (tokens.empty() && !isAtEnd()) {
+		start = current;
+		scanToken();
+	}
+
+	if (tokens.empty()) return Token(TokenType::Eof, "", line);
+	Token token = tokens.back();
+	tokens.clear();
+	return token;
+}
+
 void Scanner::string() {
 	while (peek() != '"' && !isAtEnd()) {
 		if (peek() == '\n') line++;
@@ -81,7 +98,7 @@ void Scanner::string() {
 	}
 
 	if (isAtEnd()) {
-		Error::error(line, "Unterminated string.");
+		reporter.error(line, "Unterminated string.");
 		return;
 	}
 
@@ -129,6 +146,8 @@ void Scanner::scanToken() {
 		case ')': addToken(RIGHT_PAREN); break;
 		case '{': addToken(LEFT_BRACE); break;
 		case '}': addToken(RIGHT_BRACE); break;
+		case '[': addToken(LEFT_BRACKET); break;
+		case ']': addToken(RIGHT_BRACKET); break;
 		case ',': addToken(COMMA); break;
 		case '.': addToken(DOT); break;
 		case '-': addToken(MINUS); break;
@@ -175,7 +194,7 @@ void Scanner::scanToken() {
 				identifier();
 			}
 			else {
-				Error::error(line, "Unexpected character.");
+				reporter.error(line, "Unexpected character.");
 			}
 			break;
 	}
@@ -5,10 +5,12 @@ import <string>;
 import <vector>;
 
 import Token;
+import Error;
 
 export class Scanner {
 	const std::string source;
 	std::vector<Token> tokens;
+	Error::Reporter& reporter;
 
 	int start;
 	int current;
@@ -38,7 +40,11 @@ export class Scanner {
 	void scanToken();
 
 public:
-	Scanner(std::string src);
+	// `line` is the line the source starts on, when it is a piece of a larger one.
+	Scanner(std::string src, Error::Reporter& reporter, int line = 1);
 
 	std::vector<Token> scanTokens();
+
+	// The next token, or Eof once the source is used up. For scanning while parsing.
+	Token scanNext();
 };
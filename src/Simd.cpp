@@ -0,0 +1,194 @@
+module;
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define LOX_SSE2
+#include <emmintrin.h>
+#endif
+
+#include <cmath>
+#include <cstring>
+
+module Simd;
+import Simd;
+
+import <cstddef>;
+import <bit>;
+
+#ifdef LOX_SSE2
+
+double Simd::sum(const double* values, size_t count) {
+	__m128d acc0 = _mm_setzero_pd(), acc1 = _mm_setzero_pd();
+	__m128d acc2 = _mm_setzero_pd(), acc3 = _mm_setzero_pd();
+
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		acc0 = _mm_add_pd(acc0, _mm_loadu_pd(values + i));
+		acc1 = _mm_add_pd(acc1, _mm_loadu_pd(values + i + 2));
+		acc2 = _mm_add_pd(acc2, _mm_loadu_pd(values + i + 4));
+		acc3 = _mm_add_pd(acc3, _mm_loadu_pd(values + i + 6));
+	}
+	__m128d acc = _mm_add_pd(_mm_add_pd(acc0, acc1), _mm_add_pd(acc2, acc3));
+
+	double lanes[2];
+	_mm_storeu_pd(lanes, acc);
+	double total = lanes[0] + lanes[1];
+	for (; i < count; i++) {
+		total += values[i];
+	}
+	return total;
+}
+
+double Simd::dot(const double* a, const double* b, size_t count) {
+	__m128d acc0 = _mm_setzero_pd(), acc1 = _mm_setzero_pd();
+
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4) {
+		acc0 = _mm_add_pd(acc0, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+		acc1 = _mm_add_pd(acc1, _mm_mul_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2)));
+	}
+
+	double lanes[2];
+	_mm_storeu_pd(lanes, _mm_add_pd(acc0, acc1));
+	double total = lanes[0] + lanes[1];
+	for (; i < count; i++) {
+		total += a[i] * b[i];
+	}
+	return total;
+}
+
+void Simd::scale(double* values, size_t count, double factor) {
+	__m128d f = _mm_set1_pd(factor);
+
+	size_t i = 0;
+	for (; i + 2 <= count; i += 2) {
+		_mm_storeu_pd(values + i, _mm_mul_pd(_mm_loadu_pd(values + i), f));
+	}
+	for (; i < count; i++) {
+		values[i] *= factor;
+	}
+}
+
+void Simd::sqrt(const double* in, double* out, size_t count) {
+	size_t i = 0;
+	for (; i + 2 <= count; i += 2) {
+		_mm_storeu_pd(out + i, _mm_sqrt_pd(_mm_loadu_pd(in + i)));
+	}
+	for (; i < count; i++) {
+		out[i] = std::sqrt(in[i]);
+	}
+}
+
+void Simd::abs(const double* in, double* out, size_t count) {
+	//clearing the sign bit
+	__m128d mask = _mm_castsi128_pd(_mm_set1_epi64x(0x7FFFFFFFFFFFFFFF));
+
+	size_t i = 0;
+	for (; i + 2 <= count; i += 2) {
+		_mm_storeu_pd(out + i, _mm_and_pd(_mm_loadu_pd(in + i), mask));
+	}
+	for (; i < count; i++) {
+		out[i] = std::fabs(in[i]);
+	}
+}
+
+size_t Simd::findByte(const char* text, size_t count, char byte) {
+	__m128i target = _mm_set1_epi8(byte);
+
+	size_t i = 0;
+	for (; i + 16 <= count; i += 16) {
+		__m128i block = _mm_loadu_si128((const __m128i*)(text + i));
+		unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(block, target));
+		if (mask) return i + std::countr_zero(mask);
+	}
+	for (; i < count; i++) {
+		if (text[i] == byte) return i;
+	}
+	return count;
+}
+
+size_t Simd::find(const char* text, size_t count, const char* needle, size_t length) {
+	if (length == 0) return 0;
+	if (length > count) return count;
+	if (length == 1) return findByte(text, count, needle[0]);
+
+	//tests 16 starting positions at once against the needle's first and last
+	//bytes, and only compares the whole needle where both match
+	__m128i first = _mm_set1_epi8(needle[0]);
+	__m128i last = _mm_set1_epi8(needle[length - 1]);
+	size_t starts = count - length + 1;
+
+	size_t i = 0;
+	for (; i + 16 <= starts; i += 16) {
+		__m128i head = _mm_loadu_si128((const __m128i*)(text + i));
+		__m128i tail = _mm_loadu_si128((const __m128i*)(text + i + length - 1));
+		unsigned mask = (unsigned)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(head, first), _mm_cmpeq_epi8(tail, last)));
+		while (mask) {
+			size_t at = i + std::countr_zero(mask);
+			if (std::memcmp(text + at + 1, needle + 1, length - 2) == 0) return at;
+			mask &= mask - 1;
+		}
+	}
+	for (; i < starts; i++) {
+		if (text[i] == needle[0] && std::memcmp(text + i, needle, length) == 0) return i;
+	}
+	return count;
+}
+
+#else
+
+double Simd::sum(const double* values, size_t count) {
+	double acc[4] = {};
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4) {
+		acc[0] += values[i];
+		acc[1] += values[i + 1];
+		acc[2] += values[i + 2];
+		acc[3] += values[i + 3];
+	}
+	double total = (acc[0] + acc[1]) + (acc[2] + acc[3]);
+	for (; i < count; i++) {
+		total += values[i];
+	}
+	return total;
+}
+
+double Simd::dot(const double* a, const double* b, size_t count) {
+	double total = 0;
+	for (size_t i = 0; i < count; i++) {
+		total += a[i] * b[i];
+	}
+	return total;
+}
+
+void Simd::scale(double* values, size_t count, double factor) {
+	for (size_t i = 0; i < count; i++) {
+		values[i] *= factor;
+	}
+}
+
+void Simd::sqrt(const double* in, double* out, size_t count) {
+	for (size_t i = 0; i < count; i++) {
+		out[i] = std::sqrt(in[i]);
+	}
+}
+
+void Simd::abs(const double* in, double* out, size_t count) {
+	for (size_t i = 0; i < count; i++) {
+		out[i] = std::fabs(in[i]);
+	}
+}
+
+size_t Simd::findByte(const char* text, size_t count, char byte) {
+	const void* found = std::memchr(text, byte, count);
+	return found ? (const char*)found - text : count;
+}
+
+size_t Simd::find(const char* text, size_t count, const char* needle, size_t length) {
+	if (length == 0) return 0;
+	for (size_t i = 0; i + length <= count; i++) {
+		if (text[i] == needle[0] && std::memcmp(text + i, needle, length) == 0) return i;
+	}
+	return count;
+}
+
+#endif
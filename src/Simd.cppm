@@ -0,0 +1,21 @@
+export module Simd;
+
+import <cstddef>;
+
+// Numeric kernels over contiguous doubles, used by the array natives, and
+// byte scans used by the string natives. They use SSE2 where available.
+// The numeric ones keep several accumulators, so sums come out in a
+// different order than a plain loop would add them.
+export namespace Simd {
+
+	double sum(const double* values, size_t count);
+	double dot(const double* a, const double* b, size_t count);
+	void scale(double* values, size_t count, double factor);
+
+	void sqrt(const double* in, double* out, size_t count);
+	void abs(const double* in, double* out, size_t count);
+
+	// Byte scans for the string natives. Both return `count` when nothing matches.
+	size_t findByte(const char* text, size_t count, char byte);
+	size_t find(const char* text, size_t count, const char* needle, size_t length);
+}
@@ -0,0 +1,571 @@
+module Snapshot;
+import Snapshot;
+
+import <string>;
+import <vector>;
+import <unordered_map>;
+import <cstdint>;
+import <cstring>;
+import <span>;
+import <memory>;
+import <unordered_set>;
+
+import Object;
+import Environment;
+import Stmt;
+import Parser;
+import Interpreter;
+import GC;
+import Cache;
+import Workers;
+
+namespace {
+
+	constexpr char snapshotMagic[4] = { 'L', 'O', 'X', 'S' };
+
+	enum class Kind : uint8_t {
+		ENV, LOXFN, LOXCLASS, INSTANCE, NATIVEFN, ARRAY, MAP, CHANNEL
+	};
+
+	enum class ValTag : uint8_t {
+		NIL, BOOL, NUMBER, STRING, REF
+	};
+
+	constexpr uint32_t NONE = 0xFFFFFFFF;
+	constexpr uint32_t GLOBALS = 0xFFFFFFFE;
+
+	struct BadSnapshot {};
+
+	class HeapWriter {
+		const Interpreter& interpreter;
+		std::unordered_map<const Function*, uint32_t> functionIds;
+		std::unordered_map<const void*, std::string> nativeNames;
+
+		//when packing a message, functions are numbered as they turn up and channels are shared
+		std::vector<const Function*>* reached = nullptr;
+		std::vector<std::shared_ptr<Channel>>* channels = nullptr;
+		//past the values being sent, what can't be copied comes along as nil
+		bool beyondRoots = false;
+
+		std::unordered_map<const void*, uint32_t> ids;
+		std::vector<std::pair<Kind, const void*>> objects;
+
+		std::string records;
+
+		template<class T> void raw(std::string& to, T value) {
+			to.append(reinterpret_cast<const char*>(&value), sizeof(T));
+		}
+
+		void str(std::string& to, const std::string& s) {
+			raw(to, (uint32_t)s.size());
+			to.append(s);
+		}
+
+		uint32_t ref(const void* ptr, Kind kind) {
+			if (auto found = ids.find(ptr); found != ids.end()) return found->second;
+			uint32_t id = (uint32_t)objects.size();
+			ids[ptr] = id;
+			objects.emplace_back(kind, ptr);
+			return id;
+		}
+
+		uint32_t ref(LoxCallable* callable) {
+			if (auto fn = dynamic_cast<LoxFn*>(callable)) return ref(fn, Kind::LOXFN);
+			if (auto klass = dynamic_cast<LoxClass*>(callable)) return ref(klass, Kind::LOXCLASS);
+			if (auto channel = dynamic_cast<LoxChannel*>(callable); channel && channels) return ref(channel, Kind::CHANNEL);
+			if (!nativeNames.contains(callable)) throw BadSnapshot(); //a native the interpreter doesn't register
+			return ref(callable, Kind::NATIVEFN);
+		}
+
+		bool copyable(LoxCallable* callable) const {
+			return dynamic_cast<LoxFn*>(callable) || dynamic_cast<LoxClass*>(callable)
+				|| (channels && dynamic_cast<LoxChannel*>(callable)) || nativeNames.contains(callable);
+		}
+
+		uint32_t ref(const Environment* env) {
+			if (!env) return NONE;
+			if (env == &interpreter.globals) return GLOBALS;
+			return ref(env, Kind::ENV);
+		}
+
+		void value(const Object& v) {
+			if (v.isNil()) raw(records, ValTag::NIL);
+			else if (v.isBool()) { raw(records, ValTag::BOOL); raw(records, (uint8_t)v.getBool()); }
+			else if (v.isDouble()) { raw(records, ValTag::NUMBER); raw(records, v.getDouble()); }
+			else if (v.isString()) { raw(records, ValTag::STRING); str(records, v.getString()); }
+			else if (v.isCallable() && beyondRoots && !copyable(v.getCallablePtr())) raw(records, ValTag::NIL);
+			else if (v.isCallable()) { raw(records, ValTag::REF); raw(records, ref(v.getCallablePtr())); }
+			else if (v.isArray()) { raw(records, ValTag::REF); raw(records, ref(v.getArrayPtr(), Kind::ARRAY)); }
+			else if (v.isMap()) { raw(records, ValTag::REF); raw(records, ref(v.getMapPtr(), Kind::MAP)); }
+			else { raw(records, ValTag::REF); raw(records, ref(v.getLoxInstancePtr(), Kind::INSTANCE)); }
+		}
+
+		template<class Map> void values(const Map& map) {
+			raw(records, (uint32_t)map.size());
+			for (const auto& [name, v] : map) {
+				str(records, name);
+				value(v);
+			}
+		}
+
+		void record(Kind kind, const void* ptr) {
+			switch (kind) {
+				case Kind::ENV: {
+					const Environment* env = (const Environment*)ptr;
+					raw(records, ref(env->enclosing));
+					raw(records, (uint8_t)env->isTopLevel);
+					values(env->values);
+				} break;
+				case Kind::LOXFN: {
+					const LoxFn* fn = (const LoxFn*)ptr;
+					auto function = functionIds.find(fn->function);
+					if (function == functionIds.end()) {
+						if (!reached) throw BadSnapshot();
+						function = functionIds.emplace(fn->function, (uint32_t)reached->size()).first;
+						reached->push_back(fn->function);
+					}
+					raw(records, function->second);
+					raw(records, ref(fn->closure));
+					raw(records, (uint8_t)fn->isClassInit);
+				} break;
+				case Kind::LOXCLASS: {
+					const LoxClass* klass = (const LoxClass*)ptr;
+					raw(records, klass->superclass ? ref(klass->superclass, Kind::LOXCLASS) : NONE);
+					raw(records, (uint32_t)klass->methods.size());
+					for (const auto& [name, method] : klass->methods) {
+						str(records, name);
+						raw(records, ref(method, Kind::LOXFN));
+					}
+				} break;
+				case Kind::INSTANCE: {
+					const LoxInstance* instance = (const LoxInstance*)ptr;
+					raw(records, ref(instance->klass, Kind::LOXCLASS));
+					values(instance->fields);
+				} break;
+				case Kind::NATIVEFN:
+				case Kind::CHANNEL:
+					break;
+				case Kind::ARRAY: {
+					const LoxArray* array = (const LoxArray*)ptr;
+					raw(records, (uint8_t)array->boxed);
+					raw(records, (uint32_t)array->size());
+					if (array->boxed) {
+						for (const Object& v : array->values) value(v);
+					}
+					else {
+						records.append((const char*)array->numbers.data(), array->numbers.size() * sizeof(double));
+					}
+				} break;
+				case Kind::MAP: {
+					const LoxMap* map = (const LoxMap*)ptr;
+					raw(records, (uint32_t)map->size());
+					for (const LoxMap::Slot& slot : map->slots) {
+						if (slot.state != LoxMap::State::FULL) continue;
+						value(slot.key);
+						value(slot.value);
+					}
+				} break;
+			}
+		}
+
+	public:
+		HeapWriter(const Interpreter& interpreter, const std::vector<const Function*>& functions) : interpreter{ interpreter } {
+			for (uint32_t i = 0; i < functions.size(); i++) {
+				functionIds[functions[i]] = i;
+			}
+			for (const auto& [name, v] : interpreter.globals.values) {
+				if (v.isCallable()) nativeNames[v.getCallablePtr()] = name;
+			}
+		}
+
+		HeapWriter(const Interpreter& interpreter, std::vector<const Function*>& reached, std::vector<std::shared_ptr<Channel>>& channels)
+			: HeapWriter(interpreter, {}) {
+			this->reached = &reached;
+			this->channels = &channels;
+		}
+
+		void write(std::string& out, const Environment* root) {
+			uint32_t rootId = ref(root);
+			objectsTo(out);
+			raw(out, rootId);
+		}
+
+		void write(std::string& out, std::span<const Object> roots) {
+			for (const Object& root : roots) value(root);
+			std::string rootValues;
+			std::swap(rootValues, records);
+			beyondRoots = true;
+
+			objectsTo(out);
+			raw(out, (uint32_t)roots.size());
+			out.append(rootValues);
+		}
+
+	private:
+		void objectsTo(std::string& out) {
+			//records may discover more objects, so the list grows while it is walked
+			for (size_t i = 0; i < objects.size(); i++) {
+				record(objects[i].first, objects[i].second);
+			}
+
+			raw(out, (uint32_t)objects.size());
+			for (const auto& [kind, ptr] : objects) {
+				raw(out, kind);
+				if (kind == Kind::LOXCLASS) str(out, ((const LoxClass*)ptr)->name);
+				if (kind == Kind::NATIVEFN) str(out, nativeNames[ptr]);
+				if (kind == Kind::CHANNEL) {
+					raw(out, (uint32_t)channels->size());
+					channels->push_back(((const LoxChannel*)ptr)->channel);
+				}
+			}
+			out.append(records);
+		}
+	};
+
+	class HeapReader {
+		const char*& cur;
+		const char* const end;
+		Interpreter& interpreter;
+		GC& gc;
+		const std::vector<Function*>& functions;
+		const std::vector<std::shared_ptr<Channel>>* channels;
+
+		std::vector<std::pair<Kind, void*>> objects;
+
+		template<class T> T raw() {
+			if ((size_t)(end - cur) < sizeof(T)) throw BadSnapshot();
+			T value;
+			std::memcpy(&value, cur, sizeof(T));
+			cur += sizeof(T);
+			return value;
+		}
+
+		uint32_t count() {
+			uint32_t n = raw<uint32_t>();
+			if (n > (size_t)(end - cur)) throw BadSnapshot();
+			return n;
+		}
+
+		std::string str() {
+			uint32_t size = count();
+			std::string s(cur, size);
+			cur += size;
+			return s;
+		}
+
+		void* object(uint32_t id, Kind kind) {
+			if (id >= objects.size() || objects[id].first != kind) throw BadSnapshot();
+			return objects[id].second;
+		}
+
+		inline void* ref(Kind kind) { return object(raw<uint32_t>(), kind); }
+
+		Environment* env() {
+			uint32_t id = raw<uint32_t>();
+			if (id == NONE) return nullptr;
+			if (id == GLOBALS) return &interpreter.globals;
+			return (Environment*)object(id, Kind::ENV);
+		}
+
+		Object value() {
+			switch (raw<ValTag>()) {
+				case ValTag::NIL: return Object();
+				case ValTag::BOOL: return Object((bool)raw<uint8_t>());
+				case ValTag::NUMBER: return Object(raw<double>());
+				case ValTag::STRING: return Object(str());
+				case ValTag::REF: {
+					uint32_t id = raw<uint32_t>();
+					if (id >= objects.size()) throw BadSnapshot();
+					auto [kind, ptr] = objects[id];
+					switch (kind) {
+						case Kind::LOXFN: return Object((LoxCallable*)(LoxFn*)ptr);
+						case Kind::LOXCLASS: return Object((LoxCallable*)(LoxClass*)ptr);
+						case Kind::NATIVEFN: return Object((LoxCallable*)ptr);
+						case Kind::INSTANCE: return Object((LoxInstance*)ptr);
+						case Kind::ARRAY: return Object((LoxArray*)ptr);
+						case Kind::MAP: return Object((LoxMap*)ptr);
+						case Kind::CHANNEL: return Object((LoxCallable*)(LoxChannel*)ptr);
+						case Kind::ENV: break;
+					}
+				} break;
+			}
+			throw BadSnapshot();
+		}
+
+		template<class Map> void values(Map& map) {
+			uint32_t n = count();
+			for (uint32_t i = 0; i < n; i++) {
+				std::string name = str();
+				map[name] = value();
+			}
+		}
+
+		void* shell(Kind kind) {
+			switch (kind) {
+				case Kind::ENV: return gc.track(new Environment(gc.memory));
+				case Kind::LOXFN: return gc.track(new LoxFn(nullptr, nullptr, interpreter, false));
+				case Kind::LOXCLASS: return gc.track(new LoxClass(str(), nullptr, {}));
+				case Kind::INSTANCE: return gc.track(new LoxInstance(nullptr));
+				case Kind::ARRAY: return gc.track(new LoxArray());
+				case Kind::MAP: return gc.track(new LoxMap());
+				case Kind::NATIVEFN: {
+					auto native = interpreter.globals.values.find(str());
+					if (native == interpreter.globals.values.end() || !native->second.isCallable()) throw BadSnapshot();
+					return native->second.getCallablePtr();
+				}
+				case Kind::CHANNEL: {
+					uint32_t channel = raw<uint32_t>();
+					if (!channels || channel >= channels->size()) throw BadSnapshot();
+					return gc.track(new LoxChannel((*channels)[channel]));
+				}
+			}
+			throw BadSnapshot();
+		}
+
+		void record(Kind kind, void* ptr) {
+			switch (kind) {
+				case Kind::ENV: {
+					Environment* e = (Environment*)ptr;
+					e->enclosing = env();
+					e->isTopLevel = raw<uint8_t>();
+					values(e->values);
+				} break;
+				case Kind::LOXFN: {
+					LoxFn* fn = (LoxFn*)ptr;
+					uint32_t function = raw<uint32_t>();
+					if (function >= functions.size()) throw BadSnapshot();
+					fn->function = functions[function];
+					fn->closure = env();
+					fn->isClassInit = raw<uint8_t>();
+				} break;
+				case Kind::LOXCLASS: {
+					LoxClass* klass = (LoxClass*)ptr;
+					uint32_t super = raw<uint32_t>();
+					if (super != NONE) klass->superclass = (LoxClass*)object(super, Kind::LOXCLASS);
+					uint32_t n = count();
+					for (uint32_t i = 0; i < n; i++) {
+						std::string name = str();
+						klass->methods[name] = (LoxFn*)ref(Kind::LOXFN);
+					}
+				} break;
+				case Kind::INSTANCE: {
+					LoxInstance* instance = (LoxInstance*)ptr;
+					instance->klass = (LoxClass*)ref(Kind::LOXCLASS);
+					values(instance->fields);
+				} break;
+				case Kind::NATIVEFN:
+				case Kind::CHANNEL:
+					break;
+				case Kind::ARRAY: {
+					LoxArray* array = (LoxArray*)ptr;
+					array->boxed = raw<uint8_t>();
+					uint32_t n = raw<uint32_t>();
+					if (array->boxed) {
+						if (n > (size_t)(end - cur)) throw BadSnapshot();
+						array->values.reserve(n);
+						for (uint32_t i = 0; i < n; i++) array->values.push_back(value());
+					}
+					else {
+						if (n > (size_t)(end - cur) / sizeof(double)) throw BadSnapshot();
+						array->numbers.resize(n);
+						std::memcpy(array->numbers.data(), cur, n * sizeof(double));
+						cur += n * sizeof(double);
+					}
+				} break;
+				case Kind::MAP: {
+					LoxMap* map = (LoxMap*)ptr;
+					uint32_t n = count();
+					for (uint32_t i = 0; i < n; i++) {
+						Object key = value();
+						if (!LoxMap::isKey(key)) throw BadSnapshot();
+						map->set(key, value());
+					}
+				} break;
+			}
+		}
+
+	public:
+		HeapReader(const char*& cur, const char* end, Interpreter& interpreter, GC& gc, const std::vector<Function*>& functions,
+			const std::vector<std::shared_ptr<Channel>>* channels = nullptr)
+			: cur{ cur }, end{ end }, interpreter{ interpreter }, gc{ gc }, functions{ functions }, channels{ channels } {}
+
+		Environment* read() {
+			readObjects();
+			Environment* root = env();
+			if (!root || root == &interpreter.globals) throw BadSnapshot();
+			return root;
+		}
+
+		std::vector<Object> readValues() {
+			readObjects();
+			std::vector<Object> roots(count());
+			for (Object& root : roots) root = value();
+			return roots;
+		}
+
+	private:
+		void readObjects() {
+			//every object exists before any record points at it
+			uint32_t n = count();
+			objects.reserve(n);
+			for (uint32_t i = 0; i < n; i++) {
+				Kind kind = raw<Kind>();
+				if (kind > Kind::CHANNEL) throw BadSnapshot();
+				objects.emplace_back(kind, shell(kind));
+			}
+
+			for (auto [kind, ptr] : objects) {
+				record(kind, ptr);
+			}
+		}
+	};
+}
+
+bool Snapshot::write(const std::string& path, uint64_t sourceHash, const std::vector<Stmt*>& stmts, size_t next, const Interpreter& interpreter) {
+	std::string out;
+	Cache::writeHeader(out, snapshotMagic, sourceHash);
+
+	std::vector<const Function*> functions;
+	Cache::encodeProgram(out, stmts, interpreter, functions);
+
+	uint32_t nextStmt = (uint32_t)next;
+	out.append((const char*)&nextStmt, sizeof nextStmt);
+
+	try {
+		HeapWriter(interpreter, functions).write(out, interpreter.environment);
+	}
+	catch (BadSnapshot) {
+		return false;
+	}
+
+	return Cache::writeFile(path, out);
+}
+
+bool Snapshot::restore(const std::string& path, uint64_t sourceHash, std::vector<Stmt*>& stmts, size_t& next, Interpreter& interpreter, GC& gc) {
+	Cache::MappedFile file{ path };
+	if (!file.ok()) return false;
+
+	const char* cur = file.begin();
+	const char* end = file.end();
+	if (!Cache::readHeader(cur, end, snapshotMagic, sourceHash)) return false;
+
+	//the objects are linked up only once all of them exist
+	GC::Pause pause{ gc };
+	std::vector<Function*> functions;
+	if (!Cache::decodeProgram(cur, end, stmts, functions, interpreter, gc)) return false;
+
+	try {
+		uint32_t nextStmt;
+		if ((size_t)(end - cur) < sizeof nextStmt) throw BadSnapshot();
+		std::memcpy(&nextStmt, cur, sizeof nextStmt);
+		cur += sizeof nextStmt;
+		if (nextStmt > stmts.size()) throw BadSnapshot();
+
+		Environment* root = HeapReader(cur, end, interpreter, gc, functions).read();
+		if (cur != end) throw BadSnapshot();
+
+		interpreter.environment = root;
+		interpreter.forgetGlobals();
+		next = nextStmt;
+	}
+	catch (BadSnapshot) {
+		//whatever was already restored is unreachable and left to the GC
+		ParseResult discarded = ParseResult(stmts);
+		stmts.clear();
+		return false;
+	}
+	return true;
+}
+
+Message Snapshot::pack(std::span<const Object> values, Interpreter& interpreter) {
+	//compiling a lazy body below allocates, and the values may be held by the caller alone
+	GC::Pause pause{ interpreter.gc };
+	Message message;
+	std::string heap;
+	std::vector<const Function*> reached;
+	try {
+		HeapWriter(interpreter, reached, message.channels).write(heap, values);
+	}
+	catch (BadSnapshot) {
+		throw NativeError("Only data, functions, classes, instances and channels can leave their heap.");
+	}
+
+	//functions nested in others that are sent too come along inside them
+	std::unordered_set<const Function*> nested;
+	std::vector<const Function*> pending;
+	for (const Function* function : reached) {
+		pending.assign(function->fns_in_body.begin(), function->fns_in_body.end());
+		while (!pending.empty()) {
+			const Function* inner = pending.back();
+			pending.pop_back();
+			if (nested.insert(inner).second) pending.insert(pending.end(), inner->fns_in_body.begin(), inner->fns_in_body.end());
+		}
+	}
+
+	std::vector<Stmt*> outermost;
+	for (const Function* function : reached) {
+		if (nested.contains(function)) continue;
+		if (function->lazy && !(interpreter.onLazyBody && interpreter.onLazyBody(const_cast<Function*>(function)))) {
+			throw NativeError("Could not compile '" + function->id.lexeme + "'.");
+		}
+		outermost.push_back(const_cast<Function*>(function));
+	}
+
+	std::vector<const Function*> encoded;
+	Cache::encodeProgram(message.bytes, outermost, interpreter, encoded);
+
+	//where each function the heap refers to ends up among the decoded ones
+	std::unordered_map<const Function*, uint32_t> positions;
+	for (uint32_t i = 0; i < encoded.size(); i++) {
+		positions[encoded[i]] = i;
+	}
+	uint32_t count = (uint32_t)reached.size();
+	message.bytes.append((const char*)&count, sizeof count);
+	for (const Function* function : reached) {
+		uint32_t position = positions[function];
+		message.bytes.append((const char*)&position, sizeof position);
+	}
+
+	message.bytes.append(heap);
+	return message;
+}
+
+std::vector<Object> Snapshot::unpack(const Message& message, Interpreter& interpreter, GC& gc) {
+	const char* cur = message.bytes.data();
+	const char* end = cur + message.bytes.size();
+
+	//the objects are linked up only once all of them exist
+	GC::Pause pause{ gc };
+	std::vector<Stmt*> stmts;
+	std::vector<Function*> decoded;
+	//the functions close over copies of their top-level scopes, which the table of globals knows nothing of
+	if (!Cache::decodeProgram(cur, end, stmts, decoded, interpreter, gc, false)) throw NativeError("Could not unpack a message.");
+	//the heap refers to them, unlike to top-level declarations, which stay pinned until they run
+	for (Stmt* stmt : stmts) {
+		gc.unpin(static_cast<Function*>(stmt));
+	}
+
+	try {
+		uint32_t count;
+		if ((size_t)(end - cur) < sizeof count) throw BadSnapshot();
+		std::memcpy(&count, cur, sizeof count);
+		cur += sizeof count;
+		if (count > (size_t)(end - cur) / sizeof count) throw BadSnapshot();
+
+		std::vector<Function*> functions(count);
+		for (Function*& function : functions) {
+			uint32_t position;
+			std::memcpy(&position, cur, sizeof position);
+			cur += sizeof position;
+			if (position >= decoded.size()) throw BadSnapshot();
+			function = decoded[position];
+		}
+
+		std::vector<Object> values = HeapReader(cur, end, interpreter, gc, functions, &message.channels).readValues();
+		if (cur != end) throw BadSnapshot();
+		return values;
+	}
+	catch (BadSnapshot) {
+		throw NativeError("Could not unpack a message.");
+	}
+}
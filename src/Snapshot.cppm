@@ -0,0 +1,32 @@
+export module Snapshot;
+
+import <string>;
+import <vector>;
+import <cstdint>;
+import <span>;
+
+import Stmt;
+import Interpreter;
+import GC;
+import Object;
+import Workers;
+
+// Heap snapshot (.loxs): the program plus every object reachable from the
+// top-level environment, taken where the script called `snapshot()`.
+// Restoring it resumes at the following top-level statement.
+export namespace Snapshot {
+
+	bool write(const std::string& path, uint64_t sourceHash, const std::vector<Stmt*>& stmts, size_t next, const Interpreter& interpreter);
+
+	// On success `stmts` owns the restored program, `interpreter.environment`
+	// points at the restored top level and `next` is where to continue.
+	bool restore(const std::string& path, uint64_t sourceHash, std::vector<Stmt*>& stmts, size_t& next, Interpreter& interpreter, GC& gc);
+
+	// A deep copy of values that another interpreter, on any thread, can
+	// unpack into its own heap. Functions and classes bring their code along,
+	// and closures the environments they reach, the globals included.
+	// Throws NativeError for values that can't leave their heap.
+	Message pack(std::span<const Object> values, Interpreter& interpreter);
+
+	std::vector<Object> unpack(const Message& message, Interpreter& interpreter, GC& gc);
+}
@@ -0,0 +1,53 @@
+module;
+
+// Build with LOX_STATS=0 to leave the counters out altogether.
+#ifndef LOX_STATS
+#define LOX_STATS 1
+#endif
+
+export module Stats;
+
+import <cstddef>;
+import <utility>;
+
+// Counts of work on the interpreter's hot paths, for --stats and stats().
+// The heap keeps its own in GC, and each Function its number of calls.
+export namespace Stats {
+	constexpr bool enabled = LOX_STATS != 0;
+
+	enum class Counter {
+		// variables looked up by name in an Environment
+		LOOKUPS,
+		// steps from an Environment to an enclosing one
+		HOPS,
+		// returns unwound with ReturnFromLoxFn
+		RETURNS_THROWN,
+
+		Counter_MAX
+	};
+
+	struct Counters {
+		size_t values[(int)Counter::Counter_MAX] = {};
+	};
+
+	// The counters of the interpreter running on this thread, or nullptr.
+	// Set by Use, so each interpreter counts only its own work.
+	inline thread_local Counters* current = nullptr;
+
+	// Makes `counters` the current ones until the end of the scope.
+	struct Use {
+		Counters* previous;
+
+		Use(Counters& counters) : previous{ std::exchange(current, &counters) } { }
+		~Use() { current = previous; }
+
+		Use(const Use&) = delete;
+		Use& operator=(const Use&) = delete;
+	};
+
+	template<Counter counter> inline void count(size_t n = 1) {
+		if constexpr (enabled) {
+			if (current) current->values[(int)counter] += n;
+		}
+	}
+}
@@ -29,11 +29,15 @@ Function::Function(Token name, std::vector<Token> parameters, std::vector<Stmt*>
 	: id{name}, params{parameters}, body{fnBody} { }
 
 Function::~Function() {
+	deleteBody();
+}
+void Function::deleteBody() {
 	for (Stmt* x : body) {
 		if (dynamic_cast<Function*>(x))
 			continue;
 		delete x;
 	}
+	body.clear();
 }
 void Function::accept(StmtVisitor<void>* visitor) const { return visitor->visitFunctionStmt(const_cast<Function*>(this)); }
 
@@ -63,6 +67,10 @@ If::~If() {
 void If::accept(StmtVisitor<void>* visitor) const { return visitor->visitIfStmt(this); }
 
 
+Import::Import(Token keyword, std::string path) : keywrd{keyword}, path{path} { }
+void Import::accept(StmtVisitor<void>* visitor) const { return visitor->visitImportStmt(this); }
+
+
 Print::Print(Expr* expression) : expr{expression} { }
 Print::~Print() {
 	delete expr;
@@ -3,6 +3,7 @@ export module Stmt;
 
 import <vector>;
 import <string>;
+import <memory>;
 
 import Token;
 import Expr;
@@ -13,6 +14,7 @@ struct Class;
 struct Expression;
 struct Function;
 struct If;
+struct Import;
 struct Print;
 struct Return;
 struct Var;
@@ -25,6 +27,7 @@ public:
     virtual R visitExpressionStmt(const Expression* stmt) = 0;
     virtual R visitFunctionStmt(Function* stmt) = 0;
     virtual R visitIfStmt(const If* stmt) = 0;
+    virtual R visitImportStmt(const Import* stmt) = 0;
     virtual R visitPrintStmt(const Print* stmt) = 0;
     virtual R visitReturnStmt(const Return* stmt) = 0;
     virtual R visitVarStmt(const Var* stmt) = 0;
@@ -51,6 +54,18 @@ export struct Block : public Stmt {
 	void accept(StmtVisitor<void>* visitor) const override;
 };
 
+// A function body the parser skipped, to be parsed on the function's first call.
+export struct LazyBody {
+	std::shared_ptr<const std::string> source;
+	// The text between the braces, and the line it starts on.
+	size_t begin;
+	size_t end;
+	int line;
+	// What the resolver needs to rebuild the scopes around it.
+	bool method;
+	bool subclass;
+};
+
 export struct Function : public Stmt {
 	Token id;
 	const std::vector<Token> params;
@@ -59,8 +74,32 @@ export struct Function : public Stmt {
 	//cache for the gc
 	std::vector<Function*> fns_in_body;
 
+	// Set while the body is still unparsed.
+	std::unique_ptr<LazyBody> lazy;
+
+	// Set by the resolver if the body, or a function nested in it, assigns a
+	// variable declared outside the function, or changes an object it didn't
+	// make itself: sets a field or element, or passes it to a native that
+	// changes it. Calling a method, or a function passed in, sets it too.
+	bool changesOutside = false;
+
+	// Variables declared outside the function that the body, or a function
+	// nested in it, calls or passes on by name.
+	std::vector<std::string> callsOutside;
+
+	// The globals that made the objects the body changes as its own, which
+	// must still name a class or a native that returns a new array or map.
+	std::vector<std::string> creates;
+
+	// Counted while Stats::enabled.
+	size_t calls = 0;
+
 	Function(Token name, std::vector<Token> parameters, std::vector<Stmt*> fnBody);
 	~Function();
+
+	// Frees the body, leaving nested functions to the GC. The GC calls it on
+	// every function it is about to free first, while nested ones are still alive.
+	void deleteBody();
 	void accept(StmtVisitor<void>* visitor) const override;
 };
 
@@ -92,6 +131,17 @@ export struct If : public Stmt {
 	void accept(StmtVisitor<void>* visitor) const override;
 };
 
+// `import "path";` runs another file's top level once, in the global scope.
+export struct Import : public Stmt {
+	const Token keywrd;
+	const std::string path;
+	// Canonical path of the file, filled in relative to the importing one before it runs.
+	std::string resolved;
+
+	Import(Token keyword, std::string path);
+	void accept(StmtVisitor<void>* visitor) const override;
+};
+
 export struct Print : public Stmt {
 	const Expr* expr;
 
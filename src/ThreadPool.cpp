@@ -0,0 +1,170 @@
+module;
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <process.h>
+#else
+#include <pthread.h>
+#include <limits.h>
+#endif
+
+module ThreadPool;
+import ThreadPool;
+
+import <thread>;
+import <mutex>;
+import <functional>;
+import <memory>;
+import <algorithm>;
+import <stdexcept>;
+import <exception>;
+import <utility>;
+
+#ifdef _WIN32
+
+struct Thread::Native {
+	HANDLE handle = nullptr;
+};
+
+static unsigned __stdcall threadEntry(void* body) {
+	std::unique_ptr<std::function<void()>>((std::function<void()>*)body)->operator()();
+	return 0;
+}
+
+Thread::Thread(size_t stackSize, std::function<void()> body) : native{ std::make_unique<Native>() } {
+	auto owned = std::make_unique<std::function<void()>>(std::move(body));
+	native->handle = (HANDLE)_beginthreadex(nullptr, (unsigned)stackSize, threadEntry, owned.get(), STACK_SIZE_PARAM_IS_A_RESERVATION, nullptr);
+	if (!native->handle) throw std::runtime_error("Could not start a thread.");
+	owned.release();
+}
+
+void Thread::join() {
+	if (!native->handle) return;
+	WaitForSingleObject(native->handle, INFINITE);
+	CloseHandle(native->handle);
+	native->handle = nullptr;
+}
+
+void Thread::detach() {
+	if (!native->handle) return;
+	CloseHandle(native->handle);
+	native->handle = nullptr;
+}
+
+#else
+
+struct Thread::Native {
+	pthread_t thread;
+	bool joinable = false;
+};
+
+static void* threadEntry(void* body) {
+	std::unique_ptr<std::function<void()>>((std::function<void()>*)body)->operator()();
+	return nullptr;
+}
+
+Thread::Thread(size_t stackSize, std::function<void()> body) : native{ std::make_unique<Native>() } {
+	auto owned = std::make_unique<std::function<void()>>(std::move(body));
+	pthread_attr_t attributes;
+	pthread_attr_init(&attributes);
+	if (stackSize) pthread_attr_setstacksize(&attributes, std::max(stackSize, (size_t)PTHREAD_STACK_MIN));
+	int failed = pthread_create(&native->thread, &attributes, threadEntry, owned.get());
+	pthread_attr_destroy(&attributes);
+	if (failed) throw std::runtime_error("Could not start a thread.");
+	owned.release();
+	native->joinable = true;
+}
+
+void Thread::join() {
+	if (!native->joinable) return;
+	pthread_join(native->thread, nullptr);
+	native->joinable = false;
+}
+
+void Thread::detach() {
+	if (!native->joinable) return;
+	pthread_detach(native->thread);
+	native->joinable = false;
+}
+
+#endif
+
+Thread::~Thread() {
+	join();
+}
+
+ThreadPool::ThreadPool(unsigned threads, size_t stackSize) {
+	if (threads == 0) threads = 1;
+	workers.reserve(threads);
+	try {
+		for (unsigned i = 0; i < threads; i++) {
+			workers.push_back(std::make_unique<Thread>(stackSize, [this] { work(); }));
+		}
+	}
+	catch (...) {
+		//the destructor doesn't run, and the threads already started would wait for tasks forever
+		stop();
+		throw;
+	}
+}
+
+ThreadPool::~ThreadPool() {
+	stop();
+}
+
+void ThreadPool::stop() {
+	{
+		std::lock_guard lock{ mutex };
+		stopping = true;
+	}
+	available.notify_all();
+	for (auto& worker : workers) {
+		worker->join();
+	}
+}
+
+void ThreadPool::submit(std::function<void()> task) {
+	{
+		std::lock_guard lock{ mutex };
+		tasks.push_back(std::move(task));
+	}
+	available.notify_one();
+}
+
+void ThreadPool::wait() {
+	std::unique_lock lock{ mutex };
+	idle.wait(lock, [this] { return tasks.empty() && running == 0; });
+	if (failure) std::rethrow_exception(std::exchange(failure, nullptr));
+}
+
+void ThreadPool::work() {
+	while (true) {
+		std::function<void()> task;
+		{
+			std::unique_lock lock{ mutex };
+			available.wait(lock, [this] { return stopping || !tasks.empty(); });
+			if (tasks.empty()) return;
+
+			task = std::move(tasks.front());
+			tasks.pop_front();
+			running++;
+		}
+
+		std::exception_ptr failed;
+		try {
+			task();
+		}
+		catch (...) {
+			failed = std::current_exception();
+		}
+
+		{
+			std::lock_guard lock{ mutex };
+			if (failed && !failure) failure = failed;
+			running--;
+			if (tasks.empty() && running == 0) idle.notify_all();
+		}
+	}
+}
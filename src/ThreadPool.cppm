@@ -0,0 +1,63 @@
+export module ThreadPool;
+
+import <vector>;
+import <deque>;
+import <thread>;
+import <mutex>;
+import <condition_variable>;
+import <functional>;
+import <memory>;
+import <exception>;
+
+// A thread with a stack of the given size, which std::thread can't set.
+// Deep recursion in Lox needs more native stack than threads get by default.
+export class Thread {
+	struct Native;
+	std::unique_ptr<Native> native;
+
+public:
+	// A stackSize of 0 keeps the platform default.
+	Thread(size_t stackSize, std::function<void()> body);
+	~Thread();
+
+	Thread(const Thread&) = delete;
+	Thread& operator=(const Thread&) = delete;
+
+	void join();
+
+	// Lets the thread finish on its own. The body must not need the Thread any more.
+	void detach();
+};
+
+// Fixed set of worker threads taking tasks from one queue.
+export class ThreadPool {
+	std::vector<std::unique_ptr<Thread>> workers;
+	std::deque<std::function<void()>> tasks;
+
+	std::mutex mutex;
+	std::condition_variable available;
+	std::condition_variable idle;
+	size_t running = 0;
+	bool stopping = false;
+
+	//the first exception a task let out, for wait
+	std::exception_ptr failure;
+
+	void work();
+	void stop();
+
+public:
+	ThreadPool(unsigned threads = std::thread::hardware_concurrency(), size_t stackSize = 0);
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	void submit(std::function<void()> task);
+
+	// Blocks until the queue is empty and no task is running, then rethrows
+	// the first exception a task let out since the last wait.
+	void wait();
+
+	inline size_t size() const { return workers.size(); }
+};
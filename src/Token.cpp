@@ -14,6 +14,8 @@ std::string token_to_string(TokenType t) {
 		case RIGHT_PAREN: return "RIGHT_PAREN";
 		case LEFT_BRACE: return "LEFT_BRACE";
 		case RIGHT_BRACE: return "RIGHT_BRACE";
+		case LEFT_BRACKET: return "LEFT_BRACKET";
+		case RIGHT_BRACKET: return "RIGHT_BRACKET";
 		case COMMA: return "COMMA";
 		case DOT: return "DOT";
 		case MINUS: return "MINUS";
@@ -42,6 +44,7 @@ std::string token_to_string(TokenType t) {
 		case FUN: return "FUN";
 		case FOR: return "FOR";
 		case IF: return "IF";
+		case IMPORT: return "IMPORT";
 		case NIL: return "NIL";
 		case OR: return "OR";
 		case PRINT: return "PRINT";
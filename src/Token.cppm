@@ -10,6 +10,7 @@ export enum class TokenType
 {
 	// Single-character tokens.
 	LEFT_PAREN, RIGHT_PAREN, LEFT_BRACE, RIGHT_BRACE,
+	LEFT_BRACKET, RIGHT_BRACKET,
 	COMMA, DOT, MINUS, PLUS, SEMICOLON, SLASH, STAR,
 
 	// One or two character tokens.
@@ -22,7 +23,7 @@ export enum class TokenType
 	IDENTIFIER, STRING, NUMBER,
 
 	// Keywords.
-	AND, CLASS, ELSE, FALSE, FUN, FOR, IF, NIL, OR,
+	AND, CLASS, ELSE, FALSE, FUN, FOR, IF, IMPORT, NIL, OR,
 	PRINT, RETURN, SUPER, THIS, TRUE, VAR, WHILE,
 
 	Eof
@@ -33,6 +34,8 @@ export struct Token {
 	std::string lexeme;
 	Object literal;
 	int line;
+	// Where the token starts in the source, for tokens from the scanner.
+	int offset = 0;
 
 	Token(TokenType typ, std::string lex, double lit, int ln);
 	Token(TokenType typ, std::string lex, bool lit, int ln);
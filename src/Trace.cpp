@@ -0,0 +1,70 @@
+module Trace;
+import Trace;
+
+import <string>;
+import <string_view>;
+import <vector>;
+import <mutex>;
+import <atomic>;
+import <chrono>;
+import <cstdint>;
+import <fstream>;
+
+std::atomic<bool> Trace::recording = false;
+std::mutex Trace::mutex;
+std::vector<Trace::Event> Trace::events;
+std::chrono::steady_clock::time_point Trace::origin;
+int64_t Trace::callThreshold = -1;
+
+namespace {
+	// Small numbers for threads, in the order they first record something.
+	uint32_t traceThread() {
+		static std::atomic<uint32_t> next = 1;
+		static thread_local uint32_t id = next++;
+		return id;
+	}
+
+	void appendJsonString(std::string& out, std::string_view text) {
+		out += '"';
+		for (char c : text) {
+			if (c == '"' || c == '\\') out += '\\';
+			if ((unsigned char)c < 0x20) out += ' ';
+			else out += c;
+		}
+		out += '"';
+	}
+}
+
+void Trace::start(int64_t threshold) {
+	std::lock_guard lock{ mutex };
+	events.clear();
+	origin = std::chrono::steady_clock::now();
+	callThreshold = threshold;
+	recording = true;
+}
+
+void Trace::record(const char* category, std::string_view name, int64_t start, int64_t end) {
+	uint32_t thread = traceThread();
+	std::lock_guard lock{ mutex };
+	events.push_back(Event{ std::string(name), category, start, end - start, thread });
+}
+
+bool Trace::write(const std::string& path) {
+	std::string out = "{\"traceEvents\": [";
+	{
+		std::lock_guard lock{ mutex };
+		for (size_t i = 0; i < events.size(); i++) {
+			const Event& event = events[i];
+			out += i ? ",\n" : "\n";
+			out += "{\"name\": ";
+			appendJsonString(out, event.name);
+			out += ", \"cat\": \"" + std::string(event.category) + "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " + std::to_string(event.thread)
+				+ ", \"ts\": " + std::to_string(event.start) + ", \"dur\": " + std::to_string(event.duration) + "}";
+		}
+	}
+	out += "\n], \"displayTimeUnit\": \"ms\"}\n";
+
+	std::ofstream file{ path, std::ios::trunc };
+	file << out;
+	return (bool)file;
+}
@@ -0,0 +1,74 @@
+export module Trace;
+
+import <string>;
+import <string_view>;
+import <vector>;
+import <mutex>;
+import <atomic>;
+import <chrono>;
+import <cstdint>;
+
+// A timeline of what every thread spent its time on, written as Chrome
+// trace-event JSON for Perfetto or chrome://tracing. Nothing is recorded
+// unless start was called, and then a span costs two clock reads.
+export class Trace {
+	struct Event {
+		std::string name;
+		const char* category;
+		int64_t start;
+		int64_t duration;
+		uint32_t thread;
+	};
+
+	static std::atomic<bool> recording;
+	static std::mutex mutex;
+	static std::vector<Event> events;
+	static std::chrono::steady_clock::time_point origin;
+
+	static void record(const char* category, std::string_view name, int64_t start, int64_t end);
+
+public:
+	// Calls that take at least this many microseconds get a span of their
+	// own, or none do if it is negative.
+	static int64_t callThreshold;
+
+	static void start(int64_t callThreshold = -1);
+
+	// Writes the events recorded so far. Returns false if path can't be written.
+	static bool write(const std::string& path);
+
+	static inline bool on() {
+		return recording.load(std::memory_order_relaxed);
+	}
+
+	static inline int64_t now() {
+		return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - origin).count();
+	}
+
+	// Records the time from its construction to end(), or to its destruction.
+	// The name must outlive it.
+	class Span {
+		const char* category;
+		std::string_view name;
+		int64_t begin = -1;
+		int64_t minimum;
+
+	public:
+		Span(const char* category, std::string_view name, int64_t minimum = 0)
+			: category{ category }, name{ name }, minimum{ minimum } {
+			if (on() && minimum >= 0) begin = now();
+		}
+
+		~Span() { end(); }
+
+		Span(const Span&) = delete;
+		Span& operator=(const Span&) = delete;
+
+		void end() {
+			if (begin < 0) return;
+			int64_t finish = now();
+			if (finish - begin >= minimum) record(category, name, begin, finish);
+			begin = -1;
+		}
+	};
+};
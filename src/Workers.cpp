@@ -0,0 +1,456 @@
+module Workers;
+import Workers;
+
+import <string>;
+import <vector>;
+import <deque>;
+import <mutex>;
+import <condition_variable>;
+import <memory>;
+import <sstream>;
+import <utility>;
+import <atomic>;
+import <thread>;
+import <algorithm>;
+import <unordered_set>;
+import <unordered_map>;
+import <new>;
+import <exception>;
+
+import Object;
+import Interpreter;
+import ThreadPool;
+import GC;
+import Error;
+import Lox;
+import Snapshot;
+import Memory;
+import Stats;
+
+namespace {
+	// Workers still running and the channels that exist, for finishWorkers.
+	struct Registry {
+		std::mutex mutex;
+		std::condition_variable finished;
+		size_t workers = 0;
+		std::unordered_set<Channel*> channels;
+		bool closing = false;
+	};
+
+	//never destroyed, as a worker may still be leaving it while the process exits
+	Registry& registry() {
+		static Registry* instance = new Registry();
+		return *instance;
+	}
+}
+
+Channel::Channel() {
+	Registry& all = registry();
+	std::lock_guard lock{ all.mutex };
+	all.channels.insert(this);
+	closed = all.closing;
+}
+
+Channel::~Channel() {
+	Registry& all = registry();
+	std::lock_guard lock{ all.mutex };
+	all.channels.erase(this);
+}
+
+void Channel::close() {
+	{
+		std::lock_guard lock{ mutex };
+		closed = true;
+	}
+	available.notify_all();
+}
+
+void finishWorkers() {
+	Registry& all = registry();
+	std::unique_lock lock{ all.mutex };
+	all.closing = true;
+	for (Channel* channel : all.channels) {
+		channel->close();
+	}
+	all.finished.wait(lock, [&] { return all.workers == 0; });
+}
+
+void Channel::send(Message message) {
+	{
+		std::lock_guard lock{ mutex };
+		messages.push_back(std::move(message));
+	}
+	available.notify_one();
+}
+
+Message Channel::receive() {
+	std::unique_lock lock{ mutex };
+	available.wait(lock, [this] { return !messages.empty() || closed; });
+	if (messages.empty()) throw NativeError("Channel closed.");
+	Message message = std::move(messages.front());
+	messages.pop_front();
+	return message;
+}
+
+LoxChannel::LoxChannel(std::shared_ptr<Channel> channel) : channel{ std::move(channel) } {}
+
+int LoxChannel::arity() const {
+	return 0;
+}
+
+Object LoxChannel::call(Interpreter& interpreter, CallParams arguments) {
+	return Snapshot::unpack(channel->receive(), interpreter, interpreter.gc)[0];
+}
+
+std::string LoxChannel::toString() const {
+	return "<channel>";
+}
+
+LoxWorker::LoxWorker(Interpreter& interpreter, Message call) : outcome{ std::make_shared<Outcome>() } {
+	size_t maxDepth = interpreter.maxDepth;
+	NumberFormat numbers = interpreter.out.numbers;
+	size_t memoryLimit = interpreter.gc.memory->limit;
+	Registry& all = registry();
+	{
+		std::lock_guard lock{ all.mutex };
+		all.workers++;
+	}
+	auto finished = [&all] {
+		std::lock_guard lock{ all.mutex };
+		all.workers--;
+		all.finished.notify_all();
+	};
+
+	try {
+		thread = std::make_unique<Thread>(Lox::stackSizeFor(maxDepth), [outcome = outcome, call = std::move(call), maxDepth, numbers, memoryLimit, finished]() mutable {
+			//what the worker holds goes before it counts as finished, as its channels unregister themselves
+			{
+				std::shared_ptr<Outcome> result = std::move(outcome);
+				Message message = std::move(call);
+				work(*result, message, maxDepth, numbers, memoryLimit);
+			}
+			finished();
+		});
+	}
+	catch (...) {
+		finished();
+		throw;
+	}
+}
+
+LoxWorker::~LoxWorker() {
+	thread->detach();
+}
+
+void LoxWorker::work(Outcome& outcome, const Message& call, size_t maxDepth, NumberFormat numbers, size_t memoryLimit) {
+	std::ostringstream out, err;
+	{
+		Lox lox = Lox(out, err, maxDepth, numbers);
+		lox.gc.memory->limit = memoryLimit;
+		UseBudget use{ *lox.gc.memory };
+		Stats::Use counting{ lox.gc.counts };
+		try {
+			std::vector<Object> values = Snapshot::unpack(call, lox.interpreter, lox.gc);
+			for (const Object& value : values) lox.pin(value);
+			Object returned = lox.call(values[0], CallParams{ values.data() + 1, values.size() - 1 });
+			outcome.result = Snapshot::pack({ &returned, 1 }, lox.interpreter);
+		}
+		catch (Error::RuntimeError& error) {
+			lox.output.flush();
+			lox.reporter.runtimeError(error);
+			outcome.failed = true;
+		}
+		catch (NativeError& error) {
+			lox.output.flush();
+			err << error.message << "\n";
+			outcome.failed = true;
+		}
+		catch (std::bad_alloc&) {
+			lox.interpreter.reportOutOfMemory();
+			outcome.failed = true;
+		}
+	}
+	outcome.output = out.str();
+	outcome.errors = err.str();
+}
+
+int LoxWorker::arity() const {
+	return 0;
+}
+
+Object LoxWorker::call(Interpreter& interpreter, CallParams arguments) {
+	thread->join();
+
+	//what the worker printed shows up once, where it is first joined
+	if (!reported) {
+		reported = true;
+		interpreter.out.write(outcome->output);
+		if (!outcome->errors.empty()) {
+			interpreter.out.flush();
+			interpreter.reporter.err << outcome->errors;
+		}
+	}
+
+	if (outcome->failed) throw NativeError("Worker failed.");
+	return Snapshot::unpack(outcome->result, interpreter, interpreter.gc)[0];
+}
+
+std::string LoxWorker::toString() const {
+	return "<worker>";
+}
+
+namespace {
+	// Enough chunks per thread that one slow chunk doesn't hold up the rest.
+	constexpr size_t chunksPerThread = 8;
+
+	struct Chunk {
+		size_t begin = 0;
+		size_t end = 0;
+		Message input;
+		Message output;
+		std::string printed;
+		std::string errors;
+		bool failed = false;
+	};
+
+	// One parallel call. The calling thread and the pool's threads take its
+	// chunks in turn, and it lasts until the last of them lets go of it.
+	struct Job {
+		Message function;
+		std::vector<Chunk> chunks;
+		std::atomic<size_t> next = 0;
+		std::atomic<size_t> firstFailed = 0;
+		bool reduce = false;
+		size_t maxDepth = 0;
+		NumberFormat numbers = NumberFormat::SHORTEST;
+		size_t memoryLimit = 0;
+
+		//pool threads still taking chunks, and whether the caller stopped waiting for more
+		std::mutex mutex;
+		std::condition_variable finished;
+		size_t helping = 0;
+		bool closed = false;
+	};
+
+	// An interpreter a thread keeps for running chunks, so parallel calls
+	// don't each start one per thread. A function mapped in parallel may map
+	// in parallel itself, so a thread can need more than one at a time.
+	struct Helper {
+		std::ostringstream out, err;
+		Lox lox;
+		bool busy = false;
+
+		Helper(size_t maxDepth, NumberFormat numbers) : lox{ out, err, maxDepth, numbers } { }
+	};
+
+	struct Busy {
+		Helper& helper;
+
+		Busy(Helper& helper) : helper{ helper } { helper.busy = true; }
+		~Busy() { helper.busy = false; }
+	};
+
+	Helper& helperFor(size_t maxDepth, NumberFormat numbers) {
+		static thread_local std::vector<std::unique_ptr<Helper>> helpers;
+		for (auto& helper : helpers) {
+			if (!helper->busy && helper->lox.interpreter.maxDepth == maxDepth && helper->lox.output.numbers == numbers) return *helper;
+		}
+		helpers.push_back(std::make_unique<Helper>(maxDepth, numbers));
+		return *helpers.back();
+	}
+
+	// The pool whose threads have stackSize bytes of stack. Pools are never
+	// destroyed, their idle threads wait until the process exits.
+	ThreadPool& poolFor(size_t stackSize) {
+		static std::mutex mutex;
+		static auto& pools = *new std::unordered_map<size_t, std::unique_ptr<ThreadPool>>();
+		std::lock_guard lock{ mutex };
+		std::unique_ptr<ThreadPool>& pool = pools[stackSize];
+		if (!pool) pool = std::make_unique<ThreadPool>(std::max(1u, std::thread::hardware_concurrency()), stackSize);
+		return *pool;
+	}
+
+	// Holds an object across calls into the helper, which may collect.
+	struct Held {
+		Lox& lox;
+		Object value;
+
+		Held(Lox& lox, Object value) : lox{ lox }, value{ value } { lox.pin(value); }
+		~Held() { lox.unpin(value); }
+	};
+
+	void applyChunks(Job& job) {
+		//chunks after one that failed are skipped, as their output is never shown
+		if (job.next >= std::min(job.chunks.size(), job.firstFailed.load())) return;
+
+		Helper& helper = helperFor(job.maxDepth, job.numbers);
+		Busy busy{ helper };
+		Lox& lox = helper.lox;
+		std::ostringstream& out = helper.out;
+		std::ostringstream& err = helper.err;
+		lox.gc.memory->limit = job.memoryLimit;
+		UseBudget use{ *lox.gc.memory };
+		Stats::Use counting{ lox.gc.counts };
+		Object fn;
+		try {
+			fn = Snapshot::unpack(job.function, lox.interpreter, lox.gc)[0];
+		}
+		catch (NativeError& error) {
+			err << error.message << "\n";
+		}
+		catch (std::bad_alloc&) {
+			err << "Out of memory.\n";
+		}
+		Held heldFn{ lox, fn };
+
+		for (size_t i = job.next++; i < job.chunks.size() && i < job.firstFailed; i = job.next++) {
+			Chunk& chunk = job.chunks[i];
+			try {
+				if (fn.isNil()) throw NativeError("Could not unpack the function.");
+
+				LoxArray* elements = lox.gc.track(new LoxArray());
+				Held heldElements{ lox, Object(elements) };
+				for (const Object& element : Snapshot::unpack(chunk.input, lox.interpreter, lox.gc)) {
+					elements->push(element);
+				}
+
+				Object result;
+				if (job.reduce) {
+					result = elements->get(0);
+					for (size_t j = 1; j < elements->size(); j++) {
+						Object args[] = { result, elements->get(j) };
+						result = lox.call(fn, CallParams{ args, 2 });
+					}
+				}
+				else {
+					LoxArray* results = lox.gc.track(new LoxArray());
+					Held heldResults{ lox, Object(results) };
+					for (size_t j = 0; j < elements->size(); j++) {
+						Object element = elements->get(j);
+						results->push(lox.call(fn, CallParams{ &element, 1 }));
+					}
+					result = Object(results);
+				}
+				chunk.output = Snapshot::pack({ &result, 1 }, lox.interpreter);
+			}
+			catch (Error::RuntimeError& error) {
+				lox.output.flush();
+				lox.reporter.runtimeError(error);
+				chunk.failed = true;
+			}
+			catch (NativeError& error) {
+				lox.output.flush();
+				err << error.message << "\n";
+				chunk.failed = true;
+			}
+			catch (std::bad_alloc&) {
+				lox.interpreter.reportOutOfMemory();
+				chunk.failed = true;
+			}
+			catch (std::exception& error) {
+				//the pool would swallow it, leaving the chunk without a result
+				lox.output.flush();
+				err << error.what() << "\n";
+				chunk.failed = true;
+			}
+			for (size_t failed = job.firstFailed; chunk.failed && i < failed;) {
+				job.firstFailed.compare_exchange_weak(failed, i);
+			}
+
+			lox.output.flush();
+			chunk.printed = out.str();
+			chunk.errors = err.str();
+			out.str("");
+			err.str("");
+		}
+		out.str("");
+		err.str("");
+		lox.reporter.hadRuntimeError = false;
+	}
+
+	// What a pool thread does for a job, unless the caller has finished it already.
+	void help(Job& job) {
+		{
+			std::lock_guard lock{ job.mutex };
+			if (job.closed) return;
+			job.helping++;
+		}
+		struct Done {
+			Job& job;
+			~Done() {
+				std::lock_guard lock{ job.mutex };
+				if (--job.helping == 0) job.finished.notify_all();
+			}
+		} done{ job };
+		applyChunks(job);
+	}
+
+	// Lets the caller return once no pool thread is in the job any more.
+	struct Close {
+		Job& job;
+
+		~Close() {
+			std::unique_lock lock{ job.mutex };
+			job.closed = true;
+			job.finished.wait(lock, [this] { return job.helping == 0; });
+		}
+	};
+}
+
+LoxArray* mapInParallel(Interpreter& interpreter, const Object& fn, const LoxArray* array, bool reduce) {
+	auto job = std::make_shared<Job>();
+	job->function = Snapshot::pack({ &fn, 1 }, interpreter);
+	job->reduce = reduce;
+	job->maxDepth = interpreter.maxDepth;
+	job->numbers = interpreter.out.numbers;
+	job->memoryLimit = interpreter.gc.memory->limit;
+
+	ThreadPool& pool = poolFor(Lox::stackSizeFor(interpreter.maxDepth));
+	std::vector<Chunk>& chunks = job->chunks;
+	chunks.resize(std::min(array->size(), (pool.size() + 1) * chunksPerThread));
+	job->firstFailed = chunks.size();
+	for (size_t i = 0; i < chunks.size(); i++) {
+		Chunk& chunk = chunks[i];
+		chunk.begin = array->size() * i / chunks.size();
+		chunk.end = array->size() * (i + 1) / chunks.size();
+
+		std::vector<Object> elements;
+		for (size_t j = chunk.begin; j < chunk.end; j++) {
+			elements.push_back(array->get(j));
+		}
+		chunk.input = Snapshot::pack(elements, interpreter);
+	}
+
+	if (!chunks.empty()) {
+		//the caller takes chunks too, so a parallel call inside one running
+		//on the pool still gets done when every pool thread is busy
+		for (size_t i = 0; i < std::min(pool.size(), chunks.size() - 1); i++) {
+			pool.submit([job] { help(*job); });
+		}
+		Close close{ *job };
+		applyChunks(*job);
+	}
+
+	//output comes out in the order of the elements, up to the first that failed.
+	//nothing points at the results until they are returned
+	GC::Pause pause{ interpreter.gc };
+	LoxArray* results = interpreter.gc.track(new LoxArray());
+	for (const Chunk& chunk : chunks) {
+		interpreter.out.write(chunk.printed);
+		if (!chunk.errors.empty()) {
+			interpreter.out.flush();
+			interpreter.reporter.err << chunk.errors;
+		}
+		if (chunk.failed) throw NativeError("Parallel call failed.");
+
+		Object result = Snapshot::unpack(chunk.output, interpreter, interpreter.gc)[0];
+		if (reduce) results->push(result);
+		else {
+			const LoxArray* values = result.getArrayPtr();
+			for (size_t i = 0; i < values->size(); i++) {
+				results->push(values->get(i));
+			}
+		}
+	}
+	return results;
+}
@@ -0,0 +1,104 @@
+export module Workers;
+
+import <string>;
+import <vector>;
+import <deque>;
+import <mutex>;
+import <condition_variable>;
+import <memory>;
+
+import Object;
+import Interpreter;
+import ThreadPool;
+
+export class Channel;
+
+// Values on their way from one heap to another, packed by Snapshot::pack.
+// The channels among them are shared rather than copied.
+export struct Message {
+	std::string bytes;
+	std::vector<std::shared_ptr<Channel>> channels;
+};
+
+// A queue of messages that any thread may send to and receive from.
+export class Channel {
+	std::mutex mutex;
+	std::condition_variable available;
+	std::deque<Message> messages;
+	bool closed = false;
+
+public:
+	Channel();
+	~Channel();
+
+	Channel(const Channel&) = delete;
+	Channel& operator=(const Channel&) = delete;
+
+	void send(Message message);
+
+	// Waits until a message is queued. Throws a NativeError once the channel
+	// is closed and empty.
+	Message receive();
+
+	// Wakes whoever waits on the channel for good.
+	void close();
+};
+
+// A channel as one heap sees it. Calling it receives the next value, waiting
+// for one if none has been sent yet.
+export class LoxChannel : public LoxCallable {
+public:
+	const std::shared_ptr<Channel> channel;
+
+	LoxChannel(std::shared_ptr<Channel> channel);
+
+	int arity() const override;
+	Object call(Interpreter& interpreter, CallParams arguments) override;
+	std::string toString() const override;
+};
+
+// A Lox function running on a thread of its own, in a fresh interpreter with
+// its own heap and globals, under the same memory limit. Calling the worker waits for the function to
+// return and gives back a copy of its result. finishWorkers waits for the
+// workers that are never joined.
+export class LoxWorker : public LoxCallable {
+	// Written by the worker's thread, and only read once it has been joined.
+	struct Outcome {
+		Message result;
+		std::string output;
+		std::string errors;
+		bool failed = false;
+	};
+
+	std::shared_ptr<Outcome> outcome;
+	std::unique_ptr<Thread> thread;
+	bool reported = false;
+
+	static void work(Outcome& outcome, const Message& call, size_t maxDepth, NumberFormat numbers, size_t memoryLimit);
+
+public:
+	// `call` holds the function followed by its arguments.
+	LoxWorker(Interpreter& interpreter, Message call);
+
+	// A worker that is never joined is left to finish on its own, as it may
+	// be waiting on a channel nobody sends to any more.
+	~LoxWorker();
+
+	int arity() const override;
+	Object call(Interpreter& interpreter, CallParams arguments) override;
+	std::string toString() const override;
+};
+
+// Closes every channel, now and as they are created, so that workers
+// waiting on one give up, and waits until every worker has finished. Call
+// it before the process exits, as workers still running would use the
+// trace and module registry while they are destroyed.
+export void finishWorkers();
+
+// Calls fn on every element of array, spread over the calling thread and
+// a pool kept for the process, which take chunks of the array until none
+// are left. Each thread runs them in an interpreter and heap of its own,
+// under the same memory limit, and keeps it for the next call. With `reduce`, fn folds each chunk into one
+// value instead, which must not matter if fn is associative. Returns a new
+// array of the results, or of one value per chunk, in order.
+export LoxArray* mapInParallel(Interpreter& interpreter, const Object& fn, const LoxArray* array, bool reduce);
@@ -1,76 +1,181 @@
 
-
 import <iostream>;
-import <fstream>;
 import <sstream>;
+import <string>;
 import <vector>;
-
-import Scanner;
-import Parser;
-import Resolver;
+import <chrono>;
+import <algorithm>;
+import <cstdint>;
+import <climits>;
+import <charconv>;
+import <system_error>;
+import <exception>;
+
+import Lox;
 import Interpreter;
-import GC;
-import Token;
-import Error;
-
-void run(std::string source, Interpreter& interpreter, GC& gc) {
-	Scanner scanner = Scanner(source);
-	auto tokens = scanner.scanTokens();
-
-	Parser parser = Parser(tokens);
-	ParseResult parseResult = parser.parse();
-
-	if (Error::hadError) return;
+import ThreadPool;
+import Object;
+import Trace;
+import Workers;
+
+// Runs every script in its own interpreter on a pool of threads. Output is
+// buffered per script and printed in order. With repeat > 1 the scripts are
+// run that many times each and only the throughput is reported.
+int runParallel(const RunOptions& base, const std::vector<std::string>& scripts, unsigned jobs, int repeat, size_t maxDepth, NumberFormat numbers) {
+	std::vector<std::string> queue;
+	for (int r = 0; r < repeat; r++) {
+		queue.insert(queue.end(), scripts.begin(), scripts.end());
+	}
 
-	Resolver resolver = Resolver(interpreter, gc);
-	resolver.resolve(parseResult.stmts);
+	std::vector<std::ostringstream> outs(queue.size());
+	std::vector<std::ostringstream> errs(queue.size());
+	std::vector<int> codes(queue.size());
+
+	auto start = std::chrono::steady_clock::now();
+	{
+		ThreadPool pool = ThreadPool(jobs, Lox::stackSizeFor(maxDepth));
+		for (size_t i = 0; i < queue.size(); i++) {
+			pool.submit([&, i] {
+				RunOptions options = base;
+				options.script = queue[i];
+				try {
+					Lox lox = Lox(outs[i], errs[i], maxDepth, numbers);
+					codes[i] = lox.runFile(options);
+				}
+				catch (std::exception& error) {
+					//e.g. a coroutine stack that couldn't be mapped, which fails this script only
+					errs[i] << error.what() << "\n";
+					codes[i] = 70;
+				}
+			});
+		}
+		pool.wait();
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
 
-	// Stop if there was a syntax error.
-	if (!Error::hadError) {
-		interpreter.interpret(parseResult.stmts);
+	int exitCode = 0;
+	for (size_t i = 0; i < queue.size(); i++) {
+		if (repeat == 1) std::cout << outs[i].str();
+		std::cerr << errs[i].str();
+		exitCode = std::max(exitCode, codes[i]);
 	}
 
+	if (repeat > 1) {
+		std::cerr << queue.size() << " runs on " << jobs << " threads in " << elapsed.count() * 1000 << " ms ("
+			<< queue.size() / elapsed.count() << " runs/s)\n";
+	}
+	return exitCode;
 }
 
-int runFile(std::string path, Interpreter& interpreter, GC& gc) {
-	std::ifstream input{path};
-	if (!input) return 69;
-	std::stringstream buffer;
-	buffer << input.rdbuf();
-	run(buffer.str(), interpreter, gc);
-
-	if (Error::hadError) return 65;
-	if (Error::hadRuntimeError) return 70;
-	return 0;
+int usage() {
+	std::cout << "Usage: cpplox [--no-cache] [--snapshot=file] [--jobs=n] [--repeat=n] [--max-depth=n] [--compat-output] [--stream] [--lazy] [--stats] [--heap-profile=file] [--memory-limit=mb] [--trace=file] [--trace-calls=us] [script...]\n";
+	return 64;
 }
 
-void runPrompt(Interpreter& interpreter, GC& gc) {
-	while (true) {
-		std::cout << "> ";
-
-		std::string line;
-		getline(std::cin, line);
-
-		if (line.empty()) break;
-		run(line, interpreter, gc);
-		Error::hadError = false;
-	}
+// Reads the whole number after `prefix` in `arg`, which must lie in [least, most].
+bool numberOption(const std::string& arg, const std::string& prefix, int64_t least, int64_t most, int64_t& value) {
+	const char* end = arg.data() + arg.size();
+	auto [last, error] = std::from_chars(arg.data() + prefix.size(), end, value);
+	return error == std::errc() && last == end && value >= least && value <= most;
 }
 
 int main(int argc, char* argv[]) {
-	GC gc = GC();
-	Interpreter interpreter = Interpreter(gc);
+	RunOptions options;
+	std::vector<std::string> scripts;
+	unsigned jobs = 1;
+	int repeat = 1;
+	size_t maxDepth = Interpreter::defaultMaxDepth;
+	NumberFormat numbers = NumberFormat::SHORTEST;
+	std::string tracePath;
+	int64_t callThreshold = -1;
+	int64_t number = 0;
+
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (arg == "--no-cache") {
+			options.useCache = false;
+		}
+		else if (arg.starts_with("--snapshot=")) {
+			options.snapshotPath = arg.substr(std::string("--snapshot=").size());
+		}
+		else if (arg.starts_with("--jobs=")) {
+			if (!numberOption(arg, "--jobs=", 1, INT_MAX, number)) return usage();
+			jobs = (unsigned)number;
+		}
+		else if (arg.starts_with("--repeat=")) {
+			if (!numberOption(arg, "--repeat=", 1, INT_MAX, number)) return usage();
+			repeat = (int)number;
+		}
+		else if (arg.starts_with("--max-depth=")) {
+			if (!numberOption(arg, "--max-depth=", 1, INT_MAX, number)) return usage();
+			maxDepth = (size_t)number;
+		}
+		else if (arg == "--stream") {
+			options.stream = true;
+		}
+		else if (arg == "--lazy") {
+			options.lazy = true;
+		}
+		else if (arg == "--stats") {
+			options.stats = true;
+		}
+		else if (arg.starts_with("--heap-profile=")) {
+			options.heapProfilePath = arg.substr(std::string("--heap-profile=").size());
+		}
+		else if (arg.starts_with("--memory-limit=")) {
+			if (!numberOption(arg, "--memory-limit=", 1, (int64_t)(SIZE_MAX >> 20), number)) return usage();
+			options.memoryLimit = (size_t)number << 20;
+		}
+		else if (arg.starts_with("--trace=")) {
+			tracePath = arg.substr(std::string("--trace=").size());
+		}
+		else if (arg.starts_with("--trace-calls=")) {
+			//0 records every call
+			if (!numberOption(arg, "--trace-calls=", 0, INT_MAX, callThreshold)) return usage();
+		}
+		else if (arg == "--compat-output") {
+			numbers = NumberFormat::COMPAT;
+		}
+		else if (arg.starts_with("--")) {
+			return usage();
+		}
+		else {
+			scripts.push_back(arg);
+		}
+	}
 
-	if (argc > 2) {
-		std::cout << "Usage: cpplox [script]\n";
-		return 64;
+	bool parallel = scripts.size() > 1 || jobs > 1 || repeat > 1;
+	if (parallel && scripts.empty()) {
+		return usage();
 	}
-	else if (argc == 2) {
-		return runFile(argv[1], interpreter, gc);
+
+	if (!tracePath.empty()) Trace::start(callThreshold);
+
+	int exitCode = 0;
+	if (parallel) {
+		exitCode = runParallel(options, scripts, jobs, repeat, maxDepth, numbers);
 	}
 	else {
-		runPrompt(interpreter, gc);
+		//the main thread's stack is too small for deep recursion
+		Thread(Lox::stackSizeFor(maxDepth), [&] {
+			if (!scripts.empty()) {
+				//file descriptor 1 is standard output
+				Lox lox = Lox(1, std::cerr, maxDepth, numbers);
+				options.script = scripts[0];
+				exitCode = lox.runFile(options);
+			}
+			else {
+				//the prompt goes through std::cout, so the output must too
+				Lox lox = Lox(std::cout, std::cerr, maxDepth, numbers);
+				lox.runPrompt();
+			}
+		}).join();
+	}
+
+	//workers that were never joined finish before the trace is written and statics go
+	finishWorkers();
+	if (!tracePath.empty() && !Trace::write(tracePath)) {
+		std::cerr << "Could not write trace '" << tracePath << "'.\n";
 	}
-	
-	gc.deleteAll();
+	return exitCode;
 }